@@ -14,6 +14,14 @@ struct alarm_block {
 	void			(*function)(struct alarm_block *a, void *data);
 };
 
+enum alarm_type {
+	ALARM_T_RBTREE = 0,	/* red-black tree, default */
+	ALARM_T_WHEEL,		/* hashed timing wheel */
+	ALARM_T_MAX
+};
+
+int alarm_set_type(enum alarm_type type);
+
 void init_alarm(struct alarm_block *t,
 		void *data,
 		void (*fcn)(struct alarm_block *a, void *data));
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include "hash.h"
 #include "date.h"
+#include "slab.h"
+#include "alarm.h"
 
 /* cache features */
 enum {
@@ -13,6 +15,9 @@ enum {
 	TIMER_FEATURE = 0,
 	TIMER = (1 << TIMER_FEATURE),
 
+	PERSIST_FEATURE = 1,
+	PERSIST = (1 << PERSIST_FEATURE),
+
 	__CACHE_MAX_FEATURE
 };
 #define CACHE_MAX_FEATURE __CACHE_MAX_FEATURE
@@ -25,13 +30,78 @@ enum {
 	C_OBJ_MAX
 };
 
+/* attributes that changed in the last update, see cache_object->dirty. */
+enum {
+	CACHE_A_STATUS = 0,
+	CACHE_A_PROTOINFO,	/* protocol state, TCP flags and window scale */
+	CACHE_A_TIMEOUT,
+	CACHE_A_MARK,
+	CACHE_A_NATSEQ,
+	CACHE_A_HELPER,
+	CACHE_A_OTHER,		/* anything else, ie. secmark or labels */
+	CACHE_A_MAX
+};
+#define CACHE_A_ALL	((1 << CACHE_A_MAX) - 1)
+
+/* objects that go first when the cache is full, see cache_evict(). */
+enum {
+	CACHE_EVICT_HALFOPEN = 0,	/* TCP handshake not completed */
+	CACHE_EVICT_UNASSURED,		/* not assured yet */
+	CACHE_EVICT_IDLE,		/* least recently updated */
+	CACHE_EVICT_MAX
+};
+
+/*
+ * Packed lookup key of a cached object: the original tuple plus the zone
+ * and the conntrack ID. It is extracted once from the object and hashing
+ * and comparison are done over it, without calling the library getters.
+ * IPv4 addresses are stored in the first word of src and dst.
+ */
+struct cache_key {
+	uint32_t	src[4];
+	uint32_t	dst[4];
+	uint16_t	sport;		/* ICMP: id */
+	uint16_t	dport;		/* ICMP: type << 8 | code */
+	uint8_t		l3proto;
+	uint8_t		l4proto;
+	uint16_t	zone;
+	uint32_t	id;
+};
+
+/* secondary indexes of the conntrack caches. */
+enum cache_index_type {
+	CACHE_INDEX_MARK = 0,
+	CACHE_INDEX_ZONE,
+	CACHE_INDEX_SOURCE,
+	CACHE_INDEX_MAX
+};
+
+/* key of a secondary index: mark and zone are stored in value[0], the
+ * source prefix keeps the masked address and its family. */
+struct cache_index_key {
+	uint32_t	family;
+	uint32_t	value[4];
+};
+
+/* sent after the CT_*_INDEX requests through the UNIX socket. */
+struct cache_index_query {
+	uint32_t		type;
+	struct cache_index_key	key;
+};
+
 struct cache;
 struct cache_object {
 	struct	hashtable_node hashnode;
+	struct	cache_key key;
 	void	*ptr;
 	struct	cache *cache;
 	int	status;
 	int	refcnt;
+	uint32_t epoch;		/* cache epoch when added or last changed */
+	uint32_t seen;		/* generation when last added or updated */
+	uint32_t dirty;		/* CACHE_A_* bits changed by the last update */
+	uint8_t	evict;		/* CACHE_EVICT_* class */
+	uint8_t	clock;		/* updated since the eviction hand passed */
 	long	lifetime;
 	long	lastupdate;
 	char	data[0];
@@ -46,6 +116,7 @@ struct cache_feature {
 };
 
 extern struct cache_feature timer_feature;
+extern struct cache_feature persist_feature;
 
 #define CACHE_MAX_NAMELEN 32
 
@@ -70,6 +141,40 @@ struct cache {
 	unsigned int extra_offset;
 	size_t object_size;
 
+	/* secondary indexes, by type, NULL if not enabled. */
+	struct cache_index *index[CACHE_INDEX_MAX];
+	unsigned int index_num;
+	unsigned int index_offset;
+
+	/* memory budget, 0 if objects are never evicted. */
+	size_t memory;
+	size_t memory_limit;
+	uint32_t evict_cursor;
+
+	/* bumped before a full resync, see cache_object_stale() */
+	uint32_t generation;
+
+	/* removal of the stale objects in progress, see cache_sweep() */
+	struct alarm_block sweep_alarm;
+	uint32_t sweep_cursor;
+	int (*sweep)(void *data1, void *data2);
+
+	/* backing file, see cache_file.c */
+	struct cache_file *file;
+
+	/* dumps in progress, see cache_dump_async() */
+	uint32_t epoch;
+	struct list_head snapshots;
+
+	/* object allocator and recycled payloads, see cache_object_new() */
+	struct slab *slab;
+	struct {
+		void		**ptr;
+		unsigned int	num;
+		unsigned int	max;
+		uint32_t	reused;
+	} payload;
+
         /* statistics */
 	struct {
 		uint32_t	active;
@@ -86,6 +191,11 @@ struct cache {
 		uint32_t	add_fail_enospc;
 		uint32_t	del_fail_enoent;
 		uint32_t	upd_fail_enoent;
+		uint32_t	upd_noop;
+		uint32_t	upd_attr[CACHE_A_MAX];
+
+		uint32_t	evict[CACHE_EVICT_MAX];
+		uint32_t	evict_fail;
 
 		uint32_t	commit_ok;
 		uint32_t	commit_fail;
@@ -108,14 +218,40 @@ struct nfct_handle;
 
 /* cache options depends on the object type: conntrack or expectation. */
 struct cache_ops {
-	/* hashing and comparison of objects. */
+	/* hashing and comparison of objects. If key is set, both work on
+	 * the struct cache_key that it extracts from the object. */
+	void (*key)(struct cache_key *key, const void *ptr);
 	uint32_t (*hash)(const void *data, const struct hashtable *table);
 	int (*cmp)(const void *data1, const void *data2);
 
-	/* object allocation, copy and release. */
+	/* object allocation, copy and release. If reuse is set and returns
+	 * true, the released object is kept for the next allocation. Copy
+	 * returns the destination, which may have been reallocated, or NULL
+	 * on failure, in which case the destination is left untouched. */
 	void *(*alloc)(void);
-	void (*copy)(void *dst, void *src, unsigned int flags);
+	void *(*copy)(void *dst, void *src, unsigned int flags);
 	void (*free)(void *ptr);
+	int (*reuse)(const void *ptr);
+
+	/* bytes used by the payload, for the memory budget. */
+	size_t (*size)(const void *ptr);
+
+	/* CACHE_EVICT_* class of the object that is being added or
+	 * updated. Returns -1 if ptr does not tell. */
+	int (*evict)(const void *ptr);
+
+	/* CACHE_A_* bits of the attributes set in the update that differ
+	 * from the cached object. Unset attributes are kept by the update,
+	 * so they are not reported. If NULL, updates change everything. */
+	uint32_t (*diff)(const void *old, const void *update);
+
+	/* library object of payloads that are stored in another format. */
+	void *(*decode)(const struct cache_object *obj);
+
+	/* key of this object in a secondary index, ptr is the object that
+	 * is being added or updated. Returns -1 if ptr does not tell. */
+	int (*index)(int type, const struct cache_object *obj,
+		     const void *ptr, struct cache_index_key *key);
 
 	/* dump and commit. */
 	int (*dump_step)(void *data1, void *n);
@@ -127,6 +263,7 @@ struct cache_ops {
 
 /* templates to configure conntrack caching. */
 extern struct cache_ops cache_sync_internal_ct_ops;
+extern struct cache_ops cache_sync_internal_wire_ct_ops;
 extern struct cache_ops cache_sync_external_ct_ops;
 extern struct cache_ops cache_stats_ct_ops;
 /* templates to configure expectation caching. */
@@ -135,35 +272,71 @@ extern struct cache_ops cache_sync_external_exp_ops;
 
 struct nf_conntrack;
 
+void cache_ct_key(struct cache_key *key, const struct nf_conntrack *ct);
+struct nethdr *cache_ct_key_build_msg(const struct cache_key *key, int type);
+
 struct cache *cache_create(const char *name, enum cache_type type, unsigned int features, struct cache_extra *extra, struct cache_ops *ops);
 void cache_destroy(struct cache *e);
 
 struct cache_object *cache_object_new(struct cache *c, void *ptr);
+struct cache_object *cache_object_new_key(struct cache *c, void *ptr, const struct cache_key *key);
 void cache_object_free(struct cache_object *obj);
 void cache_object_get(struct cache_object *obj);
 int cache_object_put(struct cache_object *obj);
 void cache_object_set_status(struct cache_object *obj, int status);
+void *cache_object_ptr(struct cache_object *obj);
+const char *cache_attr_name(int attr);
+
+/* objects that have not been added, updated or marked as seen since
+ * cache_generation_next() are stale. A sweep still pending from the last
+ * generation is cancelled: until the next cache_sweep(), everything that
+ * the new generation has not seen yet would look stale to it. */
+static inline void cache_generation_next(struct cache *c)
+{
+	del_alarm(&c->sweep_alarm);
+	c->generation++;
+}
+
+static inline void cache_object_seen(struct cache_object *obj)
+{
+	obj->seen = obj->cache->generation;
+}
+
+static inline int cache_object_stale(const struct cache_object *obj)
+{
+	return obj->seen != obj->cache->generation;
+}
+
+void cache_sweep(struct cache *c, int (*sweep)(void *data1, void *data2));
 
 int cache_add(struct cache *c, struct cache_object *obj, int id);
 void cache_update(struct cache *c, struct cache_object *obj, int id, void *ptr);
 struct cache_object *cache_update_force(struct cache *c, void *ptr);
+struct cache_object *cache_update_force_key(struct cache *c, void *ptr, const struct cache_key *key);
 void cache_del(struct cache *c, struct cache_object *obj);
 struct cache_object *cache_find(struct cache *c, void *ptr, int *pos);
+struct cache_object *cache_find_key(struct cache *c, const struct cache_key *key, int *pos);
+void cache_prefetch_key(struct cache *c, const struct cache_key *key);
 void cache_stats(const struct cache *c, int fd);
 void cache_stats_extended(const struct cache *c, int fd);
 void *cache_get_extra(struct cache_object *);
 void cache_iterate(struct cache *c, void *data, int (*iterate)(void *data1, void *data2));
-void cache_iterate_limit(struct cache *c, void *data, uint32_t from, uint32_t steps, int (*iterate)(void *data1, void *data2));
+int cache_iterate_limit(struct cache *c, void *data, uint32_t *from, uint32_t steps, int (*iterate)(void *data1, void *data2));
 
 /* iterators */
 struct nfct_handle;
 
+struct cache_snapshot;
+
 struct __dump_container {
 	int fd;
 	int type;
+	struct cache_snapshot *snap;	/* NULL if written to fd directly */
 };
 
 void cache_dump(struct cache *c, int fd, int type);
+int cache_dump_async(struct cache *c, int fd, int type);
+int cache_dump_write(struct __dump_container *container, const char *buf, int size);
 
 struct __commit_container {
 	struct nfct_handle	*h;
@@ -172,6 +345,17 @@ struct __commit_container {
 
 int cache_commit(struct cache *c, struct nfct_handle *h, int clientfd);
 void cache_flush(struct cache *c);
+
+const char *cache_index_name(int type);
+int cache_index_type(const char *name);
+void cache_index_mask(int type, struct cache_index_key *key);
+int cache_index_iterate(struct cache *c, const struct cache_index_query *q, void *data, int (*iterate)(void *data1, void *data2));
+int cache_index_dump(struct cache *c, int fd, int type, const struct cache_index_query *q);
+int cache_index_flush(struct cache *c, const struct cache_index_query *q);
 void cache_bulk(struct cache *c);
 
+int cache_file_open(struct cache *c, const char *path);
+void cache_file_close(struct cache *c);
+void cache_file_stats(const struct cache *c, int fd);
+
 #endif
@@ -49,6 +49,10 @@
 #define ALL_COMMIT		46	/* commit all tables		*/
 #define EXP_DUMP_INT_XML	47	/* dump internal cache in XML	*/
 #define EXP_DUMP_EXT_XML	48	/* dump external cache in XML	*/
+#define CT_DUMP_INT_INDEX	49	/* dump internal cache by index	*/
+#define CT_DUMP_EXT_INDEX	50	/* dump external cache by index	*/
+#define CT_FLUSH_INT_INDEX	51	/* flush internal cache by index */
+#define CT_FLUSH_EXT_INDEX	52	/* flush external cache by index */
 
 #define DEFAULT_CONFIGFILE	"/etc/conntrackd/conntrackd.conf"
 #define DEFAULT_LOCKFILE	"/var/lock/conntrackd.lock"
@@ -71,6 +75,17 @@
 #define CTD_EXPECT		(1UL << 6)
 #define CTD_HELPER		(1UL << 7)
 
+/* I/O engines */
+#define IO_ENGINE_EPOLL		0
+#define IO_ENGINE_URING		1
+
+/* maximum number of SourceBudget clauses */
+#define CTD_SOURCE_BUDGET_MAX	16
+
+/* event datagrams received per system call, and slots of its histogram */
+#define CTNL_RECV_BATCH		64
+#define CTNL_RECV_HIST		7	/* 1, 2-3, 4-7, ... 64 */
+
 /* FILENAME_MAX is 4096 on my system, perhaps too much? */
 #ifndef FILENAME_MAXLEN
 #define FILENAME_MAXLEN 256
@@ -117,15 +132,35 @@ struct ct_conf {
 		int internal_cache_disable;
 		int external_cache_disable;
 		int tcp_window_tracking;
+		int wire_format_cache;
+		char internal_file[FILENAME_MAXLEN];
+		char external_file[FILENAME_MAXLEN];
 	} sync;
 	struct {
 		int subsys_id;
 		int groups;
 		int events_reliable;
+		int event_thread;
 	} netlink;
 	struct {
 		int commit_steps;
+		int timer_wheel;
+		int io_engine;
+		unsigned int worker_threads;
+		unsigned int hash_flags;
+		unsigned int cache_index;
+		unsigned int cache_index_prefix4;
+		unsigned int cache_index_prefix6;
+		unsigned int cache_memory;	/* bytes, 0 means no budget */
+		unsigned int cache_memory_internal;
+		unsigned int cache_memory_external;
 	} general;
+	struct {
+		char *name;
+		unsigned int calls;
+		unsigned int usecs;
+	} source_budget[CTD_SOURCE_BUDGET_MAX];
+	int source_budget_num;
 	struct {
 		int type;
 		int prio;
@@ -160,6 +195,7 @@ struct ct_general_state {
 	struct nfct_handle		*get;		/* get handler */
 	int				get_retval;	/* hackish */
 	struct nfct_handle		*flush;		/* flusher */
+	struct nfct_handle		*flush_job;	/* flusher, worker jobs */
 
 	struct alarm_block		resync_alarm;
 	struct alarm_block		polling_alarm;
@@ -174,6 +210,7 @@ struct ct_general_state {
 		uint64_t 		packets_repl;
 
 		time_t			daemon_start_time;
+		uint64_t		ready_usecs;	/* start-up time */
 
 		uint64_t		nl_events_received;
 		uint64_t		nl_events_filtered;
@@ -183,6 +220,18 @@ struct ct_general_state {
 		uint32_t		nl_dump_unknown_type;
 		uint32_t		nl_kernel_table_flush;
 		uint32_t		nl_kernel_table_resync;
+		uint64_t		nl_dump_usecs;	/* last table dump */
+		uint32_t		nl_dump_unchanged;
+		uint32_t		nl_dump_stale;
+
+		uint64_t		nl_recv_calls;	/* recvmmsg() */
+		uint64_t		nl_recv_msgs;
+		uint32_t		nl_recv_batch[CTNL_RECV_HIST];
+
+		uint32_t		nl_ring_max_depth;
+		uint32_t		nl_ring_stalls;
+		uint64_t		nl_ring_stall_usecs;
+		uint64_t		nl_ring_batches;
 
 		uint32_t		child_process_failed;
 		uint32_t		child_process_error_segfault;
@@ -219,12 +268,15 @@ struct ct_sync_state {
 		int			clientfd;
 		struct nfct_handle	*h;
 		struct evfd		*evfd;
-		int			current;
+		uint32_t		current;
 		struct commit_runqueue  rq[2];
+		struct nl_batch		*batch;
 		struct {
 			int 		ok;
 			int		fail;
 			struct timeval	start;
+			uint32_t	last_ok;	/* last commit */
+			uint64_t	last_usecs;
 		} stats;
 	} commit;
 
@@ -284,6 +336,7 @@ struct ct_mode {
 void ctnl_kill(void);
 int ctnl_local(int fd, int type, void *data);
 int ctnl_init(void);
+unsigned int ctnl_reader_depth(void);
 
 /* basic cthelper functions */
 void cthelper_kill(void);
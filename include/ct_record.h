@@ -0,0 +1,106 @@
+#ifndef _CT_RECORD_H_
+#define _CT_RECORD_H_
+
+#include <stdint.h>
+#include <linux/netlink.h>
+#include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+
+struct cache_key;
+
+/*
+ * Compact conntrack parsed straight from a ctnetlink event message, with
+ * only the attributes that conntrackd filters, caches and synchronizes.
+ * It lives on the stack or in the event ring, so the event path does not
+ * allocate. Addresses and ports are kept in network byte order, like
+ * libnetfilter_conntrack does.
+ */
+enum {
+	CT_REC_TUPLE_ORIG = 0,
+	CT_REC_TUPLE_REPL,
+	CT_REC_TUPLE_MASTER,
+	CT_REC_TUPLE_MAX
+};
+
+/* bits of ct_record_tuple.set */
+#define CT_REC_T_IP		(1 << 0)
+#define CT_REC_T_PROTO		(1 << 1)
+#define CT_REC_T_PORTS		(1 << 2)
+#define CT_REC_T_ICMP		(1 << 3)
+
+struct ct_record_tuple {
+	uint32_t		src[4];
+	uint32_t		dst[4];
+	uint16_t		sport;
+	uint16_t		dport;
+	uint16_t		icmp_id;
+	uint8_t			icmp_type;
+	uint8_t			icmp_code;
+	uint8_t			l4proto;
+	uint8_t			set;		/* CT_REC_T_* */
+};
+
+/* bits of ct_record.attrs */
+enum {
+	CT_REC_STATUS		= (1 << 0),
+	CT_REC_TIMEOUT		= (1 << 1),
+	CT_REC_MARK		= (1 << 2),
+	CT_REC_SECMARK		= (1 << 3),
+	CT_REC_ZONE		= (1 << 4),
+	CT_REC_ID		= (1 << 5),
+	CT_REC_TCP_STATE	= (1 << 6),
+	CT_REC_TCP_WSCALE_ORIG	= (1 << 7),
+	CT_REC_TCP_WSCALE_REPL	= (1 << 8),
+	CT_REC_TCP_FLAGS_ORIG	= (1 << 9),
+	CT_REC_TCP_FLAGS_REPL	= (1 << 10),
+	CT_REC_SCTP_STATE	= (1 << 11),
+	CT_REC_SCTP_VTAG_ORIG	= (1 << 12),
+	CT_REC_SCTP_VTAG_REPL	= (1 << 13),
+	CT_REC_DCCP_STATE	= (1 << 14),
+	CT_REC_DCCP_ROLE	= (1 << 15),
+	CT_REC_DCCP_SEQ		= (1 << 16),
+	CT_REC_COUNTERS_ORIG	= (1 << 17),
+	CT_REC_COUNTERS_REPL	= (1 << 18),
+	CT_REC_NATSEQ_ORIG	= (1 << 19),
+	CT_REC_NATSEQ_REPL	= (1 << 20),
+	CT_REC_HELPER		= (1 << 21),
+};
+
+/* index in ct_record.natseq[dir] */
+enum {
+	CT_REC_NATSEQ_POS = 0,
+	CT_REC_NATSEQ_BEFORE,
+	CT_REC_NATSEQ_AFTER,
+	CT_REC_NATSEQ_MAX
+};
+
+struct ct_record {
+	uint32_t		attrs;		/* CT_REC_* */
+	uint8_t			l3proto;
+	struct ct_record_tuple	tuple[CT_REC_TUPLE_MAX];
+
+	uint32_t		status;
+	uint32_t		timeout;
+	uint32_t		mark;
+	uint32_t		secmark;
+	uint32_t		id;
+	uint16_t		zone;
+
+	uint8_t			state;		/* TCP, SCTP or DCCP */
+	uint8_t			wscale[2];	/* TCP */
+	uint8_t			flags[2];	/* TCP */
+	uint8_t			mask[2];	/* TCP */
+	uint8_t			role;		/* DCCP */
+	uint64_t		handshake_seq;	/* DCCP */
+	uint32_t		vtag[2];	/* SCTP */
+
+	uint64_t		packets[2];
+	uint64_t		bytes[2];
+	uint32_t		natseq[2][CT_REC_NATSEQ_MAX];
+	char			helper[NFCT_HELPER_NAME_MAX];
+};
+
+int ct_record_parse(const struct nlmsghdr *nlh, struct ct_record *r);
+void ct_record_key(const struct ct_record *r, struct cache_key *key);
+void ct_record_fill(const struct ct_record *r, struct nf_conntrack *ct);
+
+#endif
@@ -1,10 +1,20 @@
 #ifndef _DATE_H_
 #define _DATE_H_
 
+#include <stdint.h>
+#include <time.h>
 #include <sys/time.h>
 
-int do_gettimeofday(void);
-void gettimeofday_cached(struct timeval *tv);
+#define NSEC_PER_SEC	1000000000ULL
+
+/* uncached monotonic time */
+uint64_t time_ns(void);
+void gettime(struct timeval *tv);
+
+/* monotonic time cached at the beginning of the loop iteration */
+int do_gettime(void);
+void gettime_cached(struct timeval *tv);
+uint64_t time_ns_cached(void);
 int time_cached(void);
 
 #endif
@@ -1,6 +1,12 @@
 #ifndef _EVENT_H_
 #define _EVENT_H_
 
+/*
+ * Wake-up notification for producer/consumer queues: the producers call
+ * write_evfd() once they have published work, the consumer registers the
+ * descriptor in the main loop and calls read_evfd() before handling the
+ * whole batch.
+ */
 struct evfd *create_evfd(void);
 
 void destroy_evfd(struct evfd *e);
@@ -1,19 +1,29 @@
 #ifndef _EXTERNAL_H_
 #define _EXTERNAL_H_
 
+#include <stdint.h>
+
 struct nf_conntrack;
+struct cache_index_query;
 
 struct external_handler {
 	int	(*init)(void);
 	void	(*close)(void);
 
+	/* optional, called once the messages of a channel read are done. */
+	void	(*batch_end)(void);
+
 	struct {
 		void	(*new)(struct nf_conntrack *ct);
 		void	(*upd)(struct nf_conntrack *ct);
 		void	(*del)(struct nf_conntrack *ct);
 
 		void	(*dump)(int fd, int type);
+		int	(*dump_async)(int fd, int type);
 		void	(*flush)(void);
+		int	(*dump_index)(int fd, int type,
+				      const struct cache_index_query *q);
+		int	(*flush_index)(const struct cache_index_query *q);
 		int	(*commit)(struct nfct_handle *h, int fd);
 		void	(*stats)(int fd);
 		void	(*stats_ext)(int fd);
@@ -24,6 +34,7 @@ struct external_handler {
 		void	(*del)(struct nf_expect *exp);
 
 		void	(*dump)(int fd, int type);
+		int	(*dump_async)(int fd, int type);
 		void	(*flush)(void);
 		int	(*commit)(struct nfct_handle *h, int fd);
 		void	(*stats)(int fd);
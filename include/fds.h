@@ -1,24 +1,82 @@
 #ifndef _FDS_H_
 #define _FDS_H_
 
+#include <stdint.h>
 #include "linux_list.h"
+#include "uring.h"
+
+enum {
+	FDS_PRIO_NORMAL	= 0,
+	FDS_PRIO_HIGH,
+	FDS_PRIO_MAX
+};
 
 struct fds {
-	int	maxfd;
-	fd_set	readfds;
+	int	epfd;
+	int	num;
+	int	uring;		/* use io_uring instead of epoll */
+	int	high;		/* number of high priority descriptors */
+	uint64_t last_high;	/* last time high priority ones were served */
 	struct list_head list;
+	struct list_head gc;
+	struct list_head ready[FDS_PRIO_MAX];	/* io_uring only */
+};
+
+/* log2 histogram in microseconds, the last bucket is open-ended. */
+#define FDS_HIST_BUCKETS	20
+
+struct fds_stats {
+	uint64_t		dispatched;
+	uint64_t		usecs;
+	uint32_t		exhausted;
+	uint32_t		preempted;
+	uint32_t		service[FDS_HIST_BUCKETS];
+	uint32_t		delay[FDS_HIST_BUCKETS];
 };
 
+#define FDS_NAMELEN		16
+
 struct fds_item {
 	struct list_head        head;
 	int                     fd;
+	uint32_t		events;
+	int			removed;
+	int			drained;
+	int			prio;
+	unsigned int		budget;
+	unsigned int		time_budget;	/* in usecs, zero means none */
+	char			name[FDS_NAMELEN];
+	struct fds_stats	stats;
 	void			(*cb)(void *data);
 	void			*data;
+	/* io_uring only */
+	struct uring_req	req;
+	struct list_head	ready;
+	int			armed;
+	int			is_ready;
 };
 
+/* maximum number of ready descriptors that we handle per loop iteration. */
+#define FDS_EVENTS_MAX	64
+
+/* high priority descriptors preempt callbacks that run longer than this. */
+#define FDS_PREEMPT_USECS	1000
+
+/* size of the io_uring submission queue. */
+#define FDS_URING_ENTRIES	1024
+
 struct fds *create_fds(void);
 void destroy_fds(struct fds *);
+int fds_use_uring(struct fds *fds);
 int register_fd(int fd, void (*cb)(void *data), void *data, struct fds *fds);
+int register_fd_events(int fd, uint32_t events, void (*cb)(void *data),
+		       void *data, struct fds *fds);
 int unregister_fd(int fd, struct fds *fds);
+int fds_set_budget(int fd, unsigned int budget, struct fds *fds);
+int fds_set_time_budget(int fd, unsigned int usecs, struct fds *fds);
+int fds_set_priority(int fd, int prio, struct fds *fds);
+int fds_set_name(int fd, const char *name, struct fds *fds);
+void fds_drained(void);
+void fds_stats(int fd, struct fds *fds);
 
 #endif
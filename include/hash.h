@@ -9,36 +9,87 @@
 struct hashtable;
 struct hashtable_node;
 
+#define HASHTABLE_BUCKET_SLOTS	7
+
+/* open addressing bucket, see hash.c */
+struct hashtable_bucket {
+	uint64_t		ctrl;
+	struct hashtable_node	*node[HASHTABLE_BUCKET_SLOTS];
+} __attribute__((aligned(64)));
+
+/* use open addressing instead of chaining */
+#define HASHTABLE_F_OPEN	(1U << 0)
+/* grow and shrink the table with the number of entries */
+#define HASHTABLE_F_RESIZE	(1U << 1)
+
+/* buckets that are moved to the new table per operation while resizing */
+#define HASHTABLE_REHASH_STEPS	8
+
+struct hashtable_table {
+	uint32_t		size;
+	struct list_head	*members;
+	struct hashtable_bucket	*buckets;
+};
+
 struct hashtable {
-	uint32_t hashsize;
+	uint32_t hashsize;	/* buckets in the current table */
 	uint32_t limit;
 	uint32_t count;
 	uint32_t initval;
-	
+	uint32_t flags;
+	uint32_t min_size;
+	uint32_t rehash;	/* next bucket to move from the old table */
+	int	 iterating;
+
+	struct hashtable_table	cur;
+	struct hashtable_table	old;	/* only while resizing */
+
+	struct {
+		uint32_t	grow;
+		uint32_t	shrink;
+		uint32_t	resize_failed;
+	} stats;
+
+	/* returns the full 32-bit hash, not the bucket. */
 	uint32_t (*hash)(const void *data, const struct hashtable *table);
 	int	 (*compare)(const void *data1, const void *data2);
-
-	struct list_head 	members[0];
 };
 
 struct hashtable_node {
 	struct list_head head;
+	uint32_t hash;
+};
+
+#define HASHTABLE_STATS_CHAIN	8
+
+struct hashtable_stats {
+	uint32_t	buckets;
+	uint32_t	capacity;	/* slots with open addressing */
+	uint32_t	rehash_pending;	/* buckets left in the old table */
+	uint32_t	max_chain;
+	uint32_t	chain[HASHTABLE_STATS_CHAIN];	/* entries per bucket */
+	uint32_t	overflow;	/* open addressing only */
+	uint32_t	grow;
+	uint32_t	shrink;
+	uint32_t	resize_failed;
 };
 
 struct hashtable *
-hashtable_create(int hashsize, int limit,
+hashtable_create(int hashsize, int limit, unsigned int flags,
 		 uint32_t (*hash)(const void *data,
 		 		  const struct hashtable *table),
 		 int (*compare)(const void *data1, const void *data2));
 void hashtable_destroy(struct hashtable *h);
-int hashtable_hash(const struct hashtable *table, const void *data);
-struct hashtable_node *hashtable_find(const struct hashtable *table, const void *data, int id);
-int hashtable_add(struct hashtable *table, struct hashtable_node *n, int id);
+uint32_t hashtable_hash(const struct hashtable *table, const void *data);
+struct hashtable_node *hashtable_find(struct hashtable *table, const void *data, uint32_t hash);
+void hashtable_prefetch(const struct hashtable *table, uint32_t hash);
+int hashtable_add(struct hashtable *table, struct hashtable_node *n, uint32_t hash);
 void hashtable_del(struct hashtable *table, struct hashtable_node *node);
 int hashtable_flush(struct hashtable *table);
 int hashtable_iterate(struct hashtable *table, void *data,
 		      int (*iterate)(void *data, void *n));
-int hashtable_iterate_limit(struct hashtable *table, void *data, uint32_t from, uint32_t steps, int (*iterate)(void *data1, void *n));
+int hashtable_iterate_limit(struct hashtable *table, void *data, uint32_t *cursor, uint32_t steps, int (*iterate)(void *data1, void *n));
 unsigned int hashtable_counter(const struct hashtable *table);
+void hashtable_get_stats(const struct hashtable *h, struct hashtable_stats *s);
 
 #endif
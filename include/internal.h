@@ -4,6 +4,8 @@
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 
 struct nf_conntrack;
+struct cache_key;
+struct cache_index_query;
 
 enum {
 	INTERNAL_F_POPULATE	= (1 << 0),
@@ -20,16 +22,29 @@ struct internal_handler {
 	struct {
 		void	*data;
 
-		void	(*new)(struct nf_conntrack *ct, int origin_type);
-		void	(*upd)(struct nf_conntrack *ct, int origin_type);
-		int	(*del)(struct nf_conntrack *ct, int origin_type);
+		void	(*new)(struct nf_conntrack *ct,
+			       const struct cache_key *key, int origin_type);
+		void	(*upd)(struct nf_conntrack *ct,
+			       const struct cache_key *key, int origin_type);
+		int	(*del)(struct nf_conntrack *ct,
+			       const struct cache_key *key, int origin_type);
 
 		void	(*dump)(int fd, int type);
+		int	(*dump_async)(int fd, int type);
 		void	(*populate)(struct nf_conntrack *ct);
+		void	(*populate_start)(void);
+		void	(*populate_done)(void);
+		void	(*seen)(struct nf_conntrack *ct);
+		void	(*prefetch_key)(const struct cache_key *key);
+		void	(*batch_start)(void);
+		void	(*batch_done)(void);
 		void	(*purge)(void);
 		int	(*resync)(enum nf_conntrack_msg_type type,
 				  struct nf_conntrack *ct, void *data);
 		void	(*flush)(void);
+		int	(*dump_index)(int fd, int type,
+				      const struct cache_index_query *q);
+		int	(*flush_index)(const struct cache_index_query *q);
 
 		void	(*stats)(int fd);
 		void	(*stats_ext)(int fd);
@@ -42,6 +57,7 @@ struct internal_handler {
 		int	(*del)(struct nf_expect *exp, int origin_type);
 
 		void	(*dump)(int fd, int type);
+		int	(*dump_async)(int fd, int type);
 		void	(*populate)(struct nf_expect *exp);
 		void	(*purge)(void);
 		int	(*resync)(enum nf_conntrack_msg_type type,
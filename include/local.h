@@ -1,6 +1,8 @@
 #ifndef _LOCAL_SOCKET_H_
 #define _LOCAL_SOCKET_H_
 
+#include <stddef.h>
+
 #ifndef UNIX_PATH_MAX
 #define UNIX_PATH_MAX   108
 #endif
@@ -32,6 +34,8 @@ int local_client_create(struct local_conf *conf);
 void local_client_destroy(int fd);
 int do_local_client_step(int fd, void (*process)(char *buf));
 int do_local_request(int, struct local_conf *,void (*step)(char *buf));
+int do_local_request_data(int request, const void *data, size_t len,
+			  struct local_conf *conf, void (*step)(char *buf));
 void local_step(char *buf);
 
 #endif
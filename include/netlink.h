@@ -12,12 +12,28 @@ struct nlif_handle *nl_init_interface_handler(void);
 int nl_send_resync(struct nfct_handle *h);
 void nl_resize_socket_buffer(struct nfct_handle *h);
 int nl_dump_conntrack_table(struct nfct_handle *h);
-int nl_flush_conntrack_table_selective(void);
+int nl_flush_conntrack_table_selective(struct nfct_handle *h);
 int nl_get_conntrack(struct nfct_handle *h, const struct nf_conntrack *ct);
 int nl_create_conntrack(struct nfct_handle *h, const struct nf_conntrack *ct, int timeout);
 int nl_update_conntrack(struct nfct_handle *h, const struct nf_conntrack *ct, int timeout);
 int nl_destroy_conntrack(struct nfct_handle *h, const struct nf_conntrack *ct);
 
+/* messages per batch, see nl_batch_flush() */
+#define NL_BATCH_MAX		256
+
+struct nl_batch;
+
+struct nl_batch *nl_batch_create(struct nfct_handle *h);
+void nl_batch_destroy(struct nl_batch *b);
+unsigned int nl_batch_len(const struct nl_batch *b);
+unsigned int nl_batch_pending(const struct nl_batch *b);
+int nl_batch_create_conntrack(struct nl_batch *b, const struct nf_conntrack *ct, int timeout, void *data);
+int nl_batch_update_conntrack(struct nl_batch *b, const struct nf_conntrack *ct, int timeout, void *data);
+int nl_batch_destroy_conntrack(struct nl_batch *b, const struct nf_conntrack *ct, void *data);
+int nl_batch_send(struct nl_batch *b, void (*cb)(void *data, int error, void *arg), void *arg);
+int nl_batch_recv(struct nl_batch *b, void (*cb)(void *data, int error, void *arg), void *arg, int flags);
+int nl_batch_flush(struct nl_batch *b, void (*cb)(void *data, int error, void *arg), void *arg);
+
 static inline int ct_is_related(const struct nf_conntrack *ct)
 {
 	return (nfct_attr_is_set(ct, ATTR_MASTER_L3PROTO) &&
@@ -1,25 +1,50 @@
 #ifndef _PROCESS_H_
 #define _PROCESS_H_
 
+#include "linux_list.h"
+
+#include <sys/time.h>
+
 enum process_type {
 	CTD_PROC_ANY,		/* any type */
 	CTD_PROC_FLUSH,		/* flush process */
 	CTD_PROC_COMMIT,	/* commit process */
+	CTD_PROC_DUMP,		/* dump to client */
 	CTD_PROC_MAX
 };
 
 #define CTD_PROC_F_EXCL 	(1 << 0)  /* only one process at a time */
 
-struct child_process {
-	struct list_head	head;
-	int			pid;
+enum worker_job_state {
+	WORKER_JOB_QUEUED,	/* waiting for a worker thread */
+	WORKER_JOB_RUNNING,	/* being run by a worker thread */
+	WORKER_JOB_DONE,	/* waiting for the main loop to release it */
+	WORKER_JOB_ITER,	/* run in steps from the main loop */
+};
+
+struct worker_job {
+	struct list_head	head;	/* list of all jobs, main thread */
+	struct list_head	list;	/* pending, done or iterator list */
 	int			type;
-	void			(*cb)(void *data);
+	int			state;
+	struct timeval		start;
+	void			(*run)(void *data);
+	int			(*step)(void *data);
+	void			(*done)(void *data);
 	void			*data;
 };
 
-int fork_process_new(int type, int flags, void (*cb)(void *data), void *data);
-int fork_process_delete(int pid);
-void fork_process_dump(int fd);
+#define WORKER_THREADS_MAX	32
+
+int worker_pool_create(unsigned int num);
+void worker_pool_destroy(void);
+
+int worker_job_new(int type, int flags,
+		   void (*run)(void *data),
+		   void (*done)(void *data), void *data);
+int worker_iter_new(int type, int flags,
+		    int (*step)(void *data),
+		    void (*done)(void *data), void *data);
+void worker_job_dump(int fd);
 
 #endif
@@ -15,6 +15,7 @@ enum {
 	Q_ELEM_OBJ = 0,
 	Q_ELEM_CTL = 1,
 	Q_ELEM_ERR = 2,
+	Q_ELEM_DEL = 3,
 };
 
 void queue_node_init(struct queue_node *n, int type);
@@ -40,6 +41,8 @@ struct queue {
 	uint32_t		flags;
 	struct list_head	head;
 	struct evfd		*evfd;
+	unsigned int		plugged;	/* hold back the wake-ups */
+	int			deferred;	/* wake-up held back */
 	char			name[QUEUE_NAMELEN];
 };
 
@@ -58,5 +61,8 @@ void queue_iterate(struct queue *b,
 		   const void *data,
 		   int (*iterate)(struct queue_node *n, const void *data2));
 int queue_get_eventfd(struct queue *b);
+int queue_ack_eventfd(struct queue *b);
+void queue_plug(struct queue *b);
+void queue_unplug(struct queue *b);
 
 #endif
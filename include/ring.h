@@ -0,0 +1,34 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Lock-free single-producer single-consumer ring of fixed-size elements.
+ * The producer and the consumer indexes live in different cachelines.
+ */
+struct ring {
+	unsigned int	size;		/* number of elements, power of two */
+	unsigned int	mask;
+	size_t		elem_size;
+	char		*data;
+
+	unsigned int	head __attribute__((aligned(64))); /* producer */
+	unsigned int	tail __attribute__((aligned(64))); /* consumer */
+};
+
+struct ring *ring_create(unsigned int size, size_t elem_size);
+void ring_destroy(struct ring *r);
+
+/* producer side */
+void *ring_write_slot(struct ring *r);
+int ring_write_commit(struct ring *r);
+
+/* consumer side */
+void *ring_read_slot(struct ring *r);
+int ring_read_commit(struct ring *r);
+
+unsigned int ring_depth(struct ring *r);
+
+#endif
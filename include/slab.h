@@ -0,0 +1,54 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "linux_list.h"
+
+/*
+ * Fixed-size object allocator. Objects are carved from chunks of
+ * SLAB_CHUNK_SIZE bytes aligned to their size, so the chunk of an object
+ * is found by masking its address. Free objects are linked through their
+ * first word. Chunks that become empty are released, except for those
+ * that keep the preallocated reserve.
+ */
+#define SLAB_CHUNK_SIZE		(64 * 1024)
+
+struct slab_chunk {
+	struct list_head	head;
+	void			*free;		/* free objects in this chunk */
+	unsigned int		used;
+};
+
+struct slab {
+	size_t			size;		/* object size, rounded */
+	unsigned int		per_chunk;	/* objects per chunk */
+	unsigned int		reserve;	/* objects never released */
+	struct list_head	partial;	/* chunks with free objects */
+	struct list_head	full;
+
+	unsigned int		chunks;
+	unsigned int		empty;		/* chunks with no objects */
+	unsigned int		used;		/* objects handed out */
+
+	struct {
+		uint32_t	alloc;
+		uint32_t	free;
+		uint32_t	grow;
+		uint32_t	shrink;
+		uint32_t	fail;
+	} stats;
+};
+
+struct slab *slab_create(size_t size, unsigned int reserve);
+void slab_destroy(struct slab *s);
+
+void *slab_alloc(struct slab *s);
+void slab_free(struct slab *s, void *obj);
+
+static inline unsigned int slab_total(const struct slab *s)
+{
+	return s->chunks * s->per_chunk;
+}
+
+#endif
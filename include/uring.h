@@ -0,0 +1,43 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+/* datagrams that can be in flight at the same time, and their size. */
+#define URING_SEND_MAX		256
+#define URING_SEND_BUFSIZ	9216
+
+/* embedded in the objects that submit requests to the io_uring. */
+struct uring_req {
+	void	(*complete)(struct uring_req *req, int res);
+};
+
+struct uring_stats {
+	uint64_t	enter;		/* io_uring_enter() calls */
+	uint64_t	submitted;	/* submission queue entries */
+	uint64_t	completed;	/* completion queue entries */
+	uint64_t	sends;		/* batched datagrams */
+	uint64_t	send_failed;
+	uint64_t	send_busy;	/* no free send, sent by the caller */
+};
+
+int uring_init(unsigned int entries);
+void uring_fini(void);
+int uring_enabled(void);
+
+int uring_poll_add(int fd, uint32_t events, struct uring_req *req);
+int uring_poll_remove(struct uring_req *req);
+
+ssize_t uring_sendto(int fd, const void *data, size_t size,
+		     const struct sockaddr *addr, socklen_t addrlen,
+		     void (*done)(void *data, ssize_t res), void *cbdata);
+void uring_flush(void *cbdata);
+
+int uring_wait(struct timeval *tv);
+
+void uring_get_stats(struct uring_stats *stats);
+
+#endif
@@ -19,9 +19,16 @@
 #include "alarm.h"
 #include "date.h"
 #include <stdlib.h>
+#include <stdint.h>
 #include <limits.h>
 
-static struct rb_root alarm_root = RB_ROOT;
+struct alarm_ops {
+	void		(*add)(struct alarm_block *alarm);
+	void		(*del)(struct alarm_block *alarm);
+	int		(*pending)(struct alarm_block *alarm);
+	struct timeval *(*next)(struct timeval *tv, struct timeval *next_run);
+	void		(*run)(struct timeval *tv);
+};
 
 void init_alarm(struct alarm_block *t,
 		void *data,
@@ -29,12 +36,37 @@ void init_alarm(struct alarm_block *t,
 {
 	/* initialize the head to check whether a node is inserted */
 	RB_CLEAR_NODE(&t->node);
+	INIT_LIST_HEAD(&t->list);
 	timerclear(&t->tv);
 	t->data = data;
 	t->function = fcn;
 }
 
-static void __add_alarm(struct alarm_block *alarm)
+static struct timeval *
+calculate_next_run(struct timeval *cand,
+		   struct timeval *tv,
+		   struct timeval *next_run)
+{
+	if (cand->tv_sec != LONG_MAX) {
+		if (timercmp(cand, tv, >))
+			timersub(cand, tv, next_run);
+		else {
+			/* loop again inmediately */
+			next_run->tv_sec = 0;
+			next_run->tv_usec = 0;
+		}
+		return next_run;
+	}
+	return NULL;
+}
+
+/*
+ * Red-black tree: alarms are sorted by expiration time, O(log n) to
+ * add and delete, the next alarm to expire is the leftmost node.
+ */
+static struct rb_root alarm_root = RB_ROOT;
+
+static void rbtree_add(struct alarm_block *alarm)
 {
 	struct rb_node **new = &(alarm_root.rb_node);
 	struct rb_node *parent = NULL;
@@ -55,19 +87,7 @@ static void __add_alarm(struct alarm_block *alarm)
 	rb_insert_color(&alarm->node, &alarm_root);
 }
 
-void add_alarm(struct alarm_block *alarm, unsigned long sc, unsigned long usc)
-{
-	struct timeval tv;
-
-	del_alarm(alarm);
-	alarm->tv.tv_sec = sc;
-	alarm->tv.tv_usec = usc;
-	gettimeofday_cached(&tv);
-	timeradd(&alarm->tv, &tv, &alarm->tv);
-	__add_alarm(alarm);
-}
-
-void del_alarm(struct alarm_block *alarm)
+static void rbtree_del(struct alarm_block *alarm)
 {
 	/* don't remove a non-inserted node */
 	if (!RB_EMPTY_NODE(&alarm->node)) {
@@ -76,7 +96,7 @@ void del_alarm(struct alarm_block *alarm)
 	}
 }
 
-int alarm_pending(struct alarm_block *alarm)
+static int rbtree_pending(struct alarm_block *alarm)
 {
 	if (RB_EMPTY_NODE(&alarm->node))
 		return 0;
@@ -85,55 +105,30 @@ int alarm_pending(struct alarm_block *alarm)
 }
 
 static struct timeval *
-calculate_next_run(struct timeval *cand,
-		   struct timeval *tv,
-		   struct timeval *next_run)
-{
-	if (cand->tv_sec != LONG_MAX) {
-		if (timercmp(cand, tv, >))
-			timersub(cand, tv, next_run);
-		else {
-			/* loop again inmediately */
-			next_run->tv_sec = 0;
-			next_run->tv_usec = 0;
-		}
-		return next_run;
-	}
-	return NULL;
-}
-
-struct timeval *
-get_next_alarm_run(struct timeval *next_run)
+rbtree_next(struct timeval *tv, struct timeval *next_run)
 {
 	struct rb_node *node;
-	struct timeval tv;
-
-	gettimeofday_cached(&tv);
 
 	node = rb_first(&alarm_root);
 	if (node) {
 		struct alarm_block *this;
 		this = container_of(node, struct alarm_block, node);
-		return calculate_next_run(&this->tv, &tv, next_run);
+		return calculate_next_run(&this->tv, tv, next_run);
 	}
 	return NULL;
 }
 
-struct timeval *
-do_alarm_run(struct timeval *next_run)
+static void rbtree_run(struct timeval *tv)
 {
 	struct list_head alarm_run_queue;
 	struct rb_node *node;
 	struct alarm_block *this, *tmp;
-	struct timeval tv;
-
-	gettimeofday_cached(&tv);
 
 	INIT_LIST_HEAD(&alarm_run_queue);
 	for (node = rb_first(&alarm_root); node; node = rb_next(node)) {
 		this = container_of(node, struct alarm_block, node);
 
-		if (timercmp(&this->tv, &tv, >))
+		if (timercmp(&this->tv, tv, >))
 			break;
 
 		list_add(&this->list, &alarm_run_queue);
@@ -145,6 +140,241 @@ do_alarm_run(struct timeval *next_run)
 		RB_CLEAR_NODE(&this->node);
 		this->function(this, this->data);
 	}
+}
+
+static struct alarm_ops alarm_rbtree_ops = {
+	.add		= rbtree_add,
+	.del		= rbtree_del,
+	.pending	= rbtree_pending,
+	.next		= rbtree_next,
+	.run		= rbtree_run,
+};
+
+/*
+ * Hashed timing wheel: the alarm goes to the slot of the tick in which
+ * it expires, that is O(1) to add and delete. Alarms that expire after
+ * one full rotation stay in their slot until their round comes. A bitmap
+ * of non-empty slots tells us when the next wake-up is needed.
+ */
+#define WHEEL_TICK_USEC		10000	/* 10 ms */
+#define WHEEL_SLOTS		(1 << 16) /* ~655 seconds per rotation */
+#define WHEEL_MASK		(WHEEL_SLOTS - 1)
+#define WHEEL_BITMAP_WORDS	(WHEEL_SLOTS / 32)
+
+static struct {
+	struct list_head	slot[WHEEL_SLOTS];
+	uint32_t		bitmap[WHEEL_BITMAP_WORDS];
+	uint64_t		last_tick;	/* last tick that we processed */
+	unsigned int		count;
+} *wheel;
+
+static uint64_t wheel_tick_floor(const struct timeval *tv)
+{
+	return ((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec) /
+		WHEEL_TICK_USEC;
+}
+
+static uint64_t wheel_tick_ceil(const struct timeval *tv)
+{
+	return ((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec +
+		WHEEL_TICK_USEC - 1) / WHEEL_TICK_USEC;
+}
+
+static int wheel_init(void)
+{
+	struct timeval tv;
+	int i;
+
+	wheel = calloc(1, sizeof(*wheel));
+	if (wheel == NULL)
+		return -1;
+
+	for (i = 0; i < WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&wheel->slot[i]);
+
+	gettime_cached(&tv);
+	wheel->last_tick = wheel_tick_floor(&tv);
+	return 0;
+}
+
+static void wheel_add(struct alarm_block *alarm)
+{
+	uint64_t tick = wheel_tick_ceil(&alarm->tv);
+	unsigned int i;
+
+	/* this tick has been already processed, run it in the next one. */
+	if (tick <= wheel->last_tick)
+		tick = wheel->last_tick + 1;
+
+	i = tick & WHEEL_MASK;
+	list_add_tail(&alarm->list, &wheel->slot[i]);
+	wheel->bitmap[i >> 5] |= (1U << (i & 31));
+	wheel->count++;
+}
+
+static void wheel_del(struct alarm_block *alarm)
+{
+	if (list_empty(&alarm->list))
+		return;
+
+	list_del_init(&alarm->list);
+	wheel->count--;
+}
+
+static int wheel_pending(struct alarm_block *alarm)
+{
+	return !list_empty(&alarm->list);
+}
+
+/* returns the distance in ticks to the next non-empty slot. */
+static int wheel_next_slot(void)
+{
+	unsigned int from = (wheel->last_tick + 1) & WHEEL_MASK;
+	unsigned int i, j, word;
+
+	for (i = 0; i <= WHEEL_BITMAP_WORDS; i++) {
+		j = ((from >> 5) + i) % WHEEL_BITMAP_WORDS;
+		word = wheel->bitmap[j];
+		/* skip the slots behind us in the first word. */
+		if (i == 0)
+			word &= ~0U << (from & 31);
+
+		while (word) {
+			unsigned int slot = (j << 5) + __builtin_ctz(word);
+
+			/* slots are lazily unset from the bitmap. */
+			if (!list_empty(&wheel->slot[slot]))
+				return (slot - from) & WHEEL_MASK;
+
+			wheel->bitmap[j] &= ~(1U << (slot & 31));
+			word &= word - 1;
+		}
+	}
+	return -1;
+}
+
+static struct timeval *
+wheel_next(struct timeval *tv, struct timeval *next_run)
+{
+	struct timeval cand;
+	uint64_t usec;
+	int delta;
+
+	if (wheel->count == 0)
+		return NULL;
+
+	delta = wheel_next_slot();
+	if (delta < 0)
+		return NULL;
+
+	usec = (wheel->last_tick + 1 + delta) * WHEEL_TICK_USEC;
+	cand.tv_sec = usec / 1000000;
+	cand.tv_usec = usec % 1000000;
+
+	return calculate_next_run(&cand, tv, next_run);
+}
+
+static void wheel_run(struct timeval *tv)
+{
+	struct list_head alarm_run_queue;
+	struct alarm_block *this, *tmp;
+	uint64_t now = wheel_tick_floor(tv), tick;
+
+	/* one full rotation already visits all slots. */
+	if (now - wheel->last_tick > WHEEL_SLOTS)
+		wheel->last_tick = now - WHEEL_SLOTS;
+
+	INIT_LIST_HEAD(&alarm_run_queue);
+	for (tick = wheel->last_tick + 1; tick <= now; tick++) {
+		struct list_head *slot = &wheel->slot[tick & WHEEL_MASK];
+
+		list_for_each_entry_safe(this, tmp, slot, list) {
+			/* this alarm expires in a later rotation. */
+			if (timercmp(&this->tv, tv, >))
+				continue;
+
+			list_move_tail(&this->list, &alarm_run_queue);
+		}
+	}
+	wheel->last_tick = now;
+
+	/* callbacks may delete or re-arm other alarms in the run queue,
+	 * so always pick the head of the queue. */
+	while (!list_empty(&alarm_run_queue)) {
+		this = list_entry(alarm_run_queue.next,
+				  struct alarm_block, list);
+		list_del_init(&this->list);
+		wheel->count--;
+		this->function(this, this->data);
+	}
+}
+
+static struct alarm_ops alarm_wheel_ops = {
+	.add		= wheel_add,
+	.del		= wheel_del,
+	.pending	= wheel_pending,
+	.next		= wheel_next,
+	.run		= wheel_run,
+};
+
+static struct alarm_ops *alarm_ops = &alarm_rbtree_ops;
+
+/* this has to be called before any alarm is added. */
+int alarm_set_type(enum alarm_type type)
+{
+	switch(type) {
+	case ALARM_T_RBTREE:
+		alarm_ops = &alarm_rbtree_ops;
+		break;
+	case ALARM_T_WHEEL:
+		if (wheel == NULL && wheel_init() == -1)
+			return -1;
+		alarm_ops = &alarm_wheel_ops;
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+void add_alarm(struct alarm_block *alarm, unsigned long sc, unsigned long usc)
+{
+	struct timeval tv;
+
+	del_alarm(alarm);
+	alarm->tv.tv_sec = sc;
+	alarm->tv.tv_usec = usc;
+	gettime_cached(&tv);
+	timeradd(&alarm->tv, &tv, &alarm->tv);
+	alarm_ops->add(alarm);
+}
+
+void del_alarm(struct alarm_block *alarm)
+{
+	alarm_ops->del(alarm);
+}
+
+int alarm_pending(struct alarm_block *alarm)
+{
+	return alarm_ops->pending(alarm);
+}
+
+struct timeval *
+get_next_alarm_run(struct timeval *next_run)
+{
+	struct timeval tv;
+
+	gettime_cached(&tv);
+	return alarm_ops->next(&tv, next_run);
+}
+
+struct timeval *
+do_alarm_run(struct timeval *next_run)
+{
+	struct timeval tv;
+
+	gettime_cached(&tv);
+	alarm_ops->run(&tv);
 
 	return get_next_alarm_run(next_run);
 }
@@ -27,75 +27,149 @@
 #include "network.h"
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+#include <libnetfilter_conntrack/libnetfilter_conntrack_tcp.h>
 
-static uint32_t
-cache_hash4_ct(const struct nf_conntrack *ct, const struct hashtable *table)
-{
-	uint32_t a[4] = {
-		[0]	= nfct_get_attr_u32(ct, ATTR_IPV4_SRC),
-		[1]	= nfct_get_attr_u32(ct, ATTR_IPV4_DST),
-		[2]	= nfct_get_attr_u8(ct, ATTR_L3PROTO) << 16 |
-			  nfct_get_attr_u8(ct, ATTR_L4PROTO),
-		[3]	= nfct_get_attr_u16(ct, ATTR_PORT_SRC) << 16 |
-			  nfct_get_attr_u16(ct, ATTR_PORT_DST),
-	};
+void cache_ct_key(struct cache_key *key, const struct nf_conntrack *ct)
+{
+	const void *addr;
+
+	memset(key, 0, sizeof(struct cache_key));
+
+	key->l3proto = nfct_get_attr_u8(ct, ATTR_L3PROTO);
+	key->l4proto = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+
+	switch(key->l3proto) {
+	case AF_INET:
+		key->src[0] = nfct_get_attr_u32(ct, ATTR_IPV4_SRC);
+		key->dst[0] = nfct_get_attr_u32(ct, ATTR_IPV4_DST);
+		break;
+	case AF_INET6:
+		addr = nfct_get_attr(ct, ATTR_IPV6_SRC);
+		if (addr)
+			memcpy(key->src, addr, sizeof(key->src));
+		addr = nfct_get_attr(ct, ATTR_IPV6_DST);
+		if (addr)
+			memcpy(key->dst, addr, sizeof(key->dst));
+		break;
+	default:
+		dlog(LOG_ERR, "unknown layer 3 proto in hash");
+		break;
+	}
 
-	/*
-	 * Instead of returning hash % table->hashsize (implying a divide)
-	 * we return the high 32 bits of the (hash * table->hashsize) that will
-	 * give results between [0 and hashsize-1] and same hash distribution,
-	 * but using a multiply, less expensive than a divide. See:
-	 * http://www.mail-archive.com/netdev@vger.kernel.org/msg56623.html
-	 */
-	return ((uint64_t)jhash2(a, 4, 0) * table->hashsize) >> 32;
+	switch(key->l4proto) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		key->sport = nfct_get_attr_u16(ct, ATTR_ICMP_ID);
+		key->dport = nfct_get_attr_u8(ct, ATTR_ICMP_TYPE) << 8 |
+			     nfct_get_attr_u8(ct, ATTR_ICMP_CODE);
+		break;
+	default:
+		key->sport = nfct_get_attr_u16(ct, ATTR_PORT_SRC);
+		key->dport = nfct_get_attr_u16(ct, ATTR_PORT_DST);
+		break;
+	}
+
+	key->zone = nfct_get_attr_u16(ct, ATTR_ZONE);
+	key->id = nfct_get_attr_u32(ct, ATTR_ID);
 }
 
-static uint32_t
-cache_hash6_ct(const struct nf_conntrack *ct, const struct hashtable *table)
+/* clear a conntrack that we reuse, through the library so that it releases
+ * the attributes that it allocated (helper info, labels, secctx). */
+static void cache_ct_clear(struct nf_conntrack *ct)
+{
+	int i;
+
+	for (i = 0; i < ATTR_MAX; i++)
+		nfct_attr_unset(ct, i);
+}
+
+/* message with the original tuple in this key only, that is all that the
+ * other nodes need to delete the entry. */
+struct nethdr *cache_ct_key_build_msg(const struct cache_key *key, int type)
 {
-	uint32_t a[10];
+	static struct nf_conntrack *ct;
+
+	if (ct == NULL) {
+		ct = nfct_new();
+		if (ct == NULL)
+			return NULL;
+	}
+	cache_ct_clear(ct);
+
+	nfct_set_attr_u8(ct, ATTR_L3PROTO, key->l3proto);
+	nfct_set_attr_u8(ct, ATTR_L4PROTO, key->l4proto);
+
+	switch(key->l3proto) {
+	case AF_INET:
+		nfct_set_attr_u32(ct, ATTR_IPV4_SRC, key->src[0]);
+		nfct_set_attr_u32(ct, ATTR_IPV4_DST, key->dst[0]);
+		break;
+	case AF_INET6:
+		nfct_set_attr(ct, ATTR_IPV6_SRC, key->src);
+		nfct_set_attr(ct, ATTR_IPV6_DST, key->dst);
+		break;
+	}
 
-	memcpy(&a[0], nfct_get_attr(ct, ATTR_IPV6_SRC), sizeof(uint32_t)*4);
-	memcpy(&a[4], nfct_get_attr(ct, ATTR_IPV6_SRC), sizeof(uint32_t)*4);
-	a[8] = nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO) << 16 |
-	       nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO);
-	a[9] = nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC) << 16 |
-	       nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST);
+	switch(key->l4proto) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		nfct_set_attr_u16(ct, ATTR_ICMP_ID, key->sport);
+		nfct_set_attr_u8(ct, ATTR_ICMP_TYPE, key->dport >> 8);
+		nfct_set_attr_u8(ct, ATTR_ICMP_CODE, key->dport & 0xff);
+		break;
+	default:
+		nfct_set_attr_u16(ct, ATTR_PORT_SRC, key->sport);
+		nfct_set_attr_u16(ct, ATTR_PORT_DST, key->dport);
+		break;
+	}
 
-	return ((uint64_t)jhash2(a, 10, 0) * table->hashsize) >> 32;
+	return BUILD_NETMSG_FROM_CT(ct, type);
 }
 
-static uint32_t
-cache_ct_hash(const void *data, const struct hashtable *table)
+static void cache_ct_getkey(struct cache_key *key, const void *ptr)
 {
-	int ret = 0;
-	const struct nf_conntrack *ct = data;
+	cache_ct_key(key, ptr);
+}
 
-	switch(nfct_get_attr_u8(ct, ATTR_L3PROTO)) {
-		case AF_INET:
-			ret = cache_hash4_ct(ct, table);
-			break;
-		case AF_INET6:
-			ret = cache_hash6_ct(ct, table);
-			break;
-		default:
-			dlog(LOG_ERR, "unknown layer 3 proto in hash");
-			break;
+static int cache_ct_index(int type, const struct cache_object *obj,
+			  const void *ptr, struct cache_index_key *key)
+{
+	const struct nf_conntrack *ct = ptr;
+
+	switch(type) {
+	case CACHE_INDEX_MARK:
+		if (!nfct_attr_is_set(ct, ATTR_MARK))
+			return -1;
+		key->value[0] = nfct_get_attr_u32(ct, ATTR_MARK);
+		break;
+	case CACHE_INDEX_ZONE:
+		key->value[0] = obj->key.zone;
+		break;
+	case CACHE_INDEX_SOURCE:
+		key->family = obj->key.l3proto;
+		memcpy(key->value, obj->key.src, sizeof(key->value));
+		break;
 	}
-	return ret;
+	return 0;
+}
+
+static uint32_t
+cache_ct_hash(const void *data, const struct hashtable *table)
+{
+	/* the ID is left out, it is only compared. */
+	return jhash2(data, offsetof(struct cache_key, id) / sizeof(uint32_t), 0);
 }
 
 static int cache_ct_cmp(const void *data1, const void *data2)
 {
 	const struct cache_object *obj = data1;
-	const struct nf_conntrack *ct = data2;
+	const struct cache_key *key = data2;
 
-	return nfct_cmp(obj->ptr, ct, NFCT_CMP_ORIG) &&
-	       nfct_get_attr_u32(obj->ptr, ATTR_ID) ==
-	       nfct_get_attr_u32(ct, ATTR_ID);
+	return memcmp(&obj->key, key, sizeof(struct cache_key)) == 0;
 }
 
 static void *cache_ct_alloc(void)
@@ -108,9 +182,113 @@ static void cache_ct_free(void *ptr)
 	nfct_destroy(ptr);
 }
 
-static void cache_ct_copy(void *dst, void *src, unsigned int flags)
+/* payloads with memory allocated by the library cannot be recycled, the
+ * override copy on reuse would leak it. */
+static int cache_ct_reuse(const void *ptr)
+{
+	return !nfct_attr_is_set(ptr, ATTR_HELPER_INFO) &&
+	       !nfct_attr_is_set(ptr, ATTR_SECCTX) &&
+	       !nfct_attr_is_set(ptr, ATTR_CONNLABELS);
+}
+
+static size_t cache_ct_size(const void *ptr)
+{
+	return nfct_maxsize();
+}
+
+static int cache_ct_evict(const void *ptr)
+{
+	if (nfct_attr_is_set(ptr, ATTR_TCP_STATE)) {
+		switch(nfct_get_attr_u8(ptr, ATTR_TCP_STATE)) {
+		case TCP_CONNTRACK_SYN_SENT:
+		case TCP_CONNTRACK_SYN_RECV:
+			return CACHE_EVICT_HALFOPEN;
+		}
+	}
+	if (!nfct_attr_is_set(ptr, ATTR_STATUS))
+		return -1;
+
+	if (!(nfct_get_attr_u32(ptr, ATTR_STATUS) & IPS_ASSURED))
+		return CACHE_EVICT_UNASSURED;
+
+	return CACHE_EVICT_IDLE;
+}
+
+static void *cache_ct_copy(void *dst, void *src, unsigned int flags)
 {
 	nfct_copy(dst, src, flags);
+	return dst;
+}
+
+/* attributes that an update may change, and the CACHE_A_* bit of each. */
+static const struct {
+	enum nf_conntrack_attr	attr;
+	int			size;
+	int			type;
+} cache_ct_attrs[] = {
+	{ ATTR_STATUS,		sizeof(uint32_t),	CACHE_A_STATUS },
+	{ ATTR_TCP_STATE,	sizeof(uint8_t),	CACHE_A_PROTOINFO },
+	{ ATTR_TCP_WSCALE_ORIG,	sizeof(uint8_t),	CACHE_A_PROTOINFO },
+	{ ATTR_TCP_WSCALE_REPL,	sizeof(uint8_t),	CACHE_A_PROTOINFO },
+	{ ATTR_SCTP_STATE,	sizeof(uint8_t),	CACHE_A_PROTOINFO },
+	{ ATTR_SCTP_VTAG_ORIG,	sizeof(uint32_t),	CACHE_A_PROTOINFO },
+	{ ATTR_SCTP_VTAG_REPL,	sizeof(uint32_t),	CACHE_A_PROTOINFO },
+	{ ATTR_DCCP_STATE,	sizeof(uint8_t),	CACHE_A_PROTOINFO },
+	{ ATTR_DCCP_ROLE,	sizeof(uint8_t),	CACHE_A_PROTOINFO },
+	{ ATTR_TIMEOUT,		sizeof(uint32_t),	CACHE_A_TIMEOUT },
+	{ ATTR_MARK,		sizeof(uint32_t),	CACHE_A_MARK },
+	{ ATTR_ORIG_NAT_SEQ_CORRECTION_POS, sizeof(uint32_t), CACHE_A_NATSEQ },
+	{ ATTR_ORIG_NAT_SEQ_OFFSET_BEFORE, sizeof(uint32_t), CACHE_A_NATSEQ },
+	{ ATTR_ORIG_NAT_SEQ_OFFSET_AFTER, sizeof(uint32_t), CACHE_A_NATSEQ },
+	{ ATTR_REPL_NAT_SEQ_CORRECTION_POS, sizeof(uint32_t), CACHE_A_NATSEQ },
+	{ ATTR_REPL_NAT_SEQ_OFFSET_BEFORE, sizeof(uint32_t), CACHE_A_NATSEQ },
+	{ ATTR_REPL_NAT_SEQ_OFFSET_AFTER, sizeof(uint32_t), CACHE_A_NATSEQ },
+	{ ATTR_TCP_FLAGS_ORIG,	sizeof(uint8_t),	CACHE_A_OTHER },
+	{ ATTR_TCP_FLAGS_REPL,	sizeof(uint8_t),	CACHE_A_OTHER },
+	{ ATTR_SECMARK,		sizeof(uint32_t),	CACHE_A_OTHER },
+};
+
+static uint32_t cache_ct_diff(const void *old, const void *update)
+{
+	uint32_t dirty = 0;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(cache_ct_attrs)/sizeof(cache_ct_attrs[0]); i++) {
+		enum nf_conntrack_attr attr = cache_ct_attrs[i].attr;
+
+		if (dirty & (1 << cache_ct_attrs[i].type) ||
+		    !nfct_attr_is_set(update, attr))
+			continue;
+
+		if (!nfct_attr_is_set(old, attr)) {
+			dirty |= (1 << cache_ct_attrs[i].type);
+			continue;
+		}
+		if (cache_ct_attrs[i].size == sizeof(uint32_t)) {
+			if (nfct_get_attr_u32(old, attr) ==
+			    nfct_get_attr_u32(update, attr))
+				continue;
+		} else {
+			if (nfct_get_attr_u8(old, attr) ==
+			    nfct_get_attr_u8(update, attr))
+				continue;
+		}
+		dirty |= (1 << cache_ct_attrs[i].type);
+	}
+
+	if (nfct_attr_is_set(update, ATTR_HELPER_NAME) &&
+	    (!nfct_attr_is_set(old, ATTR_HELPER_NAME) ||
+	     strcmp(nfct_get_attr(old, ATTR_HELPER_NAME),
+		    nfct_get_attr(update, ATTR_HELPER_NAME)) != 0))
+		dirty |= (1 << CACHE_A_HELPER);
+
+	/* not worth comparing, they rarely come with updates. */
+	if (nfct_attr_is_set(update, ATTR_CONNLABELS) ||
+	    nfct_attr_is_set(update, ATTR_SECCTX) ||
+	    nfct_attr_is_set(update, ATTR_HELPER_INFO))
+		dirty |= (1 << CACHE_A_OTHER);
+
+	return dirty;
 }
 
 static int cache_ct_dump_step(void *data1, void *n)
@@ -119,6 +297,7 @@ static int cache_ct_dump_step(void *data1, void *n)
 	int size;
 	struct __dump_container *container = data1;
 	struct cache_object *obj = n;
+	struct nf_conntrack *ct;
 	char *data = obj->data;
 	unsigned i;
 
@@ -135,14 +314,18 @@ static int cache_ct_dump_step(void *data1, void *n)
 	if (CONFIG(flags) & CTD_SYNC_FTFW && obj->status == C_OBJ_DEAD)
 		return 0;
 
+	ct = cache_object_ptr(obj);
+	if (ct == NULL)
+		return 0;
+
 	/* do not show cached timeout, this may confuse users */
-	if (nfct_attr_is_set(obj->ptr, ATTR_TIMEOUT))
-		nfct_attr_unset(obj->ptr, ATTR_TIMEOUT);
+	if (nfct_attr_is_set(ct, ATTR_TIMEOUT))
+		nfct_attr_unset(ct, ATTR_TIMEOUT);
 
 	memset(buf, 0, sizeof(buf));
 	size = nfct_snprintf(buf, 
 			     sizeof(buf), 
-			     obj->ptr,
+			     ct,
 			     NFCT_T_UNKNOWN, 
 			     container->type,
 			     0);
@@ -157,63 +340,142 @@ static int cache_ct_dump_step(void *data1, void *n)
 		}
 	}
 	if (container->type != NFCT_O_XML) {
-		long tm = time(NULL);
+		long tm = time_cached();
 		size += sprintf(buf+size, " [active since %lds]",
 				tm - obj->lifetime);
 	}
 	size += sprintf(buf+size, "\n");
-	if (send(container->fd, buf, size, 0) == -1) {
-		if (errno != EPIPE)
-			return -1;
-	}
 
-	return 0;
+	return cache_dump_write(container, buf, size);
+}
+
+/* estimation of the timeout that the conntrack has left. */
+static int cache_ct_commit_timeout(const struct cache_object *obj)
+{
+	int timeout;
+
+	if (CONFIG(commit_timeout))
+		return CONFIG(commit_timeout);
+
+	/* monotonic clock, this never goes negative. */
+	timeout = time_cached() - obj->lastupdate;
+	/* calculate an estimation of the current timeout */
+	timeout = nfct_get_attr_u32(obj->ptr, ATTR_TIMEOUT) - timeout;
+	if (timeout < 0)
+		timeout = 60;
+
+	return timeout;
+}
+
+static void cache_ct_commit_error(struct cache *c,
+				  const struct cache_object *obj,
+				  const char *what, int error)
+{
+	dlog(LOG_ERR, "commit-%s: %s", what, strerror(error));
+	dlog_ct(STATE(log), obj->ptr, NFCT_O_PLAIN);
+	c->stats.commit_fail++;
+}
+
+/*
+ * Entries are created in batches of netlink messages. Those that already
+ * exist in the kernel are collected and handled in a second pass, which
+ * destroys them in one batch and creates them again in another.
+ */
+static struct cache_object *commit_retry[NL_BATCH_MAX];
+static unsigned int commit_retry_num;
+
+static void cache_ct_commit_created(void *data, int error, void *arg)
+{
+	struct __commit_container *tmp = arg;
+	struct cache_object *obj = data;
+
+	if (error == 0)
+		tmp->c->stats.commit_ok++;
+	else if (error == EEXIST && commit_retry_num < NL_BATCH_MAX)
+		commit_retry[commit_retry_num++] = obj;
+	else
+		cache_ct_commit_error(tmp->c, obj, "create", error);
+}
+
+static void cache_ct_commit_destroyed(void *data, int error, void *arg)
+{
+	struct __commit_container *tmp = arg;
+	struct cache_object *obj = data;
+
+	/* the pass is flushed as it goes, so this never overtakes it. */
+	if (error == 0 || error == ENOENT)
+		commit_retry[commit_retry_num++] = obj;
+	else
+		cache_ct_commit_error(tmp->c, obj, "destroy", error);
+}
+
+static void cache_ct_commit_recreated(void *data, int error, void *arg)
+{
+	struct __commit_container *tmp = arg;
+	struct cache_object *obj = data;
+
+	if (error == 0)
+		tmp->c->stats.commit_ok++;
+	else
+		cache_ct_commit_error(tmp->c, obj, "create", error);
 }
 
 static void
-cache_ct_commit_step(struct __commit_container *tmp, struct cache_object *obj)
+cache_ct_commit_pass(struct __commit_container *tmp, int create,
+		     void (*cb)(void *data, int error, void *arg))
 {
-	int ret, retry = 1, timeout;
-	struct nf_conntrack *ct = obj->ptr;
-
-	if (CONFIG(commit_timeout)) {
-		timeout = CONFIG(commit_timeout);
-	} else {
-		timeout = time(NULL) - obj->lastupdate;
-		if (timeout < 0) {
-			/* XXX: Arbitrarily set the timer to one minute, how
-			 * can this happen? For example, an adjustment due to
-			 * daylight-saving. Probably other situations can
-			 * trigger this. */
-			timeout = 60;
-		}
-		/* calculate an estimation of the current timeout */
-		timeout = nfct_get_attr_u32(ct, ATTR_TIMEOUT) - timeout;
-		if (timeout < 0) {
-			timeout = 60;
-		}
-	}
+	struct nl_batch *b = STATE_SYNC(commit).batch;
+	unsigned int i, num = commit_retry_num;
 
+	commit_retry_num = 0;
+	for (i = 0; i < num; i++) {
+		struct cache_object *obj = commit_retry[i];
+		int ret;
 retry:
-	if (nl_create_conntrack(tmp->h, ct, timeout) == -1) {
-		if (errno == EEXIST && retry == 1) {
-			ret = nl_destroy_conntrack(tmp->h, ct);
-			if (ret == 0 || (ret == -1 && errno == ENOENT)) {
-				if (retry) {
-					retry = 0;
-					goto retry;
-				}
+		if (create) {
+			ret = nl_batch_create_conntrack(b, obj->ptr,
+						cache_ct_commit_timeout(obj),
+						obj);
+		} else
+			ret = nl_batch_destroy_conntrack(b, obj->ptr, obj);
+
+		if (ret == -1) {
+			if (errno == ENOSPC && nl_batch_len(b) > 0) {
+				nl_batch_flush(b, cb, tmp);
+				goto retry;
 			}
-			dlog(LOG_ERR, "commit-destroy: %s", strerror(errno));
-			dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
-			tmp->c->stats.commit_fail++;
-		} else {
-			dlog(LOG_ERR, "commit-create: %s", strerror(errno));
-			dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
-			tmp->c->stats.commit_fail++;
+			cache_ct_commit_error(tmp->c, obj,
+					      create ? "create" : "destroy",
+					      errno);
 		}
-	} else {
-		tmp->c->stats.commit_ok++;
+	}
+	nl_batch_flush(b, cb, tmp);
+}
+
+static void cache_ct_commit_flush(struct __commit_container *tmp)
+{
+	commit_retry_num = 0;
+	nl_batch_flush(STATE_SYNC(commit).batch, cache_ct_commit_created, tmp);
+	if (commit_retry_num == 0)
+		return;
+
+	cache_ct_commit_pass(tmp, 0, cache_ct_commit_destroyed);
+	cache_ct_commit_pass(tmp, 1, cache_ct_commit_recreated);
+}
+
+static void
+cache_ct_commit_step(struct __commit_container *tmp, struct cache_object *obj)
+{
+	struct nl_batch *b = STATE_SYNC(commit).batch;
+
+	while (nl_batch_create_conntrack(b, obj->ptr,
+					 cache_ct_commit_timeout(obj),
+					 obj) == -1) {
+		if (errno != ENOSPC || nl_batch_len(b) == 0) {
+			cache_ct_commit_error(tmp->c, obj, "create", errno);
+			return;
+		}
+		cache_ct_commit_flush(tmp);
 	}
 }
 
@@ -255,38 +517,40 @@ static int cache_ct_commit(struct cache *c, struct nfct_handle *h, int clientfd)
 
 	switch(STATE_SYNC(commit).state) {
 	case COMMIT_STATE_INACTIVE:
-		gettimeofday(&STATE_SYNC(commit).stats.start, NULL);
+		gettime(&STATE_SYNC(commit).stats.start);
 		STATE_SYNC(commit).stats.ok = c->stats.commit_ok;
 		STATE_SYNC(commit).stats.fail = c->stats.commit_fail;
 		STATE_SYNC(commit).clientfd = clientfd;
 	case COMMIT_STATE_MASTER:
-		STATE_SYNC(commit).current =
-			hashtable_iterate_limit(c->h, &tmp,
-						STATE_SYNC(commit).current,
-						CONFIG(general).commit_steps,
-						cache_ct_commit_master);
-		if (STATE_SYNC(commit).current < CONFIG(hashsize)) {
+		if (hashtable_iterate_limit(c->h, &tmp,
+					    &STATE_SYNC(commit).current,
+					    CONFIG(general).commit_steps,
+					    cache_ct_commit_master) > 0) {
+			cache_ct_commit_flush(&tmp);
 			STATE_SYNC(commit).state = COMMIT_STATE_MASTER;
 			/* give it another step as soon as possible */
 			write_evfd(STATE_SYNC(commit).evfd);
 			return 1;
 		}
+		/* masters have to be there before their related entries */
+		cache_ct_commit_flush(&tmp);
 		STATE_SYNC(commit).current = 0;
 		STATE_SYNC(commit).state = COMMIT_STATE_RELATED;
 	case COMMIT_STATE_RELATED:
-		STATE_SYNC(commit).current =
-			hashtable_iterate_limit(c->h, &tmp,
-						STATE_SYNC(commit).current,
-						CONFIG(general).commit_steps,
-						cache_ct_commit_related);
-		if (STATE_SYNC(commit).current < CONFIG(hashsize)) {
+		if (hashtable_iterate_limit(c->h, &tmp,
+					    &STATE_SYNC(commit).current,
+					    CONFIG(general).commit_steps,
+					    cache_ct_commit_related) > 0) {
+			cache_ct_commit_flush(&tmp);
 			STATE_SYNC(commit).state = COMMIT_STATE_RELATED;
 			/* give it another step as soon as possible */
 			write_evfd(STATE_SYNC(commit).evfd);
 			return 1;
 		}
+		cache_ct_commit_flush(&tmp);
+
 		/* calculate the time that commit has taken */
-		gettimeofday(&commit_stop, NULL);
+		gettime(&commit_stop);
 		timersub(&commit_stop, &STATE_SYNC(commit).stats.start, &res);
 
 		/* calculate new entries committed */
@@ -301,8 +565,15 @@ static int cache_ct_commit(struct cache *c, struct nfct_handle *h, int clientfd)
 			dlog(LOG_NOTICE, "%u entries can't be "
 					 "committed", commit_fail);
 
-		dlog(LOG_NOTICE, "commit has taken %lu.%06lu seconds", 
-				res.tv_sec, res.tv_usec);
+		STATE_SYNC(commit).stats.last_ok = commit_ok;
+		STATE_SYNC(commit).stats.last_usecs =
+			(uint64_t)res.tv_sec * 1000000 + res.tv_usec;
+
+		dlog(LOG_NOTICE, "commit has taken %lu.%06lu seconds "
+				 "(%llu entries/s)",
+				res.tv_sec, res.tv_usec,
+				(unsigned long long)commit_ok * 1000000 /
+				(STATE_SYNC(commit).stats.last_usecs + 1));
 
 		/* prepare the state machine for new commits */
 		STATE_SYNC(commit).current = 0;
@@ -319,25 +590,278 @@ cache_ct_build_msg(const struct cache_object *obj, int type)
 	return BUILD_NETMSG_FROM_CT(obj->ptr, type);
 }
 
+/*
+ * Wire format payload: the NTA attributes of the conntrack, encoded once
+ * by ct2msg() and kept in network byte order, so transmissions copy them
+ * verbatim. Updates patch the fixed-size attributes in place, we only
+ * decode and re-encode if the set of attributes changes.
+ */
+struct cache_wire {
+	uint16_t	len;		/* bytes of attributes */
+	uint16_t	size;		/* bytes allocated for attributes */
+	unsigned char	data[0];
+};
+
+#define CACHE_WIRE_ALIGN	32
+#define CACHE_WIRE_BUFSIZ	4096
+
+/* attributes that change during the lifetime of a conntrack. */
+static const struct {
+	enum nf_conntrack_attr	attr;
+	int			nta;
+	int			size;
+} wire_patch[] = {
+	{ ATTR_STATUS,		NTA_STATUS,		sizeof(uint32_t) },
+	{ ATTR_TIMEOUT,		NTA_TIMEOUT,		sizeof(uint32_t) },
+	{ ATTR_MARK,		NTA_MARK,		sizeof(uint32_t) },
+	{ ATTR_TCP_STATE,	NTA_TCP_STATE,		sizeof(uint8_t) },
+	{ ATTR_TCP_WSCALE_ORIG,	NTA_TCP_WSCALE_ORIG,	sizeof(uint8_t) },
+	{ ATTR_TCP_WSCALE_REPL,	NTA_TCP_WSCALE_REPL,	sizeof(uint8_t) },
+	{ ATTR_SCTP_STATE,	NTA_SCTP_STATE,		sizeof(uint8_t) },
+	{ ATTR_SCTP_VTAG_ORIG,	NTA_SCTP_VTAG_ORIG,	sizeof(uint32_t) },
+	{ ATTR_SCTP_VTAG_REPL,	NTA_SCTP_VTAG_REPL,	sizeof(uint32_t) },
+	{ ATTR_DCCP_STATE,	NTA_DCCP_STATE,		sizeof(uint8_t) },
+	{ ATTR_DCCP_ROLE,	NTA_DCCP_ROLE,		sizeof(uint8_t) },
+};
+
+static const enum nf_conntrack_attr wire_natseq[] =
+	{ ATTR_ORIG_NAT_SEQ_CORRECTION_POS, ATTR_ORIG_NAT_SEQ_OFFSET_BEFORE,
+	  ATTR_ORIG_NAT_SEQ_OFFSET_AFTER, ATTR_REPL_NAT_SEQ_CORRECTION_POS,
+	  ATTR_REPL_NAT_SEQ_OFFSET_BEFORE, ATTR_REPL_NAT_SEQ_OFFSET_AFTER };
+
+static struct nf_conntrack *wire_ct;
+
+static void *cache_wire_alloc(void)
+{
+	struct cache_wire *w;
+
+	w = malloc(sizeof(struct cache_wire) + CACHE_WIRE_ALIGN * 3);
+	if (w == NULL)
+		return NULL;
+
+	w->len = 0;
+	w->size = CACHE_WIRE_ALIGN * 3;
+	return w;
+}
+
+static size_t cache_wire_size(const void *ptr)
+{
+	const struct cache_wire *w = ptr;
+
+	return sizeof(struct cache_wire) + w->size;
+}
+
+static void cache_wire_free(void *ptr)
+{
+	free(ptr);
+}
+
+/* store the attributes of this message, reallocate if they do not fit. */
+static struct cache_wire *
+cache_wire_store(struct cache_wire *w, const struct nethdr *net)
+{
+	size_t len = net->len - NETHDR_SIZ;
+
+	if (len > w->size) {
+		size_t size = (len + CACHE_WIRE_ALIGN - 1) &
+			      ~(CACHE_WIRE_ALIGN - 1);
+
+		w = realloc(w, sizeof(struct cache_wire) + size);
+		if (w == NULL)
+			return NULL;
+		w->size = size;
+	}
+	memcpy(w->data, NETHDR_DATA(net), len);
+	w->len = len;
+	return w;
+}
+
+static struct nf_conntrack *cache_wire_decode(const struct cache_wire *w)
+{
+	static char buf[CACHE_WIRE_BUFSIZ];
+	struct nethdr *net = (struct nethdr *) buf;
+
+	if (wire_ct == NULL) {
+		wire_ct = nfct_new();
+		if (wire_ct == NULL)
+			return NULL;
+	}
+	cache_ct_clear(wire_ct);
+
+	memset(net, 0, NETHDR_SIZ);
+	memcpy(NETHDR_DATA(net), w->data, w->len);
+	net->len = NETHDR_SIZ + w->len;
+
+	/* msg2ct() converts the attributes to host byte order in place. */
+	if (msg2ct(wire_ct, net, net->len) == -1)
+		return NULL;
+
+	return wire_ct;
+}
+
+static int cache_wire_encoded(enum nf_conntrack_attr attr)
+{
+	switch(attr) {
+	case ATTR_TIMEOUT:
+		return !CONFIG(commit_timeout);
+	case ATTR_TCP_WSCALE_ORIG:
+	case ATTR_TCP_WSCALE_REPL:
+		return CONFIG(sync).tcp_window_tracking;
+	default:
+		return 1;
+	}
+}
+
+/* update the attributes in place, returns -1 if they cannot be patched. */
+static int cache_wire_patch(struct cache_wire *w, const struct nf_conntrack *ct)
+{
+	struct netattr *nta;
+	unsigned int i, found = 0;
+	int len = w->len;
+
+	if (nfct_attr_is_set_array(ct, wire_natseq, 6) ||
+	    nfct_attr_is_set(ct, ATTR_HELPER_NAME) ||
+	    nfct_attr_grp_is_set(ct, ATTR_GRP_MASTER_IPV4) ||
+	    nfct_attr_grp_is_set(ct, ATTR_GRP_MASTER_IPV6))
+		return -1;
+
+	nta = (struct netattr *) w->data;
+	while (len >= (int)sizeof(struct netattr)) {
+		int nta_len = ntohs(nta->nta_len);
+		int nta_attr = ntohs(nta->nta_attr);
+
+		if (nta_len < (int)sizeof(struct netattr) || nta_len > len)
+			return -1;
+
+		for (i = 0; i < sizeof(wire_patch)/sizeof(wire_patch[0]); i++) {
+			uint32_t val;
+
+			if (wire_patch[i].nta != nta_attr)
+				continue;
+
+			found |= (1 << i);
+			if (!nfct_attr_is_set(ct, wire_patch[i].attr))
+				break;
+
+			if (wire_patch[i].size == sizeof(uint32_t)) {
+				val = htonl(nfct_get_attr_u32(ct,
+							wire_patch[i].attr));
+				memcpy(NTA_DATA(nta), &val, sizeof(val));
+			} else {
+				*((uint8_t *) NTA_DATA(nta)) =
+					nfct_get_attr_u8(ct, wire_patch[i].attr);
+			}
+			break;
+		}
+		len -= NTA_ALIGN(nta_len);
+		nta = (struct netattr *)((char *)nta + NTA_ALIGN(nta_len));
+	}
+
+	/* an attribute that we do not have yet, encode it again. */
+	for (i = 0; i < sizeof(wire_patch)/sizeof(wire_patch[0]); i++) {
+		if (!(found & (1 << i)) &&
+		    nfct_attr_is_set(ct, wire_patch[i].attr) &&
+		    cache_wire_encoded(wire_patch[i].attr))
+			return -1;
+	}
+	return 0;
+}
+
+static void *cache_wire_copy(void *dst, void *src, unsigned int flags)
+{
+	static char buf[CACHE_WIRE_BUFSIZ];
+	struct nethdr *net = (struct nethdr *) buf;
+	struct cache_wire *w = dst;
+	const struct nf_conntrack *ct = src;
+
+	if (flags == NFCT_CP_META) {
+		if (cache_wire_patch(w, ct) == 0)
+			return w;
+
+		/* merge the update with what we have, as nfct_copy() does. */
+		ct = cache_wire_decode(w);
+		if (ct == NULL)
+			return NULL;
+		nfct_copy(wire_ct, src, NFCT_CP_META);
+	}
+
+	memset(net, 0, NETHDR_SIZ);
+	net->len = NETHDR_SIZ;
+	ct2msg(ct, net);
+
+	return cache_wire_store(w, net);
+}
+
+static void *cache_wire_object(const struct cache_object *obj)
+{
+	return cache_wire_decode(obj->ptr);
+}
+
+static struct nethdr *
+cache_wire_build_msg(const struct cache_object *obj, int type)
+{
+	static char buf[CACHE_WIRE_BUFSIZ];
+	struct nethdr *net = (struct nethdr *) buf;
+	const struct cache_wire *w = obj->ptr;
+
+	memset(net, 0, NETHDR_SIZ);
+	nethdr_set(net, type);
+	memcpy(NETHDR_DATA(net), w->data, w->len);
+	net->len += w->len;
+	HDR_HOST2NETWORK(net);
+
+	return net;
+}
+
 /* template to cache conntracks coming from the kernel. */
 struct cache_ops cache_sync_internal_ct_ops = {
+	.key		= cache_ct_getkey,
+	.index		= cache_ct_index,
 	.hash		= cache_ct_hash,
 	.cmp		= cache_ct_cmp,
 	.alloc		= cache_ct_alloc,
 	.free		= cache_ct_free,
+	.reuse		= cache_ct_reuse,
+	.size		= cache_ct_size,
+	.evict		= cache_ct_evict,
 	.copy		= cache_ct_copy,
+	.diff		= cache_ct_diff,
 	.dump_step	= cache_ct_dump_step,
 	.commit		= NULL,
 	.build_msg	= cache_ct_build_msg,
 };
 
+/* template to cache conntracks coming from the kernel in wire format. */
+struct cache_ops cache_sync_internal_wire_ct_ops = {
+	.key		= cache_ct_getkey,
+	.index		= cache_ct_index,
+	.hash		= cache_ct_hash,
+	.cmp		= cache_ct_cmp,
+	.alloc		= cache_wire_alloc,
+	.free		= cache_wire_free,
+	.size		= cache_wire_size,
+	.evict		= cache_ct_evict,
+	.copy		= cache_wire_copy,
+	.decode		= cache_wire_object,
+	.diff		= cache_ct_diff,
+	.dump_step	= cache_ct_dump_step,
+	.commit		= NULL,
+	.build_msg	= cache_wire_build_msg,
+};
+
 /* template to cache conntracks coming from the network. */
 struct cache_ops cache_sync_external_ct_ops = {
+	.key		= cache_ct_getkey,
+	.index		= cache_ct_index,
 	.hash		= cache_ct_hash,
 	.cmp		= cache_ct_cmp,
 	.alloc		= cache_ct_alloc,
 	.free		= cache_ct_free,
+	.reuse		= cache_ct_reuse,
+	.size		= cache_ct_size,
+	.evict		= cache_ct_evict,
 	.copy		= cache_ct_copy,
+	.diff		= cache_ct_diff,
 	.dump_step	= cache_ct_dump_step,
 	.commit		= cache_ct_commit,
 	.build_msg	= NULL,
@@ -345,11 +869,16 @@ struct cache_ops cache_sync_external_ct_ops = {
 
 /* template to cache conntracks for the statistics mode. */
 struct cache_ops cache_stats_ct_ops = {
+	.key		= cache_ct_getkey,
 	.hash		= cache_ct_hash,
 	.cmp		= cache_ct_cmp,
 	.alloc		= cache_ct_alloc,
 	.free		= cache_ct_free,
+	.reuse		= cache_ct_reuse,
+	.size		= cache_ct_size,
+	.evict		= cache_ct_evict,
 	.copy		= cache_ct_copy,
+	.diff		= cache_ct_diff,
 	.dump_step	= cache_ct_dump_step,
 	.commit		= NULL,
 	.build_msg	= NULL,
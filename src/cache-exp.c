@@ -43,14 +43,7 @@ cache_hash4_exp(const struct nf_conntrack *ct, const struct hashtable *table)
 			  nfct_get_attr_u16(ct, ATTR_PORT_DST),
 	};
 
-	/*
-	 * Instead of returning hash % table->hashsize (implying a divide)
-	 * we return the high 32 bits of the (hash * table->hashsize) that will
-	 * give results between [0 and hashsize-1] and same hash distribution,
-	 * but using a multiply, less expensive than a divide. See:
-	 * http://www.mail-archive.com/netdev@vger.kernel.org/msg56623.html
-	 */
-	return ((uint64_t)jhash2(a, 4, 0) * table->hashsize) >> 32;
+	return jhash2(a, 4, 0);
 }
 
 static uint32_t
@@ -65,7 +58,7 @@ cache_hash6_exp(const struct nf_conntrack *ct, const struct hashtable *table)
 	a[9] = nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC) << 16 |
 	       nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST);
 
-	return ((uint64_t)jhash2(a, 10, 0) * table->hashsize) >> 32;
+	return jhash2(a, 10, 0);
 }
 
 static uint32_t
@@ -107,10 +100,11 @@ static void cache_exp_free(void *ptr)
 	nfexp_destroy(ptr);
 }
 
-static void cache_exp_copy(void *dst, void *src, unsigned int flags)
+static void *cache_exp_copy(void *dst, void *src, unsigned int flags)
 {
 	/* XXX: add nfexp_copy(...) to libnetfilter_conntrack. */
 	memcpy(dst, src, nfexp_maxsize());
+	return dst;
 }
 
 static int cache_exp_dump_step(void *data1, void *n)
@@ -152,17 +146,13 @@ static int cache_exp_dump_step(void *data1, void *n)
 		}
 	}
 	if (container->type != NFCT_O_XML) {
-		long tm = time(NULL);
+		long tm = time_cached();
 		size += sprintf(buf+size, " [active since %lds]",
 				tm - obj->lifetime);
 	}
 	size += sprintf(buf+size, "\n");
-	if (send(container->fd, buf, size, 0) == -1) {
-		if (errno != EPIPE)
-			return -1;
-	}
 
-	return 0;
+	return cache_dump_write(container, buf, size);
 }
 
 static int cache_exp_commit_step(void *data, void *n)
@@ -175,14 +165,8 @@ static int cache_exp_commit_step(void *data, void *n)
 	if (CONFIG(commit_timeout)) {
 		timeout = CONFIG(commit_timeout);
 	} else {
-		timeout = time(NULL) - obj->lastupdate;
-		if (timeout < 0) {
-			/* XXX: Arbitrarily set the timer to one minute, how
-			 * can this happen? For example, an adjustment due to
-			 * daylight-saving. Probably other situations can
-			 * trigger this. */
-			timeout = 60;
-		}
+		/* monotonic clock, this never goes negative. */
+		timeout = time_cached() - obj->lastupdate;
 		/* calculate an estimation of the current timeout */
 		timeout = nfexp_get_attr_u32(exp, ATTR_EXP_TIMEOUT) - timeout;
 		if (timeout < 0) {
@@ -232,17 +216,15 @@ cache_exp_commit(struct cache *c, struct nfct_handle *h, int clientfd)
 
 	switch(STATE_SYNC(commit).state) {
 	case COMMIT_STATE_INACTIVE:
-		gettimeofday(&STATE_SYNC(commit).stats.start, NULL);
+		gettime(&STATE_SYNC(commit).stats.start);
 		STATE_SYNC(commit).stats.ok = c->stats.commit_ok;
 		STATE_SYNC(commit).stats.fail = c->stats.commit_fail;
 		STATE_SYNC(commit).clientfd = clientfd;
 	case COMMIT_STATE_MASTER:
-		STATE_SYNC(commit).current =
-			hashtable_iterate_limit(c->h, &tmp,
-						STATE_SYNC(commit).current,
-						CONFIG(general).commit_steps,
-						cache_exp_commit_step);
-		if (STATE_SYNC(commit).current < CONFIG(hashsize)) {
+		if (hashtable_iterate_limit(c->h, &tmp,
+					    &STATE_SYNC(commit).current,
+					    CONFIG(general).commit_steps,
+					    cache_exp_commit_step) > 0) {
 			STATE_SYNC(commit).state = COMMIT_STATE_MASTER;
 			/* give it another step as soon as possible */
 			write_evfd(STATE_SYNC(commit).evfd);
@@ -250,7 +232,7 @@ cache_exp_commit(struct cache *c, struct nfct_handle *h, int clientfd)
 		}
 
 		/* calculate the time that commit has taken */
-		gettimeofday(&commit_stop, NULL);
+		gettime(&commit_stop);
 		timersub(&commit_stop, &STATE_SYNC(commit).stats.start, &res);
 
 		/* calculate new entries committed */
@@ -17,22 +17,593 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+/* before jhash.h, which defines u32 as a macro. */
+#include <sys/epoll.h>
+
 #include "cache.h"
 #include "jhash.h"
 #include "hash.h"
 #include "log.h"
+#include "fds.h"
 #include "conntrackd.h"
 
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <time.h>
 
 struct cache_feature *cache_feature[CACHE_MAX_FEATURE] = {
 	[TIMER_FEATURE]		= &timer_feature,
+	[PERSIST_FEATURE]	= &persist_feature,
+};
+
+/*
+ * Secondary indexes: every index is a hashtable of keys, each key has the
+ * list of objects that match it. Objects carry one link per index after
+ * their extra area, which also stores the key they are linked with.
+ */
+struct cache_index {
+	enum cache_index_type	type;
+	unsigned int		slot;
+	struct hashtable	*h;
+	uint32_t		link_failed;
+};
+
+struct cache_index_entry {
+	struct hashtable_node	node;
+	struct cache_index_key	key;
+	struct list_head	objects;
+	unsigned int		count;
+};
+
+struct cache_index_link {
+	struct list_head	head;
+	struct cache_index_entry *entry;
+	struct cache_index_key	key;
+};
+
+static const char *cache_index_names[CACHE_INDEX_MAX] = {
+	[CACHE_INDEX_MARK]	= "mark",
+	[CACHE_INDEX_ZONE]	= "zone",
+	[CACHE_INDEX_SOURCE]	= "source",
+};
+
+const char *cache_index_name(int type)
+{
+	if (type < 0 || type >= CACHE_INDEX_MAX)
+		return "unknown";
+
+	return cache_index_names[type];
+}
+
+int cache_index_type(const char *name)
+{
+	int i;
+
+	for (i = 0; i < CACHE_INDEX_MAX; i++) {
+		if (strcasecmp(name, cache_index_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* the source index groups addresses by the prefix set in the config. */
+void cache_index_mask(int type, struct cache_index_key *key)
+{
+	unsigned int i, len;
+
+	if (type != CACHE_INDEX_SOURCE)
+		return;
+
+	len = key->family == AF_INET6 ? CONFIG(general).cache_index_prefix6 :
+					 CONFIG(general).cache_index_prefix4;
+	for (i = 0; i < 4; i++) {
+		uint32_t mask;
+
+		if (len >= 32)
+			mask = 0xffffffff;
+		else if (len == 0)
+			mask = 0;
+		else
+			mask = htonl(~((1U << (32 - len)) - 1));
+
+		key->value[i] &= mask;
+		len = len >= 32 ? len - 32 : 0;
+	}
+}
+
+static uint32_t cache_index_hash(const void *data, const struct hashtable *h)
+{
+	return jhash2(data, sizeof(struct cache_index_key) / sizeof(uint32_t),
+		      0);
+}
+
+static int cache_index_cmp(const void *data1, const void *data2)
+{
+	const struct cache_index_entry *e = data1;
+
+	return memcmp(&e->key, data2, sizeof(struct cache_index_key)) == 0;
+}
+
+static inline struct cache_index_link *
+cache_index_link(const struct cache *c, struct cache_object *obj,
+		 const struct cache_index *idx)
+{
+	return (struct cache_index_link *)((char *) obj + c->index_offset +
+		idx->slot * sizeof(struct cache_index_link));
+}
+
+static inline struct cache_object *
+cache_index_object(const struct cache *c, struct cache_index_link *link,
+		   const struct cache_index *idx)
+{
+	return (struct cache_object *)((char *) link - c->index_offset -
+		idx->slot * sizeof(struct cache_index_link));
+}
+
+static int cache_index_create(struct cache *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < CACHE_INDEX_MAX; i++) {
+		struct cache_index *idx;
+
+		if (!(CONFIG(general).cache_index & (1 << i)))
+			continue;
+
+		idx = calloc(1, sizeof(struct cache_index));
+		if (idx == NULL)
+			return -1;
+
+		idx->type = i;
+		idx->slot = c->index_num;
+		idx->h = hashtable_create(64, CONFIG(limit), HASHTABLE_F_RESIZE,
+					  cache_index_hash, cache_index_cmp);
+		if (idx->h == NULL) {
+			free(idx);
+			return -1;
+		}
+		c->index[i] = idx;
+		c->index_num++;
+	}
+	return 0;
+}
+
+static void cache_index_destroy(struct cache *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < CACHE_INDEX_MAX; i++) {
+		if (c->index[i] == NULL)
+			continue;
+
+		/* the objects are gone at this point, so are the entries. */
+		hashtable_destroy(c->index[i]->h);
+		free(c->index[i]);
+		c->index[i] = NULL;
+	}
+	c->index_num = 0;
+}
+
+static void __cache_index_unlink(struct cache_index *idx,
+				 struct cache_index_link *link)
+{
+	struct cache_index_entry *e = link->entry;
+
+	list_del(&link->head);
+	link->entry = NULL;
+	if (--e->count == 0) {
+		hashtable_del(idx->h, &e->node);
+		free(e);
+	}
+}
+
+static int __cache_index_link(struct cache_index *idx,
+			      struct cache_index_link *link)
+{
+	struct cache_index_entry *e;
+	uint32_t hash;
+
+	hash = hashtable_hash(idx->h, &link->key);
+	e = (struct cache_index_entry *)
+		hashtable_find(idx->h, &link->key, hash);
+	if (e == NULL) {
+		e = calloc(1, sizeof(struct cache_index_entry));
+		if (e == NULL) {
+			idx->link_failed++;
+			return -1;
+		}
+
+		e->key = link->key;
+		INIT_LIST_HEAD(&e->objects);
+		if (hashtable_add(idx->h, &e->node, hash) == -1) {
+			idx->link_failed++;
+			free(e);
+			return -1;
+		}
+	}
+	list_add_tail(&link->head, &e->objects);
+	link->entry = e;
+	e->count++;
+	return 0;
+}
+
+/* set the keys of this object, relink it if it is in the cache already. */
+static void cache_index_update(struct cache *c, struct cache_object *obj,
+			       void *ptr, int update)
+{
+	struct cache_index_key key;
+	unsigned int i;
+
+	for (i = 0; i < CACHE_INDEX_MAX; i++) {
+		struct cache_index *idx = c->index[i];
+		struct cache_index_link *link;
+
+		if (idx == NULL)
+			continue;
+
+		link = cache_index_link(c, obj, idx);
+		memset(&key, 0, sizeof(key));
+		if (c->ops->index(idx->type, obj, ptr, &key) == -1) {
+			/* keep the current key, new objects go to zero. */
+			if (update)
+				key = link->key;
+			else
+				memset(&key, 0, sizeof(key));
+		}
+		cache_index_mask(idx->type, &key);
+
+		if (update && link->entry &&
+		    memcmp(&link->key, &key, sizeof(key)) == 0)
+			continue;
+
+		if (link->entry)
+			__cache_index_unlink(idx, link);
+		link->key = key;
+
+		/* not linked yet if the last attempt failed, try again. */
+		if (update)
+			__cache_index_link(idx, link);
+	}
+}
+
+static void cache_index_add(struct cache *c, struct cache_object *obj)
+{
+	unsigned int i;
+
+	for (i = 0; i < CACHE_INDEX_MAX; i++) {
+		if (c->index[i] == NULL)
+			continue;
+
+		__cache_index_link(c->index[i],
+				   cache_index_link(c, obj, c->index[i]));
+	}
+}
+
+static void cache_index_del(struct cache *c, struct cache_object *obj)
+{
+	unsigned int i;
+
+	for (i = 0; i < CACHE_INDEX_MAX; i++) {
+		struct cache_index_link *link;
+
+		if (c->index[i] == NULL)
+			continue;
+
+		link = cache_index_link(c, obj, c->index[i]);
+		if (link->entry)
+			__cache_index_unlink(c->index[i], link);
+	}
+}
+
+/* run iterate on all the objects that match the query, which may delete
+ * them. Returns the number of objects or -1 if there is no such index. */
+int cache_index_iterate(struct cache *c, const struct cache_index_query *q,
+			void *data, int (*iterate)(void *data1, void *data2))
+{
+	struct cache_index_link *link, *tmp;
+	struct cache_index_entry *e;
+	struct cache_index_key key;
+	struct cache_index *idx;
+	int n = 0;
+
+	if (q->type >= CACHE_INDEX_MAX || c->index[q->type] == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	idx = c->index[q->type];
+
+	key = q->key;
+	cache_index_mask(idx->type, &key);
+
+	e = (struct cache_index_entry *)
+		hashtable_find(idx->h, &key, hashtable_hash(idx->h, &key));
+	if (e == NULL)
+		return 0;
+
+	/* hold the entry, it is released once its last object is gone. */
+	e->count++;
+	list_for_each_entry_safe(link, tmp, &e->objects, head) {
+		n++;
+		if (iterate(data, cache_index_object(c, link, idx)) == -1)
+			break;
+	}
+	if (--e->count == 0) {
+		hashtable_del(idx->h, &e->node);
+		free(e);
+	}
+	return n;
+}
+
+/*
+ * Dumps to UNIX socket clients are taken from a snapshot of the cache and
+ * written without blocking, CACHE_DUMP_STEPS buckets at a time whenever
+ * the socket has room, so a slow reader does not stall the main loop.
+ *
+ * The iteration cursor is a hash value, hence the objects that have not
+ * been visited yet are those whose hash is not below it. Every object
+ * records the cache epoch in which it was added or last changed, and every
+ * dump starts a new epoch: newer objects are skipped, and objects that are
+ * about to change or go away before being visited are written out first,
+ * see cache_snapshot_touch(). This way, the client gets the cache as it
+ * was when it asked for it. The buffered output is bounded by the changes
+ * that happen while the dump is in progress.
+ */
+#define CACHE_DUMP_STEPS	1024
+/* the output buffer is refilled when it goes below this. */
+#define CACHE_DUMP_LOWAT	(256 * 1024)
+/* buffered output that we tolerate before giving up on a dump. */
+#define CACHE_DUMP_MAX		(64 * 1024 * 1024)
+/* socket send buffer that we ask for, the kernel may clamp it. */
+#define CACHE_DUMP_SNDBUF	(4 * 1024 * 1024)
+
+struct cache_snapshot {
+	struct list_head	head;
+	struct cache		*cache;
+	uint32_t		epoch;
+	uint32_t		cursor;		/* next hash to visit */
+	int			fd;
+	int			type;
+	int			done;		/* all buckets visited */
+	int			error;
+	char			*buf;
+	size_t			off;		/* already sent */
+	size_t			len;
+	size_t			size;
 };
 
+static void cache_snapshot_destroy(struct cache_snapshot *s)
+{
+	unregister_fd(s->fd, STATE(fds));
+	close(s->fd);
+	list_del(&s->head);
+	free(s->buf);
+	free(s);
+}
+
+static void __cache_snapshot_touch(struct cache *c, struct cache_object *obj)
+{
+	struct cache_snapshot *s;
+
+	list_for_each_entry(s, &c->snapshots, head) {
+		struct __dump_container tmp = {
+			.fd	= s->fd,
+			.type	= s->type,
+			.snap	= s,
+		};
+
+		if (s->done || s->error || obj->epoch >= s->epoch ||
+		    obj->hashnode.hash < s->cursor)
+			continue;
+
+		if (c->ops->dump_step(&tmp, obj) == -1)
+			s->error = errno;
+	}
+	/* this object is newer than the snapshots in progress. */
+	obj->epoch = c->epoch;
+}
+
+/* called before the object changes or leaves the cache. */
+static inline void
+cache_snapshot_touch(struct cache *c, struct cache_object *obj)
+{
+	if (!list_empty(&c->snapshots))
+		__cache_snapshot_touch(c, obj);
+}
+
+static int cache_snapshot_visit(void *data, void *n)
+{
+	struct __dump_container *container = data;
+	struct cache_object *obj = n;
+
+	/* added after the snapshot or already written out by touch. */
+	if (obj->epoch >= container->snap->epoch)
+		return 0;
+
+	return obj->cache->ops->dump_step(container, obj);
+}
+
+static void cache_snapshot_cb(void *data)
+{
+	struct cache_snapshot *s = data;
+	struct cache *c = s->cache;
+	struct __dump_container tmp = {
+		.fd	= s->fd,
+		.type	= s->type,
+		.snap	= s,
+	};
+	ssize_t ret;
+
+	if (!s->done && !s->error && s->len - s->off < CACHE_DUMP_LOWAT) {
+		ret = hashtable_iterate_limit(c->h, &tmp, &s->cursor,
+					      CACHE_DUMP_STEPS,
+					      cache_snapshot_visit);
+		if (ret == -1)
+			s->error = errno;
+		else if (ret == 0)
+			s->done = 1;
+	}
+
+	while (s->off < s->len && !s->error) {
+		ret = send(s->fd, s->buf + s->off, s->len - s->off,
+			   MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			/* socket is full, wait until the client reads. */
+			if (errno == EAGAIN)
+				return;
+
+			s->error = errno;
+			break;
+		}
+		s->off += ret;
+	}
+	if (s->off == s->len)
+		s->off = s->len = 0;
+
+	if (s->error) {
+		/* the client has gone away, nothing to report. */
+		if (s->error != EPIPE && s->error != ECONNRESET) {
+			dlog(LOG_WARNING, "dump of cache `%s' failed: %s",
+			     c->name, strerror(s->error));
+		}
+		cache_snapshot_destroy(s);
+	} else if (s->done && s->len == 0)
+		cache_snapshot_destroy(s);
+}
+
+/*
+ * The client fd is owned by the dump from now on, it is closed once the
+ * dump has been sent. Returns -1 if the dump cannot be started.
+ */
+int cache_dump_async(struct cache *c, int fd, int type)
+{
+	struct cache_snapshot *s;
+	int size = CACHE_DUMP_SNDBUF;
+
+	s = calloc(1, sizeof(struct cache_snapshot));
+	if (s == NULL)
+		return -1;
+
+	s->cache = c;
+	s->fd = fd;
+	s->type = type;
+	s->epoch = ++c->epoch;
+
+	/* not fatal, we only send less per wake-up. */
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	if (register_fd_events(fd, EPOLLOUT, cache_snapshot_cb, s,
+			       STATE(fds)) == -1) {
+		free(s);
+		return -1;
+	}
+	fds_set_name(fd, "dump", STATE(fds));
+	list_add_tail(&s->head, &c->snapshots);
+
+	return 0;
+}
+
+/* output of the dump_step() callbacks */
+int cache_dump_write(struct __dump_container *container,
+		     const char *buf, int size)
+{
+	struct cache_snapshot *s = container->snap;
+	size_t len;
+	char *tmp;
+
+	if (s == NULL) {
+		if (send(container->fd, buf, size, 0) == -1) {
+			if (errno != EPIPE)
+				return -1;
+		}
+		return 0;
+	}
+
+	if (s->len + size > s->size && s->off > 0) {
+		memmove(s->buf, s->buf + s->off, s->len - s->off);
+		s->len -= s->off;
+		s->off = 0;
+	}
+	if (s->len + size > s->size) {
+		len = s->size ? s->size : CACHE_DUMP_LOWAT;
+		while (len < s->len + size)
+			len *= 2;
+
+		if (len > CACHE_DUMP_MAX) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		tmp = realloc(s->buf, len);
+		if (tmp == NULL)
+			return -1;
+
+		s->buf = tmp;
+		s->size = len;
+	}
+	memcpy(s->buf + s->len, buf, size);
+	s->len += size;
+
+	return 0;
+}
+
+/* CacheMemoryLimit of this cache, the one for this cache goes first. */
+static size_t cache_memory_limit(const char *name)
+{
+	if (strcmp(name, "internal") == 0 &&
+	    CONFIG(general).cache_memory_internal)
+		return CONFIG(general).cache_memory_internal;
+	if (strcmp(name, "external") == 0 &&
+	    CONFIG(general).cache_memory_external)
+		return CONFIG(general).cache_memory_external;
+
+	return CONFIG(general).cache_memory;
+}
+
+/*
+ * The stale objects are visited CACHE_SWEEP_STEPS buckets at a time, once
+ * per run of the main loop, so that a large cache does not stall it.
+ */
+#define CACHE_SWEEP_STEPS	1024
+
+static int cache_sweep_visit(void *data, void *n)
+{
+	struct cache *c = data;
+	struct cache_object *obj = n;
+
+	if (!cache_object_stale(obj))
+		return 0;
+
+	return c->sweep(NULL, obj);
+}
+
+static void cache_sweep_alarm(struct alarm_block *a, void *data)
+{
+	struct cache *c = data;
+
+	if (hashtable_iterate_limit(c->h, c, &c->sweep_cursor,
+				    CACHE_SWEEP_STEPS,
+				    cache_sweep_visit) == 1)
+		add_alarm(&c->sweep_alarm, 0, 0);
+}
+
+/*
+ * Call sweep for every object that has not been seen since the last
+ * cache_generation_next(), in the background. If a sweep is in progress,
+ * it starts over with the new callback.
+ */
+void cache_sweep(struct cache *c, int (*sweep)(void *data1, void *data2))
+{
+	c->sweep = sweep;
+	c->sweep_cursor = 0;
+	add_alarm(&c->sweep_alarm, 0, 0);
+}
+
 struct cache *cache_create(const char *name, enum cache_type type,
 			   unsigned int features, 
 			   struct cache_extra *extra,
@@ -55,6 +626,8 @@ struct cache *cache_create(const char *name, enum cache_type type,
 
 	strcpy(c->name, name);
 	c->type = type;
+	INIT_LIST_HEAD(&c->snapshots);
+	init_alarm(&c->sweep_alarm, c, cache_sweep_alarm);
 
 	for (i = 0; i < CACHE_MAX_FEATURE; i++) {
 		if ((1 << i) & features) {
@@ -98,62 +671,182 @@ struct cache *cache_create(const char *name, enum cache_type type,
 	}
 	c->ops = ops;
 
+	if (ops->index && cache_index_create(c) == -1) {
+		cache_index_destroy(c);
+		free(c->feature_offset);
+		free(c->features);
+		free(c);
+		return NULL;
+	}
+	c->index_offset = size;
+	size += c->index_num * sizeof(struct cache_index_link);
+
 	c->h = hashtable_create(CONFIG(hashsize),
 				CONFIG(limit),
+				CONFIG(general).hash_flags |
+				HASHTABLE_F_RESIZE,
 				c->ops->hash,
 				c->ops->cmp);
 	if (!c->h) {
+		cache_index_destroy(c);
 		free(c->features);
 		free(c->feature_offset);
 		free(c);
 		return NULL;
 	}
 	c->object_size = size;
+	c->memory_limit = cache_memory_limit(name);
+
+	/* objects for the expected number of entries are allocated in bulk
+	 * at startup, HashSize gives us the order of magnitude. */
+	c->slab = slab_create(size, CONFIG(hashsize));
+	if (!c->slab) {
+		hashtable_destroy(c->h);
+		cache_index_destroy(c);
+		free(c->features);
+		free(c->feature_offset);
+		free(c);
+		return NULL;
+	}
+
+	if (c->ops->reuse) {
+		c->payload.max = CONFIG(hashsize);
+		c->payload.ptr = calloc(c->payload.max, sizeof(void *));
+		if (!c->payload.ptr) {
+			slab_destroy(c->slab);
+			hashtable_destroy(c->h);
+			cache_index_destroy(c);
+			free(c->features);
+			free(c->feature_offset);
+			free(c);
+			return NULL;
+		}
+	}
 
 	return c;
 }
 
 void cache_destroy(struct cache *c)
 {
+	struct cache_snapshot *s, *tmp;
+	unsigned int i;
+
+	list_for_each_entry_safe(s, tmp, &c->snapshots, head)
+		cache_snapshot_destroy(s);
+	del_alarm(&c->sweep_alarm);
+
+	/* keep the entries in the file for the next run. */
+	cache_file_close(c);
 	cache_flush(c);
 	hashtable_destroy(c->h);
+	cache_index_destroy(c);
+	for (i = 0; i < c->payload.num; i++)
+		c->ops->free(c->payload.ptr[i]);
+	free(c->payload.ptr);
+	slab_destroy(c->slab);
 	free(c->features);
 	free(c->feature_offset);
 	free(c);
 }
 
-struct cache_object *cache_object_new(struct cache *c, void *ptr)
+static void *cache_payload_alloc(struct cache *c)
+{
+	if (c->payload.num > 0) {
+		c->payload.reused++;
+		return c->payload.ptr[--c->payload.num];
+	}
+	return c->ops->alloc();
+}
+
+static inline size_t cache_payload_size(const struct cache *c,
+					const void *ptr)
+{
+	return c->ops->size ? c->ops->size(ptr) : 0;
+}
+
+static inline int cache_evict_class(const struct cache *c, const void *ptr,
+				    int class)
+{
+	int ret = c->ops->evict ? c->ops->evict(ptr) : -1;
+
+	return ret == -1 ? class : ret;
+}
+
+static void cache_payload_free(struct cache *c, void *ptr)
+{
+	if (c->payload.num < c->payload.max && c->ops->reuse(ptr)) {
+		c->payload.ptr[c->payload.num++] = ptr;
+		return;
+	}
+	c->ops->free(ptr);
+}
+
+struct cache_object *
+cache_object_new_key(struct cache *c, void *ptr, const struct cache_key *key)
 {
 	struct cache_object *obj;
+	void *dst;
 
-	obj = calloc(c->object_size, 1);
+	obj = slab_alloc(c->slab);
 	if (obj == NULL) {
 		errno = ENOMEM;
 		c->stats.add_fail_enomem++;
 		return NULL;
 	}
+	memset(obj, 0, c->object_size);
 	obj->cache = c;
 
-	obj->ptr = c->ops->alloc();
+	obj->ptr = cache_payload_alloc(c);
 	if (obj->ptr == NULL) {
-		free(obj);
+		slab_free(c->slab, obj);
 		errno = ENOMEM;
 		c->stats.add_fail_enomem++;
 		return NULL;
 	}
-	c->ops->copy(obj->ptr, ptr, NFCT_CP_OVERRIDE);
+	dst = c->ops->copy(obj->ptr, ptr, NFCT_CP_OVERRIDE);
+	if (dst == NULL) {
+		c->ops->free(obj->ptr);
+		slab_free(c->slab, obj);
+		errno = ENOMEM;
+		c->stats.add_fail_enomem++;
+		return NULL;
+	}
+	obj->ptr = dst;
+	if (key)
+		obj->key = *key;
+	if (c->index_num)
+		cache_index_update(c, obj, ptr, 0);
+	obj->evict = cache_evict_class(c, ptr, CACHE_EVICT_IDLE);
 	obj->status = C_OBJ_NONE;
 	c->stats.objects++;
+	c->memory += c->object_size + cache_payload_size(c, dst);
 
 	return obj;
 }
 
+struct cache_object *cache_object_new(struct cache *c, void *ptr)
+{
+	struct cache_key key;
+
+	if (c->ops->key) {
+		c->ops->key(&key, ptr);
+		return cache_object_new_key(c, ptr, &key);
+	}
+	return cache_object_new_key(c, ptr, NULL);
+}
+
 void cache_object_free(struct cache_object *obj)
 {
-	obj->cache->stats.objects--;
-	obj->cache->ops->free(obj->ptr);
+	struct cache *c = obj->cache;
+
+	c->stats.objects--;
+	c->memory -= c->object_size + cache_payload_size(c, obj->ptr);
+	if (c->ops->reuse)
+		cache_payload_free(c, obj->ptr);
+	else
+		c->ops->free(obj->ptr);
 
-	free(obj);
+	slab_free(c->slab, obj);
 }
 
 int cache_object_put(struct cache_object *obj)
@@ -174,12 +867,39 @@ void cache_object_get(struct cache_object *obj)
 void cache_object_set_status(struct cache_object *obj, int status)
 {
 	if (status == C_OBJ_DEAD) {
+		cache_snapshot_touch(obj->cache, obj);
 		obj->cache->stats.del_ok++;
 		obj->cache->stats.active--;
 	}
 	obj->status = status;
 }
 
+void *cache_object_ptr(struct cache_object *obj)
+{
+	if (obj->cache->ops->decode)
+		return obj->cache->ops->decode(obj);
+
+	return obj->ptr;
+}
+
+static const char *cache_attr_names[CACHE_A_MAX] = {
+	[CACHE_A_STATUS]	= "status",
+	[CACHE_A_PROTOINFO]	= "protoinfo",
+	[CACHE_A_TIMEOUT]	= "timeout",
+	[CACHE_A_MARK]		= "mark",
+	[CACHE_A_NATSEQ]	= "natseq",
+	[CACHE_A_HELPER]	= "helper",
+	[CACHE_A_OTHER]		= "other",
+};
+
+const char *cache_attr_name(int attr)
+{
+	if (attr < 0 || attr >= CACHE_A_MAX)
+		return "unknown";
+
+	return cache_attr_names[attr];
+}
+
 static int __add(struct cache *c, struct cache_object *obj, int id)
 {
 	int ret;
@@ -190,6 +910,14 @@ static int __add(struct cache *c, struct cache_object *obj, int id)
 	if (ret == -1)
 		return -1;
 
+	obj->epoch = c->epoch;
+	obj->seen = c->generation;
+	obj->dirty = CACHE_A_ALL;
+	obj->clock = 1;
+
+	if (c->index_num)
+		cache_index_add(c, obj);
+
 	for (i = 0; i < c->num_features; i++) {
 		c->features[i]->add(obj, data);
 		data += c->features[i]->size;
@@ -205,10 +933,103 @@ static int __add(struct cache *c, struct cache_object *obj, int id)
 	return 0;
 }
 
+/*
+ * Objects are evicted when the cache goes over its memory budget or
+ * HashLimit. The hand sweeps the table in hash order as a CLOCK: objects
+ * updated since its last pass get a second chance. Among the objects that
+ * it visits, half-open and not yet assured conntracks go first, then the
+ * least recently updated. Objects that are dead or still referenced from
+ * somewhere else, ie. a queue of the sync mode, are left alone.
+ */
+static void __del(struct cache *c, struct cache_object *obj);
+
+#define CACHE_EVICT_SCAN	32	/* objects to visit per eviction */
+#define CACHE_EVICT_STEPS	8	/* buckets per iteration */
+#define CACHE_EVICT_BATCH	4	/* evictions per new object */
+
+struct __evict_container {
+	struct cache_object	*victim;
+	int			rank;
+	unsigned int		visited;
+};
+
+static int cache_evict_scan(void *data, void *n)
+{
+	struct __evict_container *e = data;
+	struct cache_object *obj = n;
+	int rank;
+
+	e->visited++;
+	if (obj->status == C_OBJ_DEAD || obj->refcnt > 1)
+		return 0;
+
+	rank = obj->evict;
+	if (obj->clock) {
+		obj->clock = 0;
+		rank += CACHE_EVICT_MAX;
+	}
+	if (rank < e->rank ||
+	    (rank == e->rank && obj->lastupdate < e->victim->lastupdate)) {
+		e->victim = obj;
+		e->rank = rank;
+	}
+	return 0;
+}
+
+static int cache_full(const struct cache *c)
+{
+	return c->memory > c->memory_limit ||
+	       hashtable_counter(c->h) >= (unsigned int)CONFIG(limit);
+}
+
+static int cache_evict_one(struct cache *c)
+{
+	struct __evict_container e = {
+		.rank = 2 * CACHE_EVICT_MAX,
+	};
+	unsigned int i, passes;
+
+	/* enough passes to sweep the whole table once. */
+	passes = c->h->hashsize / CACHE_EVICT_STEPS + 1;
+
+	for (i = 0; i < passes && e.visited < CACHE_EVICT_SCAN; i++) {
+		if (hashtable_iterate_limit(c->h, &e, &c->evict_cursor,
+					    CACHE_EVICT_STEPS,
+					    cache_evict_scan) == -1)
+			break;
+		/* nothing better than this */
+		if (e.rank == CACHE_EVICT_HALFOPEN)
+			break;
+	}
+	if (e.victim == NULL)
+		return -1;
+
+	c->stats.evict[e.victim->evict]++;
+	c->stats.active--;
+	__del(c, e.victim);
+	cache_object_free(e.victim);
+	return 0;
+}
+
+static void cache_evict(struct cache *c)
+{
+	int i;
+
+	for (i = 0; i < CACHE_EVICT_BATCH && cache_full(c); i++) {
+		if (cache_evict_one(c) == -1) {
+			c->stats.evict_fail++;
+			break;
+		}
+	}
+}
+
 int cache_add(struct cache *c, struct cache_object *obj, int id)
 {
 	int ret;
 
+	if (c->memory_limit)
+		cache_evict(c);
+
 	ret = __add(c, obj, id);
 	if (ret == -1) {
 		c->stats.add_fail++;
@@ -224,8 +1045,40 @@ void cache_update(struct cache *c, struct cache_object *obj, int id, void *ptr)
 {
 	char *data = obj->data;
 	unsigned int i;
+	uint32_t dirty = CACHE_A_ALL;
+	size_t size = cache_payload_size(c, obj->ptr);
+	void *dst, *old;
+
+	cache_snapshot_touch(c, obj);
 
-	c->ops->copy(obj->ptr, ptr, NFCT_CP_META);
+	/* before the copy, wire format payloads are decoded to a buffer
+	 * that the copy reuses. */
+	if (c->ops->diff) {
+		old = cache_object_ptr(obj);
+		if (old != NULL)
+			dirty = c->ops->diff(old, ptr);
+	}
+
+	dst = c->ops->copy(obj->ptr, ptr, NFCT_CP_META);
+	if (dst == NULL) {
+		c->stats.upd_fail++;
+		return;
+	}
+	obj->ptr = dst;
+	obj->dirty = dirty;
+	obj->evict = cache_evict_class(c, ptr, obj->evict);
+	obj->clock = 1;
+	c->memory += cache_payload_size(c, dst) - size;
+
+	if (dirty == 0)
+		c->stats.upd_noop++;
+	for (i = 0; i < CACHE_A_MAX; i++) {
+		if (dirty & (1 << i))
+			c->stats.upd_attr[i]++;
+	}
+
+	if (c->index_num)
+		cache_index_update(c, obj, ptr, 1);
 
 	for (i = 0; i < c->num_features; i++) {
 		c->features[i]->update(obj, data);
@@ -236,6 +1089,7 @@ void cache_update(struct cache *c, struct cache_object *obj, int id, void *ptr)
 		c->extra->update(obj, ((char *) obj) + c->extra_offset);
 
 	c->stats.upd_ok++;
+	obj->seen = c->generation;
 	obj->lastupdate = time_cached();
 	obj->status = C_OBJ_ALIVE;
 }
@@ -245,6 +1099,8 @@ static void __del(struct cache *c, struct cache_object *obj)
 	unsigned i;
 	char *data = obj->data;
 
+	cache_snapshot_touch(c, obj);
+
 	for (i = 0; i < c->num_features; i++) {
 		c->features[i]->destroy(obj, data);
 		data += c->features[i]->size;
@@ -253,6 +1109,9 @@ static void __del(struct cache *c, struct cache_object *obj)
 	if (c->extra && c->extra->destroy)
 		c->extra->destroy(obj, ((char *) obj) + c->extra_offset);
 
+	if (c->index_num)
+		cache_index_del(c, obj);
+
 	hashtable_del(c->h, &obj->hashnode);
 }
 
@@ -270,12 +1129,16 @@ void cache_del(struct cache *c, struct cache_object *obj)
 	__del(c, obj);
 }
 
-struct cache_object *cache_update_force(struct cache *c, void *ptr)
+struct cache_object *
+cache_update_force_key(struct cache *c, void *ptr, const struct cache_key *key)
 {
 	struct cache_object *obj;
 	int id;
 
-	obj = cache_find(c, ptr, &id);
+	if (key)
+		obj = cache_find_key(c, key, &id);
+	else
+		obj = cache_find(c, ptr, &id);
 	if (obj) {
 		if (obj->status != C_OBJ_DEAD) {
 			cache_update(c, obj, id, ptr);
@@ -285,7 +1148,7 @@ struct cache_object *cache_update_force(struct cache *c, void *ptr)
 			cache_object_free(obj);
 		}
 	}
-	obj = cache_object_new(c, ptr);
+	obj = cache_object_new_key(c, ptr, key);
 	if (obj == NULL)
 		return NULL;
 
@@ -297,8 +1160,38 @@ struct cache_object *cache_update_force(struct cache *c, void *ptr)
 	return obj;
 }
 
+struct cache_object *cache_update_force(struct cache *c, void *ptr)
+{
+	struct cache_key key;
+
+	if (c->ops->key) {
+		c->ops->key(&key, ptr);
+		return cache_update_force_key(c, ptr, &key);
+	}
+	return cache_update_force_key(c, ptr, NULL);
+}
+
+struct cache_object *
+cache_find_key(struct cache *c, const struct cache_key *key, int *id)
+{
+	*id = hashtable_hash(c->h, key);
+	return ((struct cache_object *) hashtable_find(c->h, key, *id));
+}
+
+/* the lookup for this key follows shortly, start loading its bucket. */
+void cache_prefetch_key(struct cache *c, const struct cache_key *key)
+{
+	hashtable_prefetch(c->h, hashtable_hash(c->h, key));
+}
+
 struct cache_object *cache_find(struct cache *c, void *ptr, int *id)
 {
+	struct cache_key key;
+
+	if (c->ops->key) {
+		c->ops->key(&key, ptr);
+		return cache_find_key(c, &key, id);
+	}
 	*id = hashtable_hash(c->h, ptr);
 	return ((struct cache_object *) hashtable_find(c->h, ptr, *id));
 }
@@ -329,6 +1222,119 @@ void cache_stats(const struct cache *c, int fd)
 	send(fd, buf, size, 0);
 }
 
+static void cache_stats_hashtable(const struct cache *c, int fd)
+{
+	struct hashtable_stats hs;
+	unsigned int entries;
+	char buf[512];
+	int size, i;
+
+	hashtable_get_stats(c->h, &hs);
+	entries = hashtable_counter(c->h);
+
+	size = snprintf(buf, sizeof(buf),
+			"\thashtable buckets/capacity:\t%12u/%12u\n"
+			"\tload factor:\t\t\t%12.2f\n"
+			"\tgrow/shrink/failed:\t\t%12u/%12u/%12u\n"
+			"\tbuckets left to rehash:\t\t%12u\n"
+			"\toverflowed buckets:\t\t%12u\n"
+			"\tmaximum chain length:\t\t%12u\n"
+			"\tchain length histogram:\t",
+			hs.buckets, hs.capacity,
+			hs.capacity ? (double)entries / hs.capacity : 0.0,
+			hs.grow, hs.shrink, hs.resize_failed,
+			hs.rehash_pending, hs.overflow, hs.max_chain);
+
+	for (i = 0; i < HASHTABLE_STATS_CHAIN; i++) {
+		size += snprintf(buf+size, sizeof(buf)-size, " %d%s:%u",
+				 i, i == HASHTABLE_STATS_CHAIN - 1 ? "+" : "",
+				 hs.chain[i]);
+	}
+	size += snprintf(buf+size, sizeof(buf)-size, "\n");
+
+	send(fd, buf, size, 0);
+}
+
+static void cache_stats_attr(const struct cache *c, int fd)
+{
+	char buf[512];
+	int size, i;
+
+	size = snprintf(buf, sizeof(buf),
+			"\tupdates with no changes:\t%12u\n"
+			"\tchanged attributes:\t",
+			c->stats.upd_noop);
+
+	for (i = 0; i < CACHE_A_MAX; i++) {
+		size += snprintf(buf+size, sizeof(buf)-size, " %s:%u",
+				 cache_attr_name(i), c->stats.upd_attr[i]);
+	}
+	size += snprintf(buf+size, sizeof(buf)-size, "\n");
+
+	send(fd, buf, size, 0);
+}
+
+static void cache_stats_evict(const struct cache *c, int fd)
+{
+	char buf[512];
+	int size;
+
+	size = snprintf(buf, sizeof(buf),
+			"\tmemory used/limit:\t\t%12zu/%12zu\n"
+			"\tevicted half-open:\t\t%12u\n"
+			"\tevicted not assured:\t\t%12u\n"
+			"\tevicted idle:\t\t\t%12u\n"
+			"\t\tnothing to evict:\t%12u\n",
+			c->memory, c->memory_limit,
+			c->stats.evict[CACHE_EVICT_HALFOPEN],
+			c->stats.evict[CACHE_EVICT_UNASSURED],
+			c->stats.evict[CACHE_EVICT_IDLE],
+			c->stats.evict_fail);
+
+	send(fd, buf, size, 0);
+}
+
+static void cache_stats_index(const struct cache *c, int fd)
+{
+	char buf[512];
+	int size = 0, i;
+
+	for (i = 0; i < CACHE_INDEX_MAX; i++) {
+		if (c->index[i] == NULL)
+			continue;
+
+		size += snprintf(buf+size, sizeof(buf)-size,
+				 "\tindex %s keys/link failed:\t%12u/%12u\n",
+				 cache_index_name(i),
+				 hashtable_counter(c->index[i]->h),
+				 c->index[i]->link_failed);
+	}
+	if (size > 0)
+		send(fd, buf, size, 0);
+}
+
+static void cache_stats_slab(const struct cache *c, int fd)
+{
+	const struct slab *s = c->slab;
+	unsigned int total = slab_total(s);
+	unsigned int idle = (s->chunks - s->empty) * s->per_chunk - s->used;
+	char buf[512];
+	int size;
+
+	size = snprintf(buf, sizeof(buf),
+			"\tslab objects used/total:\t%12u/%12u\n"
+			"\tslab chunks/empty:\t\t%12u/%12u\n"
+			"\tslab fragmentation:\t\t%11.2f%%\n"
+			"\tslab grow/shrink/failed:\t%12u/%12u/%12u\n"
+			"\tpayloads pooled/reused:\t\t%12u/%12u\n\n",
+			s->used, total, s->chunks, s->empty,
+			total ? 100.0 * idle / total : 0.0,
+			s->stats.grow, s->stats.shrink, s->stats.fail,
+			c->payload.num, c->payload.reused);
+
+	send(fd, buf, size, 0);
+}
+
 void cache_stats_extended(const struct cache *c, int fd)
 {
 	char buf[512];
@@ -343,7 +1349,7 @@ void cache_stats_extended(const struct cache *c, int fd)
 			    "\tupdate OK/failed:\t\t%12u/%12u\n"
 			    "\t\tentry not found:\t%12u\n"
 			    "\tdeletion created/failed:\t%12u/%12u\n"
-			    "\t\tentry not found:\t%12u\n\n",
+			    "\t\tentry not found:\t%12u\n",
 			    c->name, c->stats.objects,
 			    c->stats.active, hashtable_counter(c->h),
 			    c->stats.add_ok,
@@ -358,6 +1364,15 @@ void cache_stats_extended(const struct cache *c, int fd)
 			    c->stats.del_fail_enoent);
 
 	send(fd, buf, size, 0);
+
+	if (c->ops->diff)
+		cache_stats_attr(c, fd);
+	if (c->memory_limit)
+		cache_stats_evict(c, fd);
+	cache_stats_hashtable(c, fd);
+	cache_stats_index(c, fd);
+	cache_file_stats(c, fd);
+	cache_stats_slab(c, fd);
 }
 
 void cache_iterate(struct cache *c, 
@@ -367,11 +1382,11 @@ void cache_iterate(struct cache *c,
 	hashtable_iterate(c->h, data, iterate);
 }
 
-void cache_iterate_limit(struct cache *c, void *data,
-			 uint32_t from, uint32_t steps,
-			 int (*iterate)(void *data1, void *data2))
+int cache_iterate_limit(struct cache *c, void *data,
+			uint32_t *from, uint32_t steps,
+			int (*iterate)(void *data1, void *data2))
 {
-	hashtable_iterate_limit(c->h, data, from, steps, iterate);
+	return hashtable_iterate_limit(c->h, data, from, steps, iterate);
 }
 
 void cache_dump(struct cache *c, int fd, int type)
@@ -403,3 +1418,19 @@ void cache_flush(struct cache *c)
 	hashtable_iterate(c->h, c, do_flush);
 	c->stats.flush++;
 }
+
+int cache_index_dump(struct cache *c, int fd, int type,
+		     const struct cache_index_query *q)
+{
+	struct __dump_container tmp = {
+		.fd	= fd,
+		.type	= type
+	};
+
+	return cache_index_iterate(c, q, &tmp, c->ops->dump_step);
+}
+
+int cache_index_flush(struct cache *c, const struct cache_index_query *q)
+{
+	return cache_index_iterate(c, q, c, do_flush);
+}
@@ -0,0 +1,442 @@
+/*
+ * (C) 2006-2012 by Pablo Neira Ayuso <pablo@netfilter.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Description: persistent conntrack caches.
+ *
+ * The entries of a cache are mirrored into a file that is mapped in memory,
+ * one fixed-size slot per entry, in the format that is sent to the network.
+ * Every change, but timeout refreshes, rewrites the slot of the entry. Dirty
+ * pages are written back by the kernel and we ask for it every
+ * CACHE_FILE_SYNC_SECS. After a
+ * restart, the file is validated and the entries are loaded back, only the
+ * slots below the highest one that has ever been used are touched. This
+ * way, a backup that is restarted can still commit the external cache
+ * without waiting for a full resync with the primary.
+ */
+
+/* for sync_file_range() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+/* before jhash.h, which defines u32 as a macro. */
+#include <sys/mman.h>
+
+#include "cache.h"
+#include "conntrackd.h"
+#include "network.h"
+#include "alarm.h"
+#include "jhash.h"
+#include "log.h"
+
+#include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CACHE_FILE_MAGIC	0x63746463	/* "ctdc" */
+#define CACHE_FILE_VERSION	1
+#define CACHE_FILE_HDR_SIZE	4096
+#define CACHE_FILE_SLOT_SIZE	512
+#define CACHE_FILE_SYNC_SECS	1
+#define CACHE_FILE_NOSLOT	UINT32_MAX
+
+struct cache_file_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	proto;		/* CONNTRACKD_PROTOCOL_VERSION */
+	uint32_t	slot_size;
+	uint32_t	slots;
+	uint32_t	used;		/* slots above this were never used */
+	uint32_t	generation;	/* number of times it was attached */
+	char		name[CACHE_MAX_NAMELEN];
+};
+
+struct cache_file_slot {
+	uint32_t	len;		/* zero if the slot is free */
+	uint32_t	csum;
+	char		data[0];
+};
+
+#define CACHE_FILE_DATA_MAX	\
+	(CACHE_FILE_SLOT_SIZE - sizeof(struct cache_file_slot))
+
+struct cache_file {
+	int			fd;
+	char			*map;
+	size_t			size;
+	struct cache_file_hdr	*hdr;
+	uint32_t		*free;		/* stack of free slots */
+	uint32_t		free_num;
+	uint32_t		adopt;		/* slot of the entry being loaded */
+	int			loading;	/* free stack not built yet */
+	struct alarm_block	alarm;
+	struct {
+		uint32_t	loaded;
+		uint32_t	corrupt;
+		uint32_t	too_big;
+		uint32_t	full;
+	} stats;
+};
+
+static inline struct cache_file_slot *
+cache_file_slot(const struct cache_file *f, uint32_t i)
+{
+	return (struct cache_file_slot *)
+		(f->map + CACHE_FILE_HDR_SIZE + (size_t)i * CACHE_FILE_SLOT_SIZE);
+}
+
+static void cache_file_write(struct cache_file *f, uint32_t i,
+			     struct cache_object *obj)
+{
+	struct cache_file_slot *s = cache_file_slot(f, i);
+	struct nethdr *net;
+	void *ptr;
+	size_t len;
+
+	/* invalidate the slot first, we may crash while rewriting it. */
+	s->len = 0;
+	__sync_synchronize();
+
+	if (obj->cache->ops->build_msg)
+		net = obj->cache->ops->build_msg(obj, NET_T_STATE_CT_UPD);
+	else {
+		ptr = cache_object_ptr(obj);
+		if (ptr == NULL)
+			return;
+		net = BUILD_NETMSG_FROM_CT(ptr, NET_T_STATE_CT_UPD);
+	}
+	if (net == NULL)
+		return;
+
+	len = ntohs(net->len);
+	if (len > CACHE_FILE_DATA_MAX) {
+		f->stats.too_big++;
+		return;
+	}
+	memcpy(s->data, net, len);
+	s->csum = jhash(s->data, len, CACHE_FILE_MAGIC);
+	__sync_synchronize();
+	s->len = len;
+}
+
+static uint32_t cache_file_slot_get(struct cache_file *f)
+{
+	uint32_t i;
+
+	if (f->free_num == 0) {
+		f->stats.full++;
+		return CACHE_FILE_NOSLOT;
+	}
+	i = f->free[--f->free_num];
+	if (i >= f->hdr->used)
+		f->hdr->used = i + 1;
+
+	return i;
+}
+
+static void cache_file_slot_put(struct cache_file *f, uint32_t i)
+{
+	cache_file_slot(f, i)->len = 0;
+	/* entries evicted while loading, the stack is built afterwards. */
+	if (f->loading)
+		return;
+	f->free[f->free_num++] = i;
+}
+
+/* timeouts and the like change all the time, and they are refreshed
+ * by the next resync anyway: not worth a rewrite of the slot. */
+#define PERSIST_DIRTY	(CACHE_A_ALL & ~((1 << CACHE_A_TIMEOUT) | \
+					 (1 << CACHE_A_OTHER)))
+
+static void persist_add(struct cache_object *obj, void *data)
+{
+	struct cache_file *f = obj->cache->file;
+	uint32_t *slot = data;
+
+	*slot = CACHE_FILE_NOSLOT;
+	if (f == NULL)
+		return;
+
+	/* this entry comes from the file, it is already in its slot. */
+	if (f->adopt != CACHE_FILE_NOSLOT) {
+		*slot = f->adopt;
+		f->adopt = CACHE_FILE_NOSLOT;
+		return;
+	}
+	*slot = cache_file_slot_get(f);
+	if (*slot != CACHE_FILE_NOSLOT)
+		cache_file_write(f, *slot, obj);
+}
+
+static void persist_update(struct cache_object *obj, void *data)
+{
+	struct cache_file *f = obj->cache->file;
+	uint32_t *slot = data;
+
+	if (f == NULL)
+		return;
+
+	if (*slot == CACHE_FILE_NOSLOT) {
+		*slot = cache_file_slot_get(f);
+		if (*slot == CACHE_FILE_NOSLOT)
+			return;
+	} else if (!(obj->dirty & PERSIST_DIRTY))
+		return;
+
+	cache_file_write(f, *slot, obj);
+}
+
+static void persist_destroy(struct cache_object *obj, void *data)
+{
+	struct cache_file *f = obj->cache->file;
+	uint32_t *slot = data;
+
+	if (f == NULL || *slot == CACHE_FILE_NOSLOT)
+		return;
+
+	cache_file_slot_put(f, *slot);
+	*slot = CACHE_FILE_NOSLOT;
+}
+
+struct cache_feature persist_feature = {
+	.size		= sizeof(uint32_t),
+	.add		= persist_add,
+	.update		= persist_update,
+	.destroy	= persist_destroy,
+};
+
+static void cache_file_sync(struct alarm_block *a, void *data)
+{
+	struct cache_file *f = data;
+
+	/* start the writeback of dirty pages, this does not wait for it. */
+	if (sync_file_range(f->fd, 0, 0, SYNC_FILE_RANGE_WRITE) == -1)
+		dlog(LOG_WARNING, "cannot sync cache file: %s",
+		     strerror(errno));
+
+	add_alarm(&f->alarm, CACHE_FILE_SYNC_SECS, 0);
+}
+
+static int cache_file_valid(const struct cache_file_hdr *hdr, size_t size)
+{
+	return hdr->magic == CACHE_FILE_MAGIC &&
+	       hdr->version == CACHE_FILE_VERSION &&
+	       hdr->proto == CONNTRACKD_PROTOCOL_VERSION &&
+	       hdr->slot_size == CACHE_FILE_SLOT_SIZE &&
+	       hdr->used <= hdr->slots &&
+	       size == CACHE_FILE_HDR_SIZE +
+		       (size_t)hdr->slots * CACHE_FILE_SLOT_SIZE;
+}
+
+static void cache_file_load_slot(struct cache *c, struct cache_file *f,
+				 uint32_t i)
+{
+	struct cache_file_slot *s = cache_file_slot(f, i);
+	char buf[CACHE_FILE_DATA_MAX];
+	struct nethdr *net = (struct nethdr *)buf;
+	struct nf_conntrack *ct;
+
+	if (s->len == 0)
+		return;
+
+	if (s->len < (uint32_t)NETHDR_SIZ || s->len > CACHE_FILE_DATA_MAX ||
+	    s->csum != jhash(s->data, s->len, CACHE_FILE_MAGIC))
+		goto corrupt;
+
+	memcpy(buf, s->data, s->len);
+	HDR_NETWORK2HOST(net);
+	if (net->version != CONNTRACKD_PROTOCOL_VERSION)
+		goto corrupt;
+
+	ct = nfct_new();
+	if (ct == NULL)
+		goto corrupt;
+
+	if (msg2ct(ct, net, s->len) == -1) {
+		nfct_destroy(ct);
+		goto corrupt;
+	}
+
+	f->adopt = i;
+	cache_update_force(c, ct);
+	nfct_destroy(ct);
+
+	/* not adopted: duplicated entry or no memory, drop this slot. */
+	if (f->adopt != CACHE_FILE_NOSLOT) {
+		f->adopt = CACHE_FILE_NOSLOT;
+		s->len = 0;
+		return;
+	}
+	f->stats.loaded++;
+	return;
+corrupt:
+	f->stats.corrupt++;
+	s->len = 0;
+}
+
+/*
+ * Map the file, load the entries if it is valid, otherwise start from
+ * scratch. The cache must have been created with the PERSIST feature.
+ */
+int cache_file_open(struct cache *c, const char *path)
+{
+	struct cache_file *f;
+	struct stat sb;
+	uint32_t slots, i;
+	int fresh = 0, found = 0;
+
+	for (i = 0; i < c->num_features; i++) {
+		if (c->features[i] == &persist_feature)
+			found = 1;
+	}
+	if (c->type != CACHE_T_CT || !found) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	f = calloc(1, sizeof(struct cache_file));
+	if (f == NULL)
+		return -1;
+
+	f->adopt = CACHE_FILE_NOSLOT;
+	f->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (f->fd == -1)
+		goto err;
+
+	if (fstat(f->fd, &sb) == -1)
+		goto err_close;
+
+	if ((size_t)sb.st_size >= sizeof(struct cache_file_hdr)) {
+		struct cache_file_hdr hdr;
+
+		if (pread(f->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			goto err_close;
+
+		if (!cache_file_valid(&hdr, sb.st_size)) {
+			dlog(LOG_WARNING, "ignoring invalid or incompatible "
+			     "cache file `%s'", path);
+			fresh = 1;
+		}
+		slots = hdr.slots;
+	} else
+		fresh = 1;
+
+	if (fresh) {
+		slots = CONFIG(limit) ? CONFIG(limit) : CONFIG(hashsize);
+
+		/* the slots are allocated by the filesystem on demand. */
+		if (ftruncate(f->fd, 0) == -1 ||
+		    ftruncate(f->fd, CACHE_FILE_HDR_SIZE +
+				     (off_t)slots * CACHE_FILE_SLOT_SIZE) == -1)
+			goto err_close;
+	}
+	f->size = CACHE_FILE_HDR_SIZE + (size_t)slots * CACHE_FILE_SLOT_SIZE;
+
+	f->map = mmap(NULL, f->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      f->fd, 0);
+	if (f->map == MAP_FAILED)
+		goto err_close;
+
+	f->hdr = (struct cache_file_hdr *)f->map;
+	if (fresh) {
+		f->hdr->magic = CACHE_FILE_MAGIC;
+		f->hdr->version = CACHE_FILE_VERSION;
+		f->hdr->proto = CONNTRACKD_PROTOCOL_VERSION;
+		f->hdr->slot_size = CACHE_FILE_SLOT_SIZE;
+		f->hdr->slots = slots;
+		f->hdr->used = 0;
+		f->hdr->generation = 0;
+		strncpy(f->hdr->name, c->name, CACHE_MAX_NAMELEN - 1);
+	}
+	f->hdr->generation++;
+
+	f->free = calloc(slots, sizeof(uint32_t));
+	if (f->free == NULL)
+		goto err_unmap;
+
+	c->file = f;
+	f->loading = 1;
+	for (i = 0; i < f->hdr->used; i++)
+		cache_file_load_slot(c, f, i);
+	f->loading = 0;
+
+	/* lowest slots on top of the stack, to keep the file compact. */
+	for (i = slots; i-- > 0; ) {
+		if (i >= f->hdr->used || cache_file_slot(f, i)->len == 0)
+			f->free[f->free_num++] = i;
+	}
+
+	init_alarm(&f->alarm, f, cache_file_sync);
+	add_alarm(&f->alarm, CACHE_FILE_SYNC_SECS, 0);
+
+	if (!fresh) {
+		dlog(LOG_NOTICE, "loaded %u entries into %s cache from `%s' "
+		     "(%u corrupted)", f->stats.loaded, c->name, path,
+		     f->stats.corrupt);
+	}
+	return 0;
+
+err_unmap:
+	munmap(f->map, f->size);
+err_close:
+	close(f->fd);
+err:
+	free(f);
+	return -1;
+}
+
+/* detach the file, its content is kept for the next run. */
+void cache_file_close(struct cache *c)
+{
+	struct cache_file *f = c->file;
+
+	if (f == NULL)
+		return;
+
+	del_alarm(&f->alarm);
+	msync(f->map, f->size, MS_SYNC);
+	munmap(f->map, f->size);
+	close(f->fd);
+	free(f->free);
+	free(f);
+	c->file = NULL;
+}
+
+void cache_file_stats(const struct cache *c, int fd)
+{
+	const struct cache_file *f = c->file;
+	char buf[512];
+	int size;
+
+	if (f == NULL)
+		return;
+
+	size = snprintf(buf, sizeof(buf),
+			"\tfile slots used/total:\t\t%12u/%12u\n"
+			"\tfile loaded/corrupted:\t\t%12u/%12u\n"
+			"\tfile too big/full:\t\t%12u/%12u\n",
+			f->hdr->slots - f->free_num, f->hdr->slots,
+			f->stats.loaded, f->stats.corrupt,
+			f->stats.too_big, f->stats.full);
+
+	send(fd, buf, size, 0);
+}
@@ -61,7 +61,7 @@ static int timer_dump(struct cache_object *obj, void *data, char *buf, int type)
 	if (!alarm_pending(a))
 		return 0;
 
-	gettimeofday(&tv, NULL);
+	gettime_cached(&tv);
 	timersub(&a->tv, &tv, &tmp);
 	return sprintf(buf, " [expires in %lds]", tmp.tv_sec);
 }
@@ -0,0 +1,600 @@
+/*
+ * (C) 2006-2012 by Pablo Neira Ayuso <pablo@netfilter.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "ct_record.h"
+#include "cache.h"
+
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <libmnl/libmnl.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netfilter/nf_conntrack_tcp.h>
+
+struct ct_record_tb {
+	const struct nlattr	**tb;
+	int			max;
+};
+
+static int ct_record_attr_cb(const struct nlattr *attr, void *data)
+{
+	const struct ct_record_tb *t = data;
+	int type = mnl_attr_get_type(attr);
+
+	/* attributes that we do not know about are skipped. */
+	if (type <= t->max)
+		t->tb[type] = attr;
+
+	return MNL_CB_OK;
+}
+
+static int
+ct_record_nested(const struct nlattr *nest, const struct nlattr **tb, int max)
+{
+	struct ct_record_tb t = { .tb = tb, .max = max };
+
+	memset(tb, 0, (max + 1) * sizeof(struct nlattr *));
+	return mnl_attr_parse_nested(nest, ct_record_attr_cb, &t);
+}
+
+/* returns the attribute if it is there and its payload is large enough. */
+static const struct nlattr *
+ct_record_valid(const struct nlattr *attr, size_t len)
+{
+	if (attr == NULL || mnl_attr_get_payload_len(attr) < len)
+		return NULL;
+
+	return attr;
+}
+
+#define ct_record_u8(a)		ct_record_valid(a, sizeof(uint8_t))
+#define ct_record_u16(a)	ct_record_valid(a, sizeof(uint16_t))
+#define ct_record_u32(a)	ct_record_valid(a, sizeof(uint32_t))
+#define ct_record_u64(a)	ct_record_valid(a, sizeof(uint64_t))
+
+static int
+ct_record_parse_tuple(const struct nlattr *nest, struct ct_record_tuple *t)
+{
+	const struct nlattr *tb[CTA_TUPLE_MAX + 1];
+	const struct nlattr *ip[CTA_IP_MAX + 1];
+	const struct nlattr *proto[CTA_PROTO_MAX + 1];
+
+	if (ct_record_nested(nest, tb, CTA_TUPLE_MAX) < 0)
+		return -1;
+
+	if (tb[CTA_TUPLE_IP]) {
+		if (ct_record_nested(tb[CTA_TUPLE_IP], ip, CTA_IP_MAX) < 0)
+			return -1;
+
+		if (ct_record_u32(ip[CTA_IP_V4_SRC]) &&
+		    ct_record_u32(ip[CTA_IP_V4_DST])) {
+			t->src[0] = mnl_attr_get_u32(ip[CTA_IP_V4_SRC]);
+			t->dst[0] = mnl_attr_get_u32(ip[CTA_IP_V4_DST]);
+			t->set |= CT_REC_T_IP;
+		} else if (ct_record_valid(ip[CTA_IP_V6_SRC], sizeof(t->src)) &&
+			   ct_record_valid(ip[CTA_IP_V6_DST], sizeof(t->dst))) {
+			memcpy(t->src, mnl_attr_get_payload(ip[CTA_IP_V6_SRC]),
+			       sizeof(t->src));
+			memcpy(t->dst, mnl_attr_get_payload(ip[CTA_IP_V6_DST]),
+			       sizeof(t->dst));
+			t->set |= CT_REC_T_IP;
+		}
+	}
+
+	if (tb[CTA_TUPLE_PROTO]) {
+		if (ct_record_nested(tb[CTA_TUPLE_PROTO],
+				     proto, CTA_PROTO_MAX) < 0)
+			return -1;
+
+		if (ct_record_u8(proto[CTA_PROTO_NUM])) {
+			t->l4proto = mnl_attr_get_u8(proto[CTA_PROTO_NUM]);
+			t->set |= CT_REC_T_PROTO;
+		}
+		if (ct_record_u16(proto[CTA_PROTO_SRC_PORT]) &&
+		    ct_record_u16(proto[CTA_PROTO_DST_PORT])) {
+			t->sport = mnl_attr_get_u16(proto[CTA_PROTO_SRC_PORT]);
+			t->dport = mnl_attr_get_u16(proto[CTA_PROTO_DST_PORT]);
+			t->set |= CT_REC_T_PORTS;
+		}
+		if (ct_record_u16(proto[CTA_PROTO_ICMP_ID]) &&
+		    ct_record_u8(proto[CTA_PROTO_ICMP_TYPE]) &&
+		    ct_record_u8(proto[CTA_PROTO_ICMP_CODE])) {
+			t->icmp_id = mnl_attr_get_u16(proto[CTA_PROTO_ICMP_ID]);
+			t->icmp_type =
+				mnl_attr_get_u8(proto[CTA_PROTO_ICMP_TYPE]);
+			t->icmp_code =
+				mnl_attr_get_u8(proto[CTA_PROTO_ICMP_CODE]);
+			t->set |= CT_REC_T_ICMP;
+		} else if (ct_record_u16(proto[CTA_PROTO_ICMPV6_ID]) &&
+			   ct_record_u8(proto[CTA_PROTO_ICMPV6_TYPE]) &&
+			   ct_record_u8(proto[CTA_PROTO_ICMPV6_CODE])) {
+			t->icmp_id =
+				mnl_attr_get_u16(proto[CTA_PROTO_ICMPV6_ID]);
+			t->icmp_type =
+				mnl_attr_get_u8(proto[CTA_PROTO_ICMPV6_TYPE]);
+			t->icmp_code =
+				mnl_attr_get_u8(proto[CTA_PROTO_ICMPV6_CODE]);
+			t->set |= CT_REC_T_ICMP;
+		}
+	}
+	return 0;
+}
+
+static int
+ct_record_parse_protoinfo(const struct nlattr *nest, struct ct_record *r)
+{
+	const struct nlattr *tb[CTA_PROTOINFO_MAX + 1];
+	const struct nlattr *tcp[CTA_PROTOINFO_TCP_MAX + 1];
+	const struct nlattr *sctp[CTA_PROTOINFO_SCTP_MAX + 1];
+	const struct nlattr *dccp[CTA_PROTOINFO_DCCP_MAX + 1];
+	const struct nlattr *a;
+
+	if (ct_record_nested(nest, tb, CTA_PROTOINFO_MAX) < 0)
+		return -1;
+
+	if (tb[CTA_PROTOINFO_TCP]) {
+		if (ct_record_nested(tb[CTA_PROTOINFO_TCP],
+				     tcp, CTA_PROTOINFO_TCP_MAX) < 0)
+			return -1;
+
+		if ((a = ct_record_u8(tcp[CTA_PROTOINFO_TCP_STATE]))) {
+			r->state = mnl_attr_get_u8(a);
+			r->attrs |= CT_REC_TCP_STATE;
+		}
+		a = ct_record_u8(tcp[CTA_PROTOINFO_TCP_WSCALE_ORIGINAL]);
+		if (a) {
+			r->wscale[0] = mnl_attr_get_u8(a);
+			r->attrs |= CT_REC_TCP_WSCALE_ORIG;
+		}
+		a = ct_record_u8(tcp[CTA_PROTOINFO_TCP_WSCALE_REPLY]);
+		if (a) {
+			r->wscale[1] = mnl_attr_get_u8(a);
+			r->attrs |= CT_REC_TCP_WSCALE_REPL;
+		}
+		a = ct_record_valid(tcp[CTA_PROTOINFO_TCP_FLAGS_ORIGINAL],
+				    sizeof(struct nf_ct_tcp_flags));
+		if (a) {
+			const struct nf_ct_tcp_flags *f;
+
+			f = mnl_attr_get_payload(a);
+
+			r->flags[0] = f->flags;
+			r->mask[0] = f->mask;
+			r->attrs |= CT_REC_TCP_FLAGS_ORIG;
+		}
+		a = ct_record_valid(tcp[CTA_PROTOINFO_TCP_FLAGS_REPLY],
+				    sizeof(struct nf_ct_tcp_flags));
+		if (a) {
+			const struct nf_ct_tcp_flags *f;
+
+			f = mnl_attr_get_payload(a);
+
+			r->flags[1] = f->flags;
+			r->mask[1] = f->mask;
+			r->attrs |= CT_REC_TCP_FLAGS_REPL;
+		}
+	}
+
+	if (tb[CTA_PROTOINFO_SCTP]) {
+		if (ct_record_nested(tb[CTA_PROTOINFO_SCTP],
+				     sctp, CTA_PROTOINFO_SCTP_MAX) < 0)
+			return -1;
+
+		if ((a = ct_record_u8(sctp[CTA_PROTOINFO_SCTP_STATE]))) {
+			r->state = mnl_attr_get_u8(a);
+			r->attrs |= CT_REC_SCTP_STATE;
+		}
+		a = ct_record_u32(sctp[CTA_PROTOINFO_SCTP_VTAG_ORIGINAL]);
+		if (a) {
+			r->vtag[0] = ntohl(mnl_attr_get_u32(a));
+			r->attrs |= CT_REC_SCTP_VTAG_ORIG;
+		}
+		a = ct_record_u32(sctp[CTA_PROTOINFO_SCTP_VTAG_REPLY]);
+		if (a) {
+			r->vtag[1] = ntohl(mnl_attr_get_u32(a));
+			r->attrs |= CT_REC_SCTP_VTAG_REPL;
+		}
+	}
+
+	if (tb[CTA_PROTOINFO_DCCP]) {
+		if (ct_record_nested(tb[CTA_PROTOINFO_DCCP],
+				     dccp, CTA_PROTOINFO_DCCP_MAX) < 0)
+			return -1;
+
+		if ((a = ct_record_u8(dccp[CTA_PROTOINFO_DCCP_STATE]))) {
+			r->state = mnl_attr_get_u8(a);
+			r->attrs |= CT_REC_DCCP_STATE;
+		}
+		if ((a = ct_record_u8(dccp[CTA_PROTOINFO_DCCP_ROLE]))) {
+			r->role = mnl_attr_get_u8(a);
+			r->attrs |= CT_REC_DCCP_ROLE;
+		}
+		a = ct_record_u64(dccp[CTA_PROTOINFO_DCCP_HANDSHAKE_SEQ]);
+		if (a) {
+			r->handshake_seq = be64toh(mnl_attr_get_u64(a));
+			r->attrs |= CT_REC_DCCP_SEQ;
+		}
+	}
+	return 0;
+}
+
+static int
+ct_record_parse_counters(const struct nlattr *nest, struct ct_record *r,
+			 int dir)
+{
+	const struct nlattr *tb[CTA_COUNTERS_MAX + 1];
+	const struct nlattr *a;
+
+	if (ct_record_nested(nest, tb, CTA_COUNTERS_MAX) < 0)
+		return -1;
+
+	if ((a = ct_record_u64(tb[CTA_COUNTERS_PACKETS])))
+		r->packets[dir] = be64toh(mnl_attr_get_u64(a));
+	else if ((a = ct_record_u32(tb[CTA_COUNTERS32_PACKETS])))
+		r->packets[dir] = ntohl(mnl_attr_get_u32(a));
+
+	if ((a = ct_record_u64(tb[CTA_COUNTERS_BYTES])))
+		r->bytes[dir] = be64toh(mnl_attr_get_u64(a));
+	else if ((a = ct_record_u32(tb[CTA_COUNTERS32_BYTES])))
+		r->bytes[dir] = ntohl(mnl_attr_get_u32(a));
+
+	r->attrs |= dir ? CT_REC_COUNTERS_REPL : CT_REC_COUNTERS_ORIG;
+	return 0;
+}
+
+static int
+ct_record_parse_natseq(const struct nlattr *nest, struct ct_record *r, int dir)
+{
+	const struct nlattr *tb[CTA_NAT_SEQ_MAX + 1];
+	const struct nlattr *a;
+
+	if (ct_record_nested(nest, tb, CTA_NAT_SEQ_MAX) < 0)
+		return -1;
+
+	if ((a = ct_record_u32(tb[CTA_NAT_SEQ_CORRECTION_POS])))
+		r->natseq[dir][CT_REC_NATSEQ_POS] = ntohl(mnl_attr_get_u32(a));
+	if ((a = ct_record_u32(tb[CTA_NAT_SEQ_OFFSET_BEFORE])))
+		r->natseq[dir][CT_REC_NATSEQ_BEFORE] =
+			ntohl(mnl_attr_get_u32(a));
+	if ((a = ct_record_u32(tb[CTA_NAT_SEQ_OFFSET_AFTER])))
+		r->natseq[dir][CT_REC_NATSEQ_AFTER] =
+			ntohl(mnl_attr_get_u32(a));
+
+	r->attrs |= dir ? CT_REC_NATSEQ_REPL : CT_REC_NATSEQ_ORIG;
+	return 0;
+}
+
+static int ct_record_parse_helper(const struct nlattr *nest,
+				  struct ct_record *r)
+{
+	const struct nlattr *tb[CTA_HELP_MAX + 1];
+	size_t len;
+
+	if (ct_record_nested(nest, tb, CTA_HELP_MAX) < 0)
+		return -1;
+
+	if (tb[CTA_HELP_NAME] == NULL)
+		return 0;
+
+	len = strnlen(mnl_attr_get_str(tb[CTA_HELP_NAME]),
+		      mnl_attr_get_payload_len(tb[CTA_HELP_NAME]));
+	if (len >= sizeof(r->helper))
+		len = sizeof(r->helper) - 1;
+
+	memcpy(r->helper, mnl_attr_get_str(tb[CTA_HELP_NAME]), len);
+	r->helper[len] = '\0';
+	r->attrs |= CT_REC_HELPER;
+	return 0;
+}
+
+/* this may run in the event reader thread, do not touch global state. */
+int ct_record_parse(const struct nlmsghdr *nlh, struct ct_record *r)
+{
+	const struct nlattr *tb[CTA_MAX + 1] = { NULL };
+	struct ct_record_tb t = { .tb = tb, .max = CTA_MAX };
+	const struct nfgenmsg *nfg;
+	const struct nlattr *a;
+	int i;
+
+	if (mnl_nlmsg_get_payload_len(nlh) < sizeof(struct nfgenmsg)) {
+		errno = EINVAL;
+		return -1;
+	}
+	nfg = mnl_nlmsg_get_payload(nlh);
+
+	memset(r, 0, sizeof(struct ct_record));
+	r->l3proto = nfg->nfgen_family;
+
+	if (mnl_attr_parse(nlh, sizeof(struct nfgenmsg),
+			   ct_record_attr_cb, &t) < 0)
+		return -1;
+
+	for (i = 0; i < CT_REC_TUPLE_MAX; i++) {
+		static const int type[CT_REC_TUPLE_MAX] = {
+			[CT_REC_TUPLE_ORIG]	= CTA_TUPLE_ORIG,
+			[CT_REC_TUPLE_REPL]	= CTA_TUPLE_REPLY,
+			[CT_REC_TUPLE_MASTER]	= CTA_TUPLE_MASTER,
+		};
+
+		if (tb[type[i]] &&
+		    ct_record_parse_tuple(tb[type[i]], &r->tuple[i]) < 0)
+			return -1;
+	}
+
+	if ((a = ct_record_u32(tb[CTA_STATUS]))) {
+		r->status = ntohl(mnl_attr_get_u32(a));
+		r->attrs |= CT_REC_STATUS;
+	}
+	if ((a = ct_record_u32(tb[CTA_TIMEOUT]))) {
+		r->timeout = ntohl(mnl_attr_get_u32(a));
+		r->attrs |= CT_REC_TIMEOUT;
+	}
+	if ((a = ct_record_u32(tb[CTA_MARK]))) {
+		r->mark = ntohl(mnl_attr_get_u32(a));
+		r->attrs |= CT_REC_MARK;
+	}
+	if ((a = ct_record_u32(tb[CTA_SECMARK]))) {
+		r->secmark = ntohl(mnl_attr_get_u32(a));
+		r->attrs |= CT_REC_SECMARK;
+	}
+	if ((a = ct_record_u32(tb[CTA_ID]))) {
+		r->id = ntohl(mnl_attr_get_u32(a));
+		r->attrs |= CT_REC_ID;
+	}
+	if ((a = ct_record_u16(tb[CTA_ZONE]))) {
+		r->zone = ntohs(mnl_attr_get_u16(a));
+		r->attrs |= CT_REC_ZONE;
+	}
+
+	if (tb[CTA_PROTOINFO] &&
+	    ct_record_parse_protoinfo(tb[CTA_PROTOINFO], r) < 0)
+		return -1;
+	if (tb[CTA_COUNTERS_ORIG] &&
+	    ct_record_parse_counters(tb[CTA_COUNTERS_ORIG], r, 0) < 0)
+		return -1;
+	if (tb[CTA_COUNTERS_REPLY] &&
+	    ct_record_parse_counters(tb[CTA_COUNTERS_REPLY], r, 1) < 0)
+		return -1;
+	if (tb[CTA_NAT_SEQ_ADJ_ORIG] &&
+	    ct_record_parse_natseq(tb[CTA_NAT_SEQ_ADJ_ORIG], r, 0) < 0)
+		return -1;
+	if (tb[CTA_NAT_SEQ_ADJ_REPLY] &&
+	    ct_record_parse_natseq(tb[CTA_NAT_SEQ_ADJ_REPLY], r, 1) < 0)
+		return -1;
+	if (tb[CTA_HELP] && ct_record_parse_helper(tb[CTA_HELP], r) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* same key that cache_ct_key() extracts from the library object. */
+void ct_record_key(const struct ct_record *r, struct cache_key *key)
+{
+	const struct ct_record_tuple *t = &r->tuple[CT_REC_TUPLE_ORIG];
+
+	memset(key, 0, sizeof(struct cache_key));
+
+	key->l3proto = r->l3proto;
+	key->l4proto = t->l4proto;
+
+	switch(key->l3proto) {
+	case AF_INET:
+		key->src[0] = t->src[0];
+		key->dst[0] = t->dst[0];
+		break;
+	case AF_INET6:
+		memcpy(key->src, t->src, sizeof(key->src));
+		memcpy(key->dst, t->dst, sizeof(key->dst));
+		break;
+	}
+
+	switch(key->l4proto) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		key->sport = t->icmp_id;
+		key->dport = t->icmp_type << 8 | t->icmp_code;
+		break;
+	default:
+		key->sport = t->sport;
+		key->dport = t->dport;
+		break;
+	}
+
+	key->zone = r->zone;
+	key->id = r->id;
+}
+
+static const struct {
+	enum nf_conntrack_attr	l3proto, l4proto;
+	enum nf_conntrack_attr	ipv4_src, ipv4_dst;
+	enum nf_conntrack_attr	ipv6_src, ipv6_dst;
+	enum nf_conntrack_attr	port_src, port_dst;
+} ct_record_tuple_attrs[CT_REC_TUPLE_MAX] = {
+	[CT_REC_TUPLE_ORIG] = {
+		ATTR_ORIG_L3PROTO, ATTR_ORIG_L4PROTO,
+		ATTR_ORIG_IPV4_SRC, ATTR_ORIG_IPV4_DST,
+		ATTR_ORIG_IPV6_SRC, ATTR_ORIG_IPV6_DST,
+		ATTR_ORIG_PORT_SRC, ATTR_ORIG_PORT_DST,
+	},
+	[CT_REC_TUPLE_REPL] = {
+		ATTR_REPL_L3PROTO, ATTR_REPL_L4PROTO,
+		ATTR_REPL_IPV4_SRC, ATTR_REPL_IPV4_DST,
+		ATTR_REPL_IPV6_SRC, ATTR_REPL_IPV6_DST,
+		ATTR_REPL_PORT_SRC, ATTR_REPL_PORT_DST,
+	},
+	[CT_REC_TUPLE_MASTER] = {
+		ATTR_MASTER_L3PROTO, ATTR_MASTER_L4PROTO,
+		ATTR_MASTER_IPV4_SRC, ATTR_MASTER_IPV4_DST,
+		ATTR_MASTER_IPV6_SRC, ATTR_MASTER_IPV6_DST,
+		ATTR_MASTER_PORT_SRC, ATTR_MASTER_PORT_DST,
+	},
+};
+
+static void
+ct_record_fill_tuple(const struct ct_record *r, struct nf_conntrack *ct,
+		     int dir)
+{
+	const struct ct_record_tuple *t = &r->tuple[dir];
+	const typeof(ct_record_tuple_attrs[0]) *a = &ct_record_tuple_attrs[dir];
+
+	/* like the library, the family comes from the message header. */
+	if (dir != CT_REC_TUPLE_MASTER || t->set)
+		nfct_set_attr_u8(ct, a->l3proto, r->l3proto);
+	else
+		nfct_attr_unset(ct, a->l3proto);
+
+	nfct_attr_unset(ct, a->ipv4_src);
+	nfct_attr_unset(ct, a->ipv4_dst);
+	nfct_attr_unset(ct, a->ipv6_src);
+	nfct_attr_unset(ct, a->ipv6_dst);
+	if (t->set & CT_REC_T_IP) {
+		switch(r->l3proto) {
+		case AF_INET:
+			nfct_set_attr_u32(ct, a->ipv4_src, t->src[0]);
+			nfct_set_attr_u32(ct, a->ipv4_dst, t->dst[0]);
+			break;
+		case AF_INET6:
+			nfct_set_attr(ct, a->ipv6_src, t->src);
+			nfct_set_attr(ct, a->ipv6_dst, t->dst);
+			break;
+		}
+	}
+
+	if (t->set & CT_REC_T_PROTO)
+		nfct_set_attr_u8(ct, a->l4proto, t->l4proto);
+	else
+		nfct_attr_unset(ct, a->l4proto);
+
+	if (t->set & CT_REC_T_PORTS) {
+		nfct_set_attr_u16(ct, a->port_src, t->sport);
+		nfct_set_attr_u16(ct, a->port_dst, t->dport);
+	} else {
+		nfct_attr_unset(ct, a->port_src);
+		nfct_attr_unset(ct, a->port_dst);
+	}
+
+	/* the library only keeps the ICMP bits of the original tuple. */
+	if (dir != CT_REC_TUPLE_ORIG)
+		return;
+
+	if (t->set & CT_REC_T_ICMP) {
+		nfct_set_attr_u16(ct, ATTR_ICMP_ID, t->icmp_id);
+		nfct_set_attr_u8(ct, ATTR_ICMP_TYPE, t->icmp_type);
+		nfct_set_attr_u8(ct, ATTR_ICMP_CODE, t->icmp_code);
+	} else {
+		nfct_attr_unset(ct, ATTR_ICMP_ID);
+		nfct_attr_unset(ct, ATTR_ICMP_TYPE);
+		nfct_attr_unset(ct, ATTR_ICMP_CODE);
+	}
+}
+
+#define ct_record_fill_u8(r, ct, bit, attr, val)			\
+	((r)->attrs & (bit) ? nfct_set_attr_u8(ct, attr, val)		\
+			    : (void)nfct_attr_unset(ct, attr))
+#define ct_record_fill_u16(r, ct, bit, attr, val)			\
+	((r)->attrs & (bit) ? nfct_set_attr_u16(ct, attr, val)		\
+			    : (void)nfct_attr_unset(ct, attr))
+#define ct_record_fill_u32(r, ct, bit, attr, val)			\
+	((r)->attrs & (bit) ? nfct_set_attr_u32(ct, attr, val)		\
+			    : (void)nfct_attr_unset(ct, attr))
+#define ct_record_fill_u64(r, ct, bit, attr, val)			\
+	((r)->attrs & (bit) ? nfct_set_attr_u64(ct, attr, val)		\
+			    : (void)nfct_attr_unset(ct, attr))
+
+/*
+ * Turn the record into a library object for the filter and the caches.
+ * The object is reused from one event to another: every attribute that
+ * the record knows about is either set or unset, and only attributes of
+ * fixed size are used, so this does not allocate memory.
+ */
+void ct_record_fill(const struct ct_record *r, struct nf_conntrack *ct)
+{
+	int i;
+
+	for (i = 0; i < CT_REC_TUPLE_MAX; i++)
+		ct_record_fill_tuple(r, ct, i);
+
+	ct_record_fill_u32(r, ct, CT_REC_STATUS, ATTR_STATUS, r->status);
+	ct_record_fill_u32(r, ct, CT_REC_TIMEOUT, ATTR_TIMEOUT, r->timeout);
+	ct_record_fill_u32(r, ct, CT_REC_MARK, ATTR_MARK, r->mark);
+	ct_record_fill_u32(r, ct, CT_REC_SECMARK, ATTR_SECMARK, r->secmark);
+	ct_record_fill_u32(r, ct, CT_REC_ID, ATTR_ID, r->id);
+	ct_record_fill_u16(r, ct, CT_REC_ZONE, ATTR_ZONE, r->zone);
+
+	ct_record_fill_u8(r, ct, CT_REC_TCP_STATE, ATTR_TCP_STATE, r->state);
+	ct_record_fill_u8(r, ct, CT_REC_TCP_WSCALE_ORIG,
+			  ATTR_TCP_WSCALE_ORIG, r->wscale[0]);
+	ct_record_fill_u8(r, ct, CT_REC_TCP_WSCALE_REPL,
+			  ATTR_TCP_WSCALE_REPL, r->wscale[1]);
+	ct_record_fill_u8(r, ct, CT_REC_TCP_FLAGS_ORIG,
+			  ATTR_TCP_FLAGS_ORIG, r->flags[0]);
+	ct_record_fill_u8(r, ct, CT_REC_TCP_FLAGS_ORIG,
+			  ATTR_TCP_MASK_ORIG, r->mask[0]);
+	ct_record_fill_u8(r, ct, CT_REC_TCP_FLAGS_REPL,
+			  ATTR_TCP_FLAGS_REPL, r->flags[1]);
+	ct_record_fill_u8(r, ct, CT_REC_TCP_FLAGS_REPL,
+			  ATTR_TCP_MASK_REPL, r->mask[1]);
+
+	ct_record_fill_u8(r, ct, CT_REC_SCTP_STATE, ATTR_SCTP_STATE, r->state);
+	ct_record_fill_u32(r, ct, CT_REC_SCTP_VTAG_ORIG,
+			   ATTR_SCTP_VTAG_ORIG, r->vtag[0]);
+	ct_record_fill_u32(r, ct, CT_REC_SCTP_VTAG_REPL,
+			   ATTR_SCTP_VTAG_REPL, r->vtag[1]);
+
+	ct_record_fill_u8(r, ct, CT_REC_DCCP_STATE, ATTR_DCCP_STATE, r->state);
+	ct_record_fill_u8(r, ct, CT_REC_DCCP_ROLE, ATTR_DCCP_ROLE, r->role);
+	ct_record_fill_u64(r, ct, CT_REC_DCCP_SEQ,
+			   ATTR_DCCP_HANDSHAKE_SEQ, r->handshake_seq);
+
+	ct_record_fill_u64(r, ct, CT_REC_COUNTERS_ORIG,
+			   ATTR_ORIG_COUNTER_PACKETS, r->packets[0]);
+	ct_record_fill_u64(r, ct, CT_REC_COUNTERS_ORIG,
+			   ATTR_ORIG_COUNTER_BYTES, r->bytes[0]);
+	ct_record_fill_u64(r, ct, CT_REC_COUNTERS_REPL,
+			   ATTR_REPL_COUNTER_PACKETS, r->packets[1]);
+	ct_record_fill_u64(r, ct, CT_REC_COUNTERS_REPL,
+			   ATTR_REPL_COUNTER_BYTES, r->bytes[1]);
+
+	ct_record_fill_u32(r, ct, CT_REC_NATSEQ_ORIG,
+			   ATTR_ORIG_NAT_SEQ_CORRECTION_POS,
+			   r->natseq[0][CT_REC_NATSEQ_POS]);
+	ct_record_fill_u32(r, ct, CT_REC_NATSEQ_ORIG,
+			   ATTR_ORIG_NAT_SEQ_OFFSET_BEFORE,
+			   r->natseq[0][CT_REC_NATSEQ_BEFORE]);
+	ct_record_fill_u32(r, ct, CT_REC_NATSEQ_ORIG,
+			   ATTR_ORIG_NAT_SEQ_OFFSET_AFTER,
+			   r->natseq[0][CT_REC_NATSEQ_AFTER]);
+	ct_record_fill_u32(r, ct, CT_REC_NATSEQ_REPL,
+			   ATTR_REPL_NAT_SEQ_CORRECTION_POS,
+			   r->natseq[1][CT_REC_NATSEQ_POS]);
+	ct_record_fill_u32(r, ct, CT_REC_NATSEQ_REPL,
+			   ATTR_REPL_NAT_SEQ_OFFSET_BEFORE,
+			   r->natseq[1][CT_REC_NATSEQ_BEFORE]);
+	ct_record_fill_u32(r, ct, CT_REC_NATSEQ_REPL,
+			   ATTR_REPL_NAT_SEQ_OFFSET_AFTER,
+			   r->natseq[1][CT_REC_NATSEQ_AFTER]);
+
+	/* the helper name is stored inline in the object. */
+	if (r->attrs & CT_REC_HELPER)
+		nfct_set_attr(ct, ATTR_HELPER_NAME, r->helper);
+	else
+		nfct_attr_unset(ct, ATTR_HELPER_NAME);
+}
@@ -518,6 +518,7 @@ int cthelper_init(void)
 	}
 
 	register_fd(mnl_socket_get_fd(STATE_CTH(nl)), nfq_cb, NULL, STATE(fds));
+	fds_set_name(mnl_socket_get_fd(STATE_CTH(nl)), "nfqueue", STATE(fds));
 
 	return 0;
 }
@@ -18,17 +18,26 @@
  * Part of this code has been sponsored by Vyatta Inc. <http://www.vyatta.com>
  */
 
+/* for recvmmsg() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "conntrackd.h"
 #include "netlink.h"
 #include "filter.h"
 #include "log.h"
 #include "alarm.h"
 #include "fds.h"
+#include "event.h"
 #include "traffic_stats.h"
 #include "process.h"
 #include "origin.h"
 #include "date.h"
 #include "internal.h"
+#include "ring.h"
+#include "cache.h"
+#include "ct_record.h"
 
 #include <errno.h>
 #include <signal.h>
@@ -38,16 +47,31 @@
 #include <string.h>
 #include <time.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <libmnl/libmnl.h>
+
+static void ctnl_reader_stop(void);
+
+/* library object that the event records are turned into, reused. */
+static struct nf_conntrack *event_ct;
 
 void ctnl_kill(void)
 {
-	if (!(CONFIG(flags) & CTD_POLL))
+	if (!(CONFIG(flags) & CTD_POLL)) {
+		if (CONFIG(netlink).event_thread)
+			ctnl_reader_stop();
 		nfct_close(STATE(event));
+		nfct_destroy(event_ct);
+	}
 
 	nfct_close(STATE(resync));
 	nfct_close(STATE(get));
 	origin_unregister(STATE(flush));
 	nfct_close(STATE(flush));
+	origin_unregister(STATE(flush_job));
+	nfct_close(STATE(flush_job));
 
 	if (STATE(us_filter))
 		ct_filter_destroy(STATE(us_filter));
@@ -58,18 +82,43 @@ void ctnl_kill(void)
 	}
 }
 
+static void flush_master_run(void *data)
+{
+	nl_flush_conntrack_table_selective(STATE(flush_job));
+}
+
 static void local_flush_master(void)
 {
 	STATE(stats).nl_kernel_table_flush++;
 	dlog(LOG_NOTICE, "flushing kernel conntrack table");
 
-	/* fork a child process that performs the flush operation,
-	 * meanwhile the parent process handles events. */
-	if (fork_process_new(CTD_PROC_FLUSH, CTD_PROC_F_EXCL,
-			     NULL, NULL) == 0) {
-		nl_flush_conntrack_table_selective();
-		exit(EXIT_SUCCESS);
-	}
+	/* a worker thread performs the flush operation, meanwhile the
+	 * main loop handles events. */
+	if (worker_job_new(CTD_PROC_FLUSH, CTD_PROC_F_EXCL,
+			   flush_master_run, NULL, NULL) == -1)
+		dlog(LOG_ERR, "can't flush kernel conntrack table: %s",
+		     strerror(errno));
+}
+
+/*
+ * Dump the kernel table into the internal cache. Entries that are already
+ * cached and did not change are not updated, entries that have not been
+ * seen in a complete dump are gone from the kernel table.
+ */
+static int ctnl_populate(void)
+{
+	uint64_t start = time_ns();
+	int ret;
+
+	if (STATE(mode)->internal->ct.populate_start)
+		STATE(mode)->internal->ct.populate_start();
+
+	ret = nl_dump_conntrack_table(STATE(dump));
+	if (ret != -1 && STATE(mode)->internal->ct.populate_done)
+		STATE(mode)->internal->ct.populate_done();
+
+	STATE(stats).nl_dump_usecs = (time_ns() - start) / 1000;
+	return ret;
 }
 
 static void local_resync_master(void)
@@ -77,12 +126,17 @@ static void local_resync_master(void)
 	if (STATE(mode)->internal->flags & INTERNAL_F_POPULATE) {
 		STATE(stats).nl_kernel_table_resync++;
 		dlog(LOG_NOTICE, "resync with master conntrack table");
-		nl_dump_conntrack_table(STATE(dump));
+		ctnl_populate();
 	} else {
 		dlog(LOG_NOTICE, "resync is unsupported in this mode");
 	}
 }
 
+static void exp_flush_master_run(void *data)
+{
+	nl_flush_expect_table(STATE(flush));
+}
+
 static void local_exp_flush_master(void)
 {
 	if (!(CONFIG(flags) & CTD_EXPECT))
@@ -91,13 +145,12 @@ static void local_exp_flush_master(void)
 	STATE(stats).nl_kernel_table_flush++;
 	dlog(LOG_NOTICE, "flushing kernel expect table");
 
-	/* fork a child process that performs the flush operation,
-	 * meanwhile the parent process handles events. */
-	if (fork_process_new(CTD_PROC_FLUSH, CTD_PROC_F_EXCL,
-			     NULL, NULL) == 0) {
-		nl_flush_expect_table(STATE(flush));
-		exit(EXIT_SUCCESS);
-	}
+	/* a worker thread performs the flush operation, meanwhile the
+	 * main loop handles events. */
+	if (worker_job_new(CTD_PROC_FLUSH, CTD_PROC_F_EXCL,
+			   exp_flush_master_run, NULL, NULL) == -1)
+		dlog(LOG_ERR, "can't flush kernel expect table: %s",
+		     strerror(errno));
 }
 
 static void local_exp_resync_master(void)
@@ -149,16 +202,43 @@ int ctnl_local(int fd, int type, void *data)
 	return ret;
 }
 
+/*
+ * Remove the cached entries that are gone from the kernel table. The table
+ * is dumped once, the cached entries that are in it are marked as seen and
+ * the others are swept in the background, see cache_sweep().
+ */
+static void ctnl_purge(void)
+{
+	const struct internal_handler *internal = STATE(mode)->internal;
+
+	if (internal->ct.purge == NULL)
+		return;
+
+	if (internal->ct.seen) {
+		if (internal->ct.populate_start)
+			internal->ct.populate_start();
+
+		if (nl_dump_conntrack_table(STATE(get)) == -1) {
+			dlog(LOG_WARNING, "can't dump kernel table to purge "
+			     "the cache: %s", strerror(errno));
+			return;
+		}
+	}
+	internal->ct.purge();
+}
+
 static void do_overrun_resync_alarm(struct alarm_block *a, void *data)
 {
 	nl_send_resync(STATE(resync));
 	STATE(stats).nl_kernel_table_resync++;
+
+	/* we may have lost destroy events too. */
+	ctnl_purge();
 }
 
 static void do_polling_alarm(struct alarm_block *a, void *data)
 {
-	if (STATE(mode)->internal->ct.purge)
-		STATE(mode)->internal->ct.purge();
+	ctnl_purge();
 
 	if (STATE(mode)->internal->exp.purge)
 		STATE(mode)->internal->exp.purge();
@@ -170,15 +250,26 @@ static void do_polling_alarm(struct alarm_block *a, void *data)
 	add_alarm(&STATE(polling_alarm), CONFIG(poll_kernel_secs), 0);
 }
 
+/*
+ * The event comes as a compact record, @ct is only passed if the whole
+ * library object is needed, otherwise the record is turned into the
+ * reusable event_ct.
+ */
 static int event_handler(const struct nlmsghdr *nlh,
 			 enum nf_conntrack_msg_type type,
-			 struct nf_conntrack *ct,
-			 void *data)
+			 const struct ct_record *rec,
+			 const struct cache_key *key,
+			 struct nf_conntrack *ct)
 {
 	int origin_type;
 
 	STATE(stats).nl_events_received++;
 
+	if (ct == NULL) {
+		ct = event_ct;
+		ct_record_fill(rec, ct);
+	}
+
 	/* skip user-space filtering if already do it in the kernel */
 	if (ct_filter_conntrack(ct, !CONFIG(filter_from_kernelspace))) {
 		STATE(stats).nl_events_filtered++;
@@ -189,13 +280,13 @@ static int event_handler(const struct nlmsghdr *nlh,
 
 	switch(type) {
 	case NFCT_T_NEW:
-		STATE(mode)->internal->ct.new(ct, origin_type);
+		STATE(mode)->internal->ct.new(ct, key, origin_type);
 		break;
 	case NFCT_T_UPDATE:
-		STATE(mode)->internal->ct.upd(ct, origin_type);
+		STATE(mode)->internal->ct.upd(ct, key, origin_type);
 		break;
 	case NFCT_T_DESTROY:
-		if (STATE(mode)->internal->ct.del(ct, origin_type))
+		if (STATE(mode)->internal->ct.del(ct, key, origin_type))
 			update_traffic_stats(ct);
 		break;
 	default:
@@ -295,14 +386,21 @@ static int exp_dump_handler(enum nf_conntrack_msg_type type,
 	return NFCT_CB_CONTINUE;
 }
 
-static int get_handler(enum nf_conntrack_msg_type type,
-		       struct nf_conntrack *ct,
-		       void *data)
+static int purge_handler(enum nf_conntrack_msg_type type,
+			 struct nf_conntrack *ct,
+			 void *data)
 {
 	if (ct_filter_conntrack(ct, 1))
 		return NFCT_CB_CONTINUE;
 
-	STATE(get_retval) = 1;
+	switch(type) {
+	case NFCT_T_UPDATE:
+		STATE(mode)->internal->ct.seen(ct);
+		break;
+	default:
+		STATE(stats).nl_dump_unknown_type++;
+		break;
+	}
 	return NFCT_CB_CONTINUE;
 }
 
@@ -322,74 +420,615 @@ static int exp_get_handler(enum nf_conntrack_msg_type type,
 	return NFCT_CB_CONTINUE;
 }
 
-/* we have received an event from ctnetlink */
-static void event_cb(void *data)
+static void event_overrun(void)
+{
+	/* We have hit ENOBUFS, it's likely that we are
+	 * losing events. Two possible situations may
+	 * trigger this error:
+	 *
+	 * 1) The netlink receiver buffer is too small:
+	 *    increasing the netlink buffer size should
+	 *    be enough. However, some event messages
+	 *    got lost. We have to resync ourselves
+	 *    with the kernel table conntrack table to
+	 *    resolve the inconsistency.
+	 *
+	 * 2) The receiver is too slow to process the
+	 *    netlink messages so that the queue gets
+	 *    full quickly. This generally happens
+	 *    if the system is under heavy workload
+	 *    (busy CPU). In this case, increasing the
+	 *    size of the netlink receiver buffer
+	 *    would not help anymore since we would
+	 *    be delaying the overrun. Moreover, we
+	 *    should avoid resynchronizations. We
+	 *    should do our best here and keep
+	 *    replicating as much states as possible.
+	 *    If workload lowers at some point,
+	 *    we resync ourselves.
+	 */
+	nl_resize_socket_buffer(STATE(event));
+	if (CONFIG(nl_overrun_resync) > 0 &&
+	    STATE(mode)->internal->flags & INTERNAL_F_RESYNC) {
+		add_alarm(&STATE(resync_alarm),
+			  CONFIG(nl_overrun_resync),0);
+	}
+	STATE(stats).nl_catch_event_failed++;
+	STATE(stats).nl_overrun++;
+}
+
+static int ctnl_event_type(const struct nlmsghdr *nlh)
+{
+	uint16_t flags = nlh->nlmsg_flags;
+
+	switch(NFNL_MSG_TYPE(nlh->nlmsg_type)) {
+	case IPCTNL_MSG_CT_NEW:	/* same value as IPCTNL_MSG_EXP_NEW */
+		if (flags & (NLM_F_CREATE|NLM_F_EXCL))
+			return NFCT_T_NEW;
+		return NFCT_T_UPDATE;
+	case IPCTNL_MSG_CT_DELETE: /* same value as IPCTNL_MSG_EXP_DELETE */
+		return NFCT_T_DESTROY;
+	}
+	return NFCT_T_UNKNOWN;
+}
+
+/* destroyed entries are logged in stats mode, the log wants them all. */
+static int ctnl_event_needs_ct(int type)
+{
+	return type == NFCT_T_DESTROY &&
+	       CONFIG(flags) & CTD_STATS_MODE &&
+	       (STATE(stats_log) != NULL ||
+		CONFIG(stats).syslog_facility != -1);
+}
+
+static struct nf_conntrack *ctnl_event_ct(const struct nlmsghdr *nlh)
 {
+	struct nf_conntrack *ct;
+
+	ct = nfct_new();
+	if (ct == NULL)
+		return NULL;
+
+	if (nfct_nlmsg_parse(nlh, ct) < 0) {
+		nfct_destroy(ct);
+		return NULL;
+	}
+	return ct;
+}
+
+static struct nf_expect *ctnl_event_exp(const struct nlmsghdr *nlh)
+{
+	struct nf_expect *exp;
+
+	exp = nfexp_new();
+	if (exp == NULL)
+		return NULL;
+
+	if (nfexp_nlmsg_parse(nlh, exp) < 0) {
+		nfexp_destroy(exp);
+		return NULL;
+	}
+	return exp;
+}
+
+/*
+ * Event datagrams are received in batches with recvmmsg() into these
+ * preallocated buffers, one datagram per buffer.
+ */
+#define CTNL_RECV_BUFSIZ	8192
+
+static struct {
+	struct mmsghdr		msg[CTNL_RECV_BATCH];
+	struct iovec		iov[CTNL_RECV_BATCH];
+	struct sockaddr_nl	addr[CTNL_RECV_BATCH];
+	char			buf[CTNL_RECV_BATCH][CTNL_RECV_BUFSIZ];
+} recv_batch;
+
+static void ctnl_recv_init(void)
+{
+	int i;
+
+	for (i = 0; i < CTNL_RECV_BATCH; i++) {
+		recv_batch.iov[i].iov_base = recv_batch.buf[i];
+		recv_batch.iov[i].iov_len = CTNL_RECV_BUFSIZ;
+		recv_batch.msg[i].msg_hdr.msg_iov = &recv_batch.iov[i];
+		recv_batch.msg[i].msg_hdr.msg_iovlen = 1;
+		recv_batch.msg[i].msg_hdr.msg_name = &recv_batch.addr[i];
+		recv_batch.msg[i].msg_hdr.msg_namelen =
+			sizeof(struct sockaddr_nl);
+	}
+}
+
+/* this may run in the reader thread, hence the atomic stats. */
+static int ctnl_recv(int fd)
+{
+	int num, slot;
+
+	num = recvmmsg(fd, recv_batch.msg, CTNL_RECV_BATCH, 0, NULL);
+	if (num <= 0)
+		return num;
+
+	/* log2 histogram of the datagrams per system call. */
+	slot = 31 - __builtin_clz(num);
+	if (slot >= CTNL_RECV_HIST)
+		slot = CTNL_RECV_HIST - 1;
+
+	__atomic_fetch_add(&STATE(stats).nl_recv_calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&STATE(stats).nl_recv_batch[slot], 1,
+			   __ATOMIC_RELAXED);
+	return num;
+}
+
+/* run @cb on every message of the @num datagrams of the last ctnl_recv() */
+static int ctnl_recv_walk(int num, int (*cb)(const struct nlmsghdr *nlh))
+{
+	int i, ret = NFCT_CB_CONTINUE;
+	uint32_t msgs = 0;
+
+	for (i = 0; i < num; i++) {
+		const struct nlmsghdr *nlh =
+			(struct nlmsghdr *)recv_batch.buf[i];
+		struct msghdr *hdr = &recv_batch.msg[i].msg_hdr;
+		int len = recv_batch.msg[i].msg_len;
+
+		/* msg_namelen is overwritten, reset it for the next call. */
+		hdr->msg_namelen = sizeof(struct sockaddr_nl);
+
+		/* only trust events sent by the kernel. */
+		if (recv_batch.addr[i].nl_pid != 0) {
+			__atomic_fetch_add(&STATE(stats).nl_catch_event_failed,
+					   1, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (hdr->msg_flags & MSG_TRUNC) {
+			__atomic_fetch_add(&STATE(stats).nl_catch_event_failed,
+					   1, __ATOMIC_RELAXED);
+			continue;
+		}
+		while (mnl_nlmsg_ok(nlh, len)) {
+			if (cb(nlh) == NFCT_CB_STOP)
+				ret = NFCT_CB_STOP;
+			nlh = mnl_nlmsg_next(nlh, &len);
+			msgs++;
+		}
+	}
+	__atomic_fetch_add(&STATE(stats).nl_recv_msgs, msgs, __ATOMIC_RELAXED);
+	return ret;
+}
+
+/*
+ * Conntrack events are parsed and hashed first, prefetching the cache
+ * buckets that they are looked up in, then they are handled in one go.
+ */
+static struct {
+	unsigned int		num;
+	struct {
+		const struct nlmsghdr	*nlh;
+		int			type;
+		struct cache_key	key;
+		struct ct_record	rec;
+	} ev[CTNL_RECV_BATCH];
+} event_batch;
+
+static int event_batch_flush(void)
+{
+	struct internal_handler *internal = STATE(mode)->internal;
+	int ret = NFCT_CB_CONTINUE;
+	unsigned int i;
+
+	if (event_batch.num == 0)
+		return ret;
+
+	if (internal->ct.batch_start)
+		internal->ct.batch_start();
+
+	for (i = 0; i < event_batch.num; i++) {
+		struct nf_conntrack *ct = NULL;
+
+		if (ctnl_event_needs_ct(event_batch.ev[i].type))
+			ct = ctnl_event_ct(event_batch.ev[i].nlh);
+
+		if (event_handler(event_batch.ev[i].nlh,
+				  event_batch.ev[i].type,
+				  &event_batch.ev[i].rec,
+				  &event_batch.ev[i].key, ct) == NFCT_CB_STOP)
+			ret = NFCT_CB_STOP;
+
+		if (ct)
+			nfct_destroy(ct);
+	}
+
+	if (internal->ct.batch_done)
+		internal->ct.batch_done();
+
+	event_batch.num = 0;
+	return ret;
+}
+
+static int event_batch_add(const struct nlmsghdr *nlh)
+{
+	typeof(event_batch.ev[0]) *ev = &event_batch.ev[event_batch.num];
+
+	if (ct_record_parse(nlh, &ev->rec) == -1) {
+		STATE(stats).nl_catch_event_failed++;
+		return NFCT_CB_CONTINUE;
+	}
+	ev->nlh = nlh;
+	ev->type = ctnl_event_type(nlh);
+	ct_record_key(&ev->rec, &ev->key);
+
+	if (STATE(mode)->internal->ct.prefetch_key)
+		STATE(mode)->internal->ct.prefetch_key(&ev->key);
+
+	if (++event_batch.num == CTNL_RECV_BATCH)
+		return event_batch_flush();
+
+	return NFCT_CB_CONTINUE;
+}
+
+static int event_msg(const struct nlmsghdr *nlh)
+{
+	struct nf_expect *exp;
 	int ret;
 
-	ret = nfct_catch(STATE(event));
+	switch(NFNL_SUBSYS_ID(nlh->nlmsg_type)) {
+	case NFNL_SUBSYS_CTNETLINK:
+		return event_batch_add(nlh);
+	case NFNL_SUBSYS_CTNETLINK_EXP:
+		/* expectations are rare, the library object is fine. */
+		if (!(CONFIG(flags) & CTD_EXPECT))
+			break;
+
+		/* keep the order with the conntrack events before it. */
+		ret = event_batch_flush();
+
+		exp = ctnl_event_exp(nlh);
+		if (exp == NULL) {
+			STATE(stats).nl_catch_event_failed++;
+			return ret;
+		}
+		if (exp_event_handler(nlh, ctnl_event_type(nlh),
+				      exp, NULL) == NFCT_CB_STOP)
+			ret = NFCT_CB_STOP;
+		nfexp_destroy(exp);
+		return ret;
+	default:
+		/*
+		 * We received a message from another
+		 * netfilter subsystem that we are not
+		 * interested in. Just ignore it.
+		 */
+		break;
+	}
+	return NFCT_CB_CONTINUE;
+}
+
+/*
+ * We have received events from ctnetlink. The messages are parsed in the
+ * receive buffers, instead of going through nfct_catch() which reads one
+ * datagram per call and allocates one object per event.
+ */
+static void event_cb(void *data)
+{
+	int fd = nfct_fd(STATE(event));
+	int num, stop = 0;
+
 	/* reset event iteration limit counter */
 	STATE(event_iterations_limit) = CONFIG(event_iterations_limit);
-	if (ret == -1) {
+
+	/* the limit is checked per batch, not to lose events. */
+	while (!stop && (num = ctnl_recv(fd)) > 0) {
+		if (ctnl_recv_walk(num, event_msg) == NFCT_CB_STOP)
+			stop = 1;
+		if (event_batch_flush() == NFCT_CB_STOP)
+			stop = 1;
+	}
+	if (stop || num == 0)
+		return;
+
+	switch(errno) {
+	case ENOBUFS:
+		event_overrun();
+		break;
+	case EAGAIN:
+		/* No more events to receive, try later. */
+		fds_drained();
+		break;
+	case EINTR:
+		break;
+	default:
+		STATE(stats).nl_catch_event_failed++;
+		break;
+	}
+}
+
+/*
+ * Threaded event reader: a dedicated thread drains the ctnetlink event
+ * socket and parses the messages into conntrack records and expectation
+ * objects, so slow operations in the main select loop (commit, dumps to
+ * clients) do not make us hit ENOBUFS. Parsed events are passed to the main thread
+ * through a single-producer single-consumer ring.
+ */
+struct ctnl_event {
+	uint16_t		type;		/* NFCT_T_* */
+	uint16_t		subsys;		/* NFNL_SUBSYS_CTNETLINK* */
+	uint32_t		portid;		/* to find the event origin */
+	union {
+		struct nf_conntrack	*ct;	/* if the record is not enough */
+		struct nf_expect	*exp;
+	};
+	struct ct_record	rec;
+};
+
+#define CTNL_RING_SIZE		16384
+#define CTNL_STALL_USECS	100
+
+static struct {
+	pthread_t		thread;
+	struct ring		*ring;
+	struct evfd		*evfd;		/* wakes up the main thread */
+	int			overrun;	/* ENOBUFS seen by the thread */
+	int			stop;		/* set by ctnl_reader_stop() */
+} reader;
+
+static void ctnl_reader_wakeup(void)
+{
+	if (write_evfd(reader.evfd) == -1)
+		__atomic_fetch_add(&STATE(stats).nl_catch_event_failed, 1,
+				   __ATOMIC_RELAXED);
+}
+
+static uint64_t time_usecs(void)
+{
+	return time_ns() / 1000;
+}
+
+/* this runs in the reader thread */
+static int ctnl_reader_enqueue(const struct nlmsghdr *nlh)
+{
+	struct ctnl_event *ev;
+	uint16_t subsys = NFNL_SUBSYS_ID(nlh->nlmsg_type);
+	uint64_t stall_start = 0;
+
+	switch(subsys) {
+	case NFNL_SUBSYS_CTNETLINK:
+		break;
+	case NFNL_SUBSYS_CTNETLINK_EXP:
+		if (!(CONFIG(flags) & CTD_EXPECT))
+			return NFCT_CB_CONTINUE;
+		break;
+	default:
+		return NFCT_CB_CONTINUE;
+	}
+
+	/* the main thread is lagging behind, wait for room in the ring.
+	 * It does not consume events anymore once we are stopping. */
+	while ((ev = ring_write_slot(reader.ring)) == NULL) {
+		if (__atomic_load_n(&reader.stop, __ATOMIC_ACQUIRE))
+			return NFCT_CB_STOP;
+
+		if (stall_start == 0) {
+			stall_start = time_usecs();
+			__atomic_fetch_add(&STATE(stats).nl_ring_stalls, 1,
+					   __ATOMIC_RELAXED);
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		usleep(CTNL_STALL_USECS);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	}
+	if (stall_start) {
+		__atomic_fetch_add(&STATE(stats).nl_ring_stall_usecs,
+				   time_usecs() - stall_start,
+				   __ATOMIC_RELAXED);
+	}
+
+	ev->type = ctnl_event_type(nlh);
+	ev->subsys = subsys;
+	ev->portid = nlh->nlmsg_pid;
+
+	/* parse in place, the slot is reused if this fails. */
+	if (subsys == NFNL_SUBSYS_CTNETLINK) {
+		if (ct_record_parse(nlh, &ev->rec) == -1)
+			goto err;
+		ev->ct = NULL;
+		if (ctnl_event_needs_ct(ev->type))
+			ev->ct = ctnl_event_ct(nlh);
+	} else {
+		ev->exp = ctnl_event_exp(nlh);
+		if (ev->exp == NULL)
+			goto err;
+	}
+
+	if (ring_write_commit(reader.ring))
+		ctnl_reader_wakeup();
+	return NFCT_CB_CONTINUE;
+err:
+	__atomic_fetch_add(&STATE(stats).nl_catch_event_failed, 1,
+			   __ATOMIC_RELAXED);
+	return NFCT_CB_CONTINUE;
+}
+
+static void *ctnl_reader_thread(void *data)
+{
+	struct pollfd pfd = {
+		.fd	= nfct_fd(STATE(event)),
+		.events	= POLLIN,
+	};
+
+	/* only cancel while waiting for events, not while parsing them. */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	while (!__atomic_load_n(&reader.stop, __ATOMIC_ACQUIRE)) {
+		int ret;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ret = poll(&pfd, 1, -1);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (ret == -1)
+			continue;
+
+		while (!__atomic_load_n(&reader.stop, __ATOMIC_ACQUIRE) &&
+		       (ret = ctnl_recv(pfd.fd)) > 0)
+			ctnl_recv_walk(ret, ctnl_reader_enqueue);
+		if (ret >= 0)
+			continue;
+
 		switch(errno) {
 		case ENOBUFS:
-			/* We have hit ENOBUFS, it's likely that we are
-			 * losing events. Two possible situations may
-			 * trigger this error:
-			 *
-			 * 1) The netlink receiver buffer is too small:
-			 *    increasing the netlink buffer size should
-			 *    be enough. However, some event messages
-			 *    got lost. We have to resync ourselves
-			 *    with the kernel table conntrack table to
-			 *    resolve the inconsistency.
-			 *
-			 * 2) The receiver is too slow to process the
-			 *    netlink messages so that the queue gets
-			 *    full quickly. This generally happens
-			 *    if the system is under heavy workload
-			 *    (busy CPU). In this case, increasing the
-			 *    size of the netlink receiver buffer
-			 *    would not help anymore since we would
-			 *    be delaying the overrun. Moreover, we
-			 *    should avoid resynchronizations. We
-			 *    should do our best here and keep
-			 *    replicating as much states as possible.
-			 *    If workload lowers at some point,
-			 *    we resync ourselves.
-			 */
-			nl_resize_socket_buffer(STATE(event));
-			if (CONFIG(nl_overrun_resync) > 0 &&
-			    STATE(mode)->internal->flags & INTERNAL_F_RESYNC) {
-				add_alarm(&STATE(resync_alarm),
-					  CONFIG(nl_overrun_resync),0);
-			}
-			STATE(stats).nl_catch_event_failed++;
-			STATE(stats).nl_overrun++;
+			/* resizing and resync is done by the main thread. */
+			__atomic_store_n(&reader.overrun, 1, __ATOMIC_RELEASE);
+			ctnl_reader_wakeup();
 			break;
-		case ENOENT:
-			/*
-			 * We received a message from another
-			 * netfilter subsystem that we are not
-			 * interested in. Just ignore it.
-			 */
-		break;
 		case EAGAIN:
-			/* No more events to receive, try later. */
+		case EINTR:
 			break;
 		default:
-			STATE(stats).nl_catch_event_failed++;
+			__atomic_fetch_add(&STATE(stats).nl_catch_event_failed,
+					   1, __ATOMIC_RELAXED);
 			break;
 		}
 	}
+	return NULL;
+}
+
+static void ctnl_event_release(struct ctnl_event *ev)
+{
+	if (ev->subsys == NFNL_SUBSYS_CTNETLINK) {
+		if (ev->ct)
+			nfct_destroy(ev->ct);
+	} else
+		nfexp_destroy(ev->exp);
 }
 
-/* we previously requested a resync due to buffer overrun. */
+/* the reader thread has passed us events, consume them in batches. */
+static void event_ring_cb(void *data)
+{
+	struct internal_handler *internal = STATE(mode)->internal;
+	struct ctnl_event *ev;
+	unsigned int depth;
+
+	if (read_evfd(reader.evfd) <= 0) {
+		fds_drained();
+		return;
+	}
+
+	if (__atomic_exchange_n(&reader.overrun, 0, __ATOMIC_ACQUIRE))
+		event_overrun();
+
+	depth = ring_depth(reader.ring);
+	if (depth > STATE(stats).nl_ring_max_depth)
+		STATE(stats).nl_ring_max_depth = depth;
+	STATE(stats).nl_ring_batches++;
+
+	/* reset event iteration limit counter */
+	STATE(event_iterations_limit) = CONFIG(event_iterations_limit);
+
+	if (internal->ct.batch_start)
+		internal->ct.batch_start();
+
+	while ((ev = ring_read_slot(reader.ring)) != NULL) {
+		/* only the port ID is used to look up for the origin. */
+		struct nlmsghdr nlh = {
+			.nlmsg_pid	= ev->portid,
+		};
+		struct cache_key key;
+		int ret, more;
+
+		if (ev->subsys == NFNL_SUBSYS_CTNETLINK) {
+			ct_record_key(&ev->rec, &key);
+			ret = event_handler(&nlh, ev->type, &ev->rec,
+					    &key, ev->ct);
+		} else
+			ret = exp_event_handler(&nlh, ev->type, ev->exp, NULL);
+
+		ctnl_event_release(ev);
+		more = ring_read_commit(reader.ring);
+
+		/* give other descriptors a chance, come back later. */
+		if (ret == NFCT_CB_STOP) {
+			if (more)
+				ctnl_reader_wakeup();
+			break;
+		}
+	}
+
+	if (internal->ct.batch_done)
+		internal->ct.batch_done();
+}
+
+static int ctnl_reader_start(void)
+{
+	sigset_t all, old;
+	int ret, efd;
+
+	reader.ring = ring_create(CTNL_RING_SIZE, sizeof(struct ctnl_event));
+	if (reader.ring == NULL)
+		return -1;
+
+	reader.evfd = create_evfd();
+	if (reader.evfd == NULL) {
+		ring_destroy(reader.ring);
+		return -1;
+	}
+	efd = get_read_evfd(reader.evfd);
+	register_fd(efd, event_ring_cb, NULL, STATE(fds));
+	fds_set_priority(efd, FDS_PRIO_HIGH, STATE(fds));
+	fds_set_name(efd, "netlink", STATE(fds));
+
+	/* signals are handled by the main thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&reader.thread, NULL, ctnl_reader_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		unregister_fd(efd, STATE(fds));
+		destroy_evfd(reader.evfd);
+		ring_destroy(reader.ring);
+		errno = ret;
+		return -1;
+	}
+	dlog(LOG_NOTICE, "netlink event reader thread is ENABLED");
+	return 0;
+}
+
+static void ctnl_reader_drain(void)
+{
+	struct ctnl_event *ev;
+
+	while ((ev = ring_read_slot(reader.ring)) != NULL) {
+		ctnl_event_release(ev);
+		ring_read_commit(reader.ring);
+	}
+}
+
+static void ctnl_reader_stop(void)
+{
+	/* the thread may be waiting for room in the ring, make some. */
+	__atomic_store_n(&reader.stop, 1, __ATOMIC_RELEASE);
+	ctnl_reader_drain();
+
+	pthread_cancel(reader.thread);
+	pthread_join(reader.thread, NULL);
+
+	ctnl_reader_drain();
+	unregister_fd(get_read_evfd(reader.evfd), STATE(fds));
+	destroy_evfd(reader.evfd);
+	ring_destroy(reader.ring);
+}
+
+unsigned int ctnl_reader_depth(void)
+{
+	if (reader.ring == NULL)
+		return 0;
+
+	return ring_depth(reader.ring);
+}
+
+/* we previously requested a resync due to buffer overrun, the purge was
+ * started along with it. */
 static void resync_cb(void *data)
 {
 	nfct_catch(STATE(resync));
-	if (STATE(mode)->internal->ct.purge)
-		STATE(mode)->internal->ct.purge();
 }
 
 static void poll_cb(void *data)
@@ -435,6 +1074,7 @@ int ctnl_init(void)
 		register_fd(nfct_fd(STATE(resync)), resync_cb,
 				NULL, STATE(fds));
 	}
+	fds_set_name(nfct_fd(STATE(resync)), "resync", STATE(fds));
 	fcntl(nfct_fd(STATE(resync)), F_SETFL, O_NONBLOCK);
 
 	if (STATE(mode)->internal->flags & INTERNAL_F_POPULATE) {
@@ -453,7 +1093,7 @@ int ctnl_init(void)
 						exp_dump_handler, NULL);
 		}
 
-		if (nl_dump_conntrack_table(STATE(dump)) == -1) {
+		if (ctnl_populate() == -1) {
 			dlog(LOG_ERR, "can't get kernel conntrack table");
 			return -1;
 		}
@@ -474,7 +1114,7 @@ int ctnl_init(void)
 		dlog(LOG_ERR, "no ctnetlink kernel support?");
 		return -1;
 	}
-	nfct_callback_register(STATE(get), NFCT_T_ALL, get_handler, NULL);
+	nfct_callback_register(STATE(get), NFCT_T_ALL, purge_handler, NULL);
 
 	if (CONFIG(flags) & CTD_EXPECT) {
 		nfexp_callback_register(STATE(get), NFCT_T_ALL,
@@ -489,6 +1129,14 @@ int ctnl_init(void)
 	/* register this handler as the origin of a flush operation */
 	origin_register(STATE(flush), CTD_ORIGIN_FLUSH);
 
+	/* the same for the flushes run by worker threads. */
+	STATE(flush_job) = nfct_open(CONFIG(netlink).subsys_id, 0);
+	if (STATE(flush_job) == NULL) {
+		dlog(LOG_ERR, "cannot open flusher handler");
+		return -1;
+	}
+	origin_register(STATE(flush_job), CTD_ORIGIN_FLUSH);
+
 	if (CONFIG(flags) & CTD_POLL) {
 		init_alarm(&STATE(polling_alarm), NULL, do_polling_alarm);
 		add_alarm(&STATE(polling_alarm), CONFIG(poll_kernel_secs), 0);
@@ -510,14 +1158,28 @@ int ctnl_init(void)
 			dlog(LOG_ERR, "no ctnetlink kernel support?");
 			return -1;
 		}
-		nfct_callback_register2(STATE(event), NFCT_T_ALL,
-				        event_handler, NULL);
-
-		if (CONFIG(flags) & CTD_EXPECT) {
-			nfexp_callback_register2(STATE(event), NFCT_T_ALL,
-						 exp_event_handler, NULL);
+		/* events are parsed by us, see event_cb(). */
+		ctnl_recv_init();
+		event_ct = nfct_new();
+		if (event_ct == NULL) {
+			dlog(LOG_ERR, "can't allocate memory for events");
+			return -1;
+		}
+		if (CONFIG(netlink).event_thread) {
+			if (ctnl_reader_start() == -1) {
+				dlog(LOG_ERR, "can't start netlink event "
+					      "reader thread: %s",
+				     strerror(errno));
+				return -1;
+			}
+		} else {
+			register_fd(nfct_fd(STATE(event)), event_cb,
+				    NULL, STATE(fds));
+			fds_set_priority(nfct_fd(STATE(event)),
+					 FDS_PRIO_HIGH, STATE(fds));
+			fds_set_name(nfct_fd(STATE(event)), "netlink",
+				     STATE(fds));
 		}
-		register_fd(nfct_fd(STATE(event)), event_cb, NULL, STATE(fds));
 	}
 
 	return 0;
@@ -5,23 +5,54 @@
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation; either version 2 of the License, or
  * (at your option) any later version.
+ *
+ * All the timing in the daemon is based on the monotonic clock, so that
+ * adjustments of the wall-clock (NTP, settimeofday) do not make timers
+ * expire all at once or stall them. The clock is read once per main loop
+ * iteration, use the cached values in the fast path.
  */
 #include "date.h"
 #include <stdlib.h>
 #include <string.h>
 
+static uint64_t now_ns;
 static struct timeval now;
 
-int do_gettimeofday(void)
+uint64_t time_ns(void)
+{
+	struct timespec ts;
+
+	/* this is served from the vDSO, no syscall is involved. */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void gettime(struct timeval *tv)
+{
+	uint64_t ns = time_ns();
+
+	tv->tv_sec = ns / NSEC_PER_SEC;
+	tv->tv_usec = (ns % NSEC_PER_SEC) / 1000;
+}
+
+int do_gettime(void)
 {
-	return gettimeofday(&now, NULL);
+	now_ns = time_ns();
+	now.tv_sec = now_ns / NSEC_PER_SEC;
+	now.tv_usec = (now_ns % NSEC_PER_SEC) / 1000;
+	return 0;
 }
 
-void gettimeofday_cached(struct timeval *tv)
+void gettime_cached(struct timeval *tv)
 {
 	memcpy(tv, &now, sizeof(struct timeval));
 }
 
+uint64_t time_ns_cached(void)
+{
+	return now_ns;
+}
+
 int time_cached(void)
 {
 	return now.tv_sec;
@@ -15,16 +15,17 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
-#include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
-#include <fcntl.h>
+#include <errno.h>
+#include <sys/eventfd.h>
 
 #include "event.h"
 
 struct evfd {
-	int read;
-	int fds[2];
+	int		fd;
+	uint32_t	pending;	/* signals since the last read_evfd() */
 };
 
 struct evfd *create_evfd(void)
@@ -35,43 +36,62 @@ struct evfd *create_evfd(void)
 	if (e == NULL)
 		return NULL;
 
-	if (pipe(e->fds) == -1) {
+	e->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (e->fd == -1) {
 		free(e);
 		return NULL;
 	}
-	fcntl(e->fds[0], F_SETFL, O_NONBLOCK);
 
 	return e;
 }
 
 void destroy_evfd(struct evfd *e)
 {
-	close(e->fds[0]);
-	close(e->fds[1]);
+	close(e->fd);
 	free(e);
 }
 
 int get_read_evfd(struct evfd *evfd)
 {
-	return evfd->fds[0];
+	return evfd->fd;
 }
 
+/*
+ * Tell the consumer that there is work to do, this can be called from any
+ * thread. Only the first signal after read_evfd() hits the eventfd, the
+ * following ones are coalesced until the consumer wakes up. The producer
+ * must publish the work before calling this.
+ */
 int write_evfd(struct evfd *evfd)
 {
-	int data = 0, ret = 0;
+	uint64_t u = 1;
+
+	if (__atomic_fetch_add(&evfd->pending, 1, __ATOMIC_SEQ_CST) != 0)
+		return 0;
 
-	if (evfd->read == 0)
-		ret = write(evfd->fds[1], &data, sizeof(data));
-	evfd->read++;
+	if (write(evfd->fd, &u, sizeof(u)) == -1 && errno != EAGAIN)
+		return -1;
 
-	return ret;
+	return 0;
 }
 
+/*
+ * Acknowledge the wake-up and return the number of signals that have been
+ * coalesced into it, zero if there was nothing pending. The consumer has
+ * to handle all the work that was published before the signals, anything
+ * that is published later triggers a new wake-up.
+ */
 int read_evfd(struct evfd *evfd)
 {
-	int data, ret = 0;
+	uint32_t pending;
+	uint64_t u;
+
+	pending = __atomic_exchange_n(&evfd->pending, 0, __ATOMIC_SEQ_CST);
+
+	/* a producer may have bumped the counter and not written yet, we
+	 * have to drain always, otherwise we would spin on a readable fd. */
+	if (read(evfd->fd, &u, sizeof(u)) == -1 && errno != EAGAIN)
+		return -1;
 
-	if (--evfd->read == 0)
-		ret = read(evfd->fds[0], &data, sizeof(data));
-	return ret;
+	return pending;
 }
@@ -24,19 +24,31 @@
 
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 
 static struct cache *external;
 static struct cache *external_exp;
 
 static int external_cache_init(void)
 {
-	external = cache_create("external", CACHE_T_CT,
-				STATE_SYNC(sync)->external_cache_flags,
+	unsigned int flags = STATE_SYNC(sync)->external_cache_flags;
+
+	if (CONFIG(sync).external_file[0])
+		flags |= PERSIST;
+
+	external = cache_create("external", CACHE_T_CT, flags,
 				NULL, &cache_sync_external_ct_ops);
 	if (external == NULL) {
 		dlog(LOG_ERR, "can't allocate memory for the external cache");
 		return -1;
 	}
+	if (CONFIG(sync).external_file[0] &&
+	    cache_file_open(external, CONFIG(sync).external_file) == -1) {
+		dlog(LOG_ERR, "can't open cache file `%s': %s, going on "
+		     "without it", CONFIG(sync).external_file,
+		     strerror(errno));
+	}
 	external_exp = cache_create("external", CACHE_T_EXP,
 				STATE_SYNC(sync)->external_cache_flags,
 				NULL, &cache_sync_external_exp_ops);
@@ -99,6 +111,11 @@ static void external_cache_ct_dump(int fd, int type)
 	cache_dump(external, fd, type);
 }
 
+static int external_cache_ct_dump_async(int fd, int type)
+{
+	return cache_dump_async(external, fd, type);
+}
+
 static int external_cache_ct_commit(struct nfct_handle *h, int fd)
 {
 	return cache_commit(external, h, fd);
@@ -109,6 +126,17 @@ static void external_cache_ct_flush(void)
 	cache_flush(external);
 }
 
+static int
+external_cache_ct_dump_index(int fd, int type, const struct cache_index_query *q)
+{
+	return cache_index_dump(external, fd, type, q);
+}
+
+static int external_cache_ct_flush_index(const struct cache_index_query *q)
+{
+	return cache_index_flush(external, q);
+}
+
 static void external_cache_ct_stats(int fd)
 {
 	cache_stats(external, fd);
@@ -164,6 +192,11 @@ static void external_cache_exp_dump(int fd, int type)
 	cache_dump(external_exp, fd, type);
 }
 
+static int external_cache_exp_dump_async(int fd, int type)
+{
+	return cache_dump_async(external_exp, fd, type);
+}
+
 static int external_cache_exp_commit(struct nfct_handle *h, int fd)
 {
 	return cache_commit(external_exp, h, fd);
@@ -192,8 +225,11 @@ struct external_handler external_cache = {
 		.upd		= external_cache_ct_upd,
 		.del		= external_cache_ct_del,
 		.dump		= external_cache_ct_dump,
+		.dump_async	= external_cache_ct_dump_async,
 		.commit		= external_cache_ct_commit,
 		.flush		= external_cache_ct_flush,
+		.dump_index	= external_cache_ct_dump_index,
+		.flush_index	= external_cache_ct_flush_index,
 		.stats		= external_cache_ct_stats,
 		.stats_ext	= external_cache_ct_stats_ext,
 	},
@@ -202,6 +238,7 @@ struct external_handler external_cache = {
 		.upd		= external_cache_exp_upd,
 		.del		= external_cache_exp_del,
 		.dump		= external_cache_exp_dump,
+		.dump_async	= external_cache_exp_dump_async,
 		.commit		= external_cache_exp_commit,
 		.flush		= external_cache_exp_flush,
 		.stats		= external_cache_exp_stats,
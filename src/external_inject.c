@@ -23,10 +23,14 @@
 #include "origin.h"
 #include "external.h"
 #include "netlink.h"
+#include "fds.h"
+#include "jhash.h"
 
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 
 static struct nfct_handle *inject;
 
@@ -37,109 +41,424 @@ struct {
 	uint32_t	upd_fail;
 	uint32_t	del_ok;
 	uint32_t	del_fail;
+	uint32_t	collapsed;
+	uint32_t	batches;
 } external_inject_stat;
 
-static int external_inject_init(void)
+/*
+ * The conntrack requests that we receive from one channel read are
+ * accumulated and sent to the kernel in one netlink batch, then the
+ * acknowledgments are collected from the main loop. Requests for the same
+ * tuple that have not been sent yet are collapsed into one, so there is at
+ * most one request per tuple out of the pool. The fallbacks (delete and
+ * create again) are queued as follow-up requests, unless a newer request
+ * for the tuple arrived while the batch was in flight: that one carries
+ * the latest state, so the follow-up is dropped.
+ */
+#define INJECT_MAX		(NL_BATCH_MAX * 2)
+#define INJECT_HASHSIZE		512
+
+enum {
+	INJECT_T_NEW,
+	INJECT_T_UPD,
+	INJECT_T_DEL,
+};
+
+/* the message that we have to send next. */
+enum {
+	INJECT_S_CREATE,
+	INJECT_S_UPDATE,
+	INJECT_S_DESTROY,
+};
+
+/* why we are trying again, to report the same errors as before. */
+enum {
+	INJECT_F_NONE,
+	INJECT_F_ADD1,
+	INJECT_F_UPD1,
+	INJECT_F_UPD2,
+};
+
+struct inject_req {
+	struct list_head	head;
+	struct inject_req	*hnext;
+	struct cache_key	key;
+	struct nf_conntrack	*ct;
+	uint8_t			type;
+	uint8_t			stage;
+	uint8_t			fallback;
+	uint8_t			hashed;
+};
+
+static struct inject_req inject_pool[INJECT_MAX];
+static struct inject_req *inject_hash[INJECT_HASHSIZE];
+static struct nl_batch *inject_batch;
+
+static LIST_HEAD(inject_free);
+static LIST_HEAD(inject_unsent);
+static LIST_HEAD(inject_retry);
+
+static inline uint32_t inject_hashval(const struct cache_key *key)
 {
-	/* handler to directly inject conntracks into kernel-space */
-	inject = nfct_open(CONFIG(netlink).subsys_id, 0);
-	if (inject == NULL) {
-		dlog(LOG_ERR, "can't open netlink handler: %s",
-		     strerror(errno));
-		dlog(LOG_ERR, "no ctnetlink kernel support?");
-		return -1;
+	return jhash2((const uint32_t *)key,
+		      offsetof(struct cache_key, id) / sizeof(uint32_t), 0) &
+		(INJECT_HASHSIZE - 1);
+}
+
+static struct inject_req *inject_find(const struct cache_key *key)
+{
+	struct inject_req *r;
+
+	for (r = inject_hash[inject_hashval(key)]; r != NULL; r = r->hnext) {
+		if (memcmp(&r->key, key, sizeof(struct cache_key)) == 0)
+			return r;
 	}
-	/* we are directly injecting the entries into the kernel */
-	origin_register(inject, CTD_ORIGIN_INJECT);
-	return 0;
+	return NULL;
 }
 
-static void external_inject_close(void)
+static void inject_link(struct inject_req *r)
 {
-	origin_unregister(inject);
-	nfct_close(inject);
+	uint32_t h = inject_hashval(&r->key);
+
+	r->hnext = inject_hash[h];
+	r->hashed = 1;
+	inject_hash[h] = r;
 }
 
-static void external_inject_ct_new(struct nf_conntrack *ct)
+static void inject_unhash(struct inject_req *r)
 {
-	int ret, retry = 1;
+	struct inject_req **p = &inject_hash[inject_hashval(&r->key)];
 
-retry:
-	if (nl_create_conntrack(inject, ct, 0) == -1) {
-		/* if the state entry exists, we delete and try again */
-		if (errno == EEXIST && retry == 1) {
-			ret = nl_destroy_conntrack(inject, ct);
-			if (ret == 0 || (ret == -1 && errno == ENOENT)) {
-				if (retry) {
-					retry = 0;
-					goto retry;
-				}
-			}
-			external_inject_stat.add_fail++;
-			dlog(LOG_ERR, "inject-add1: %s", strerror(errno));
-			dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
-			return;
+	if (!r->hashed)
+		return;
+
+	for (; *p != NULL; p = &(*p)->hnext) {
+		if (*p == r) {
+			*p = r->hnext;
+			break;
 		}
-		external_inject_stat.add_fail++;
-		dlog(LOG_ERR, "inject-add2: %s", strerror(errno));
-		dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
-	} else {
-		external_inject_stat.add_ok++;
 	}
+	r->hashed = 0;
 }
 
-static void external_inject_ct_upd(struct nf_conntrack *ct)
+static void inject_release(struct inject_req *r)
 {
-	int ret;
+	inject_unhash(r);
+	list_del(&r->head);
+	list_add(&r->head, &inject_free);
+}
 
-	/* if we successfully update the entry, everything is OK */
-	if (nl_update_conntrack(inject, ct, 0) != -1) {
-		external_inject_stat.upd_ok++;
-		return;
+static void inject_fail(struct inject_req *r, int error)
+{
+	const char *tag;
+
+	switch(r->type) {
+	case INJECT_T_NEW:
+		external_inject_stat.add_fail++;
+		tag = r->fallback == INJECT_F_ADD1 ? "add1" : "add2";
+		break;
+	case INJECT_T_UPD:
+		external_inject_stat.upd_fail++;
+		if (r->stage == INJECT_S_DESTROY)
+			tag = "upd3";
+		else
+			tag = r->fallback == INJECT_F_UPD1 ? "upd1" : "upd2";
+		break;
+	default:
+		external_inject_stat.del_fail++;
+		tag = "del";
+		break;
 	}
+	dlog(LOG_ERR, "inject-%s: %s", tag, strerror(error));
+	dlog_ct(STATE(log), r->ct, NFCT_O_PLAIN);
+}
 
-	/* state entries does not exist, we have to create it */
-	if (errno == ENOENT) {
-		if (nl_create_conntrack(inject, ct, 0) == -1) {
-			external_inject_stat.upd_fail++;
-			dlog(LOG_ERR, "inject-upd1: %s", strerror(errno));
-			dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
-		} else {
+static void inject_done(struct inject_req *r, int error)
+{
+	if (error != 0) {
+		inject_fail(r, error);
+	} else {
+		switch(r->type) {
+		case INJECT_T_NEW:
+			external_inject_stat.add_ok++;
+			break;
+		case INJECT_T_UPD:
 			external_inject_stat.upd_ok++;
+			break;
+		case INJECT_T_DEL:
+			external_inject_stat.del_ok++;
+			break;
 		}
+	}
+	list_add(&r->head, &inject_free);
+}
+
+static void inject_again(struct inject_req *r, int stage, int fallback)
+{
+	/* sending it after the newer request would undo that one. */
+	if (inject_find(&r->key) != NULL) {
+		external_inject_stat.collapsed++;
+		list_add(&r->head, &inject_free);
 		return;
 	}
+	r->stage = stage;
+	r->fallback = fallback;
+	/* requests for this tuple that arrive now collapse into it. */
+	inject_link(r);
+	list_add_tail(&r->head, &inject_retry);
+}
 
-	/* we failed to update the entry, there are some operations that
-	 * may trigger this error, eg. unset some status bits. Try harder,
-	 * delete the existing entry and create a new one. */
-	ret = nl_destroy_conntrack(inject, ct);
-	if (ret == 0 || (ret == -1 && errno == ENOENT)) {
-		if (nl_create_conntrack(inject, ct, 0) == -1) {
-			external_inject_stat.upd_fail++;
-			dlog(LOG_ERR, "inject-upd2: %s", strerror(errno));
-			dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
-		} else {
-			external_inject_stat.upd_ok++;
+/* acknowledgment of the kernel, the request is not in any list. */
+static void inject_cb(void *data, int error, void *arg)
+{
+	struct inject_req *r = data;
+
+	switch(r->stage) {
+	case INJECT_S_CREATE:
+		/* if the state entry exists, we delete and try again */
+		if (error == EEXIST && r->type == INJECT_T_NEW &&
+		    r->fallback == INJECT_F_NONE) {
+			inject_again(r, INJECT_S_DESTROY, INJECT_F_ADD1);
+			return;
 		}
+		break;
+	case INJECT_S_UPDATE:
+		if (error == 0)
+			break;
+		/* state entries does not exist, we have to create it */
+		if (error == ENOENT) {
+			inject_again(r, INJECT_S_CREATE, INJECT_F_UPD1);
+			return;
+		}
+		/* we failed to update the entry, there are some operations
+		 * that may trigger this error, eg. unset some status bits.
+		 * Try harder, delete the existing entry and create a new
+		 * one. */
+		inject_again(r, INJECT_S_DESTROY, INJECT_F_UPD2);
 		return;
+	case INJECT_S_DESTROY:
+		if (error != 0 && error != ENOENT)
+			break;
+		if (r->type != INJECT_T_DEL) {
+			inject_again(r, INJECT_S_CREATE, r->fallback);
+			return;
+		}
+		/* it is already gone, nothing to account. */
+		if (error == ENOENT) {
+			list_add(&r->head, &inject_free);
+			return;
+		}
+		break;
 	}
-	external_inject_stat.upd_fail++;
-	dlog(LOG_ERR, "inject-upd3: %s", strerror(errno));
-	dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
+	inject_done(r, error);
 }
 
-static void external_inject_ct_del(struct nf_conntrack *ct)
+static void inject_send(void)
 {
-	if (nl_destroy_conntrack(inject, ct) == -1) {
-		if (errno != ENOENT) {
-			external_inject_stat.del_fail++;
-			dlog(LOG_ERR, "inject-del: %s", strerror(errno));
-			dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
+	struct inject_req *r, *tmp;
+	int ret;
+
+	if (nl_batch_pending(inject_batch))
+		return;
+
+	list_for_each_entry_safe(r, tmp, &inject_unsent, head) {
+		switch(r->stage) {
+		case INJECT_S_CREATE:
+			ret = nl_batch_create_conntrack(inject_batch,
+							r->ct, 0, r);
+			break;
+		case INJECT_S_UPDATE:
+			ret = nl_batch_update_conntrack(inject_batch,
+							r->ct, 0, r);
+			break;
+		default:
+			ret = nl_batch_destroy_conntrack(inject_batch,
+							 r->ct, r);
+			break;
 		}
+		if (ret == -1) {
+			if (errno == ENOSPC)
+				break;
+			inject_fail(r, errno);
+			inject_release(r);
+			continue;
+		}
+		/* in flight, later requests for this tuple go separately. */
+		inject_unhash(r);
+		list_del(&r->head);
+	}
+	if (nl_batch_len(inject_batch) == 0)
+		return;
+
+	external_inject_stat.batches++;
+	if (nl_batch_send(inject_batch, inject_cb, NULL) == -1) {
+		dlog(LOG_ERR, "inject batch: %s", strerror(errno));
+		list_splice_init(&inject_retry, &inject_unsent);
+	}
+}
+
+static int inject_recv(int flags)
+{
+	int ret;
+
+	ret = nl_batch_recv(inject_batch, inject_cb, NULL, flags);
+	list_splice_init(&inject_retry, &inject_unsent);
+
+	return ret;
+}
+
+/* send what we have and reconcile everything before we return. */
+static void inject_sync(void)
+{
+	do {
+		if (nl_batch_pending(inject_batch))
+			inject_recv(0);
+		inject_send();
+	} while (nl_batch_pending(inject_batch));
+}
+
+/* send the next batch, unless the previous one is still in flight. */
+static void external_inject_batch_end(void)
+{
+	if (nl_batch_pending(inject_batch) &&
+	    inject_recv(MSG_DONTWAIT) == -1 && errno == EAGAIN)
+		return;
+
+	inject_send();
+}
+
+static void inject_handler(void *data)
+{
+	/* late acknowledgments of a batch that we gave up on. */
+	if (!nl_batch_pending(inject_batch)) {
+		char buf[4096];
+
+		while (recv(nfct_fd(inject), buf, sizeof(buf),
+			    MSG_DONTWAIT) > 0);
+		return;
+	}
+	if (inject_recv(MSG_DONTWAIT) == -1 && errno == EAGAIN)
+		return;
+
+	/* the follow-ups of this batch go out right away. */
+	inject_send();
+}
+
+static void inject_enqueue(struct nf_conntrack *ct, int type)
+{
+	struct cache_key key;
+	struct inject_req *r;
+
+	cache_ct_key(&key, ct);
+
+	r = inject_find(&key);
+	if (r != NULL) {
+		/* the last one wins, but an update after a new or a
+		 * delete has to create the entry. */
+		if (type == INJECT_T_DEL)
+			r->type = INJECT_T_DEL;
+		else if (type == INJECT_T_NEW || r->type != INJECT_T_UPD)
+			r->type = INJECT_T_NEW;
+		external_inject_stat.collapsed++;
 	} else {
-		external_inject_stat.del_ok++;
+		if (list_empty(&inject_free))
+			inject_sync();
+		if (list_empty(&inject_free)) {
+			struct inject_req tmp = { .ct = ct, .type = type };
+
+			inject_fail(&tmp, ENOBUFS);
+			return;
+		}
+
+		r = list_entry(inject_free.next, struct inject_req, head);
+		list_del(&r->head);
+		list_add_tail(&r->head, &inject_unsent);
+
+		r->key = key;
+		r->type = type;
+		inject_link(r);
+	}
+	nfct_copy(r->ct, ct, NFCT_CP_OVERRIDE);
+	r->fallback = INJECT_F_NONE;
+
+	switch(r->type) {
+	case INJECT_T_NEW:
+		r->stage = INJECT_S_CREATE;
+		break;
+	case INJECT_T_UPD:
+		r->stage = INJECT_S_UPDATE;
+		break;
+	case INJECT_T_DEL:
+		r->stage = INJECT_S_DESTROY;
+		break;
+	}
+}
+
+static int external_inject_init(void)
+{
+	int i;
+
+	/* handler to directly inject conntracks into kernel-space */
+	inject = nfct_open(CONFIG(netlink).subsys_id, 0);
+	if (inject == NULL) {
+		dlog(LOG_ERR, "can't open netlink handler: %s",
+		     strerror(errno));
+		dlog(LOG_ERR, "no ctnetlink kernel support?");
+		return -1;
 	}
+	/* we are directly injecting the entries into the kernel */
+	origin_register(inject, CTD_ORIGIN_INJECT);
+
+	inject_batch = nl_batch_create(inject);
+	if (inject_batch == NULL) {
+		dlog(LOG_ERR, "can't create inject batch");
+		return -1;
+	}
+	for (i = 0; i < INJECT_MAX; i++) {
+		inject_pool[i].ct = nfct_new();
+		if (inject_pool[i].ct == NULL) {
+			dlog(LOG_ERR, "can't allocate inject requests");
+			return -1;
+		}
+		list_add_tail(&inject_pool[i].head, &inject_free);
+	}
+
+	if (register_fd(nfct_fd(inject), inject_handler,
+			NULL, STATE(fds)) == -1)
+		return -1;
+	fds_set_name(nfct_fd(inject), "inject", STATE(fds));
+
+	return 0;
+}
+
+static void external_inject_close(void)
+{
+	int i;
+
+	inject_sync();
+	unregister_fd(nfct_fd(inject), STATE(fds));
+
+	for (i = 0; i < INJECT_MAX; i++)
+		nfct_destroy(inject_pool[i].ct);
+	nl_batch_destroy(inject_batch);
+
+	origin_unregister(inject);
+	nfct_close(inject);
+}
+
+static void external_inject_ct_new(struct nf_conntrack *ct)
+{
+	inject_enqueue(ct, INJECT_T_NEW);
+}
+
+static void external_inject_ct_upd(struct nf_conntrack *ct)
+{
+	inject_enqueue(ct, INJECT_T_UPD);
+}
+
+static void external_inject_ct_del(struct nf_conntrack *ct)
+{
+	inject_enqueue(ct, INJECT_T_DEL);
 }
 
 static void external_inject_ct_dump(int fd, int type)
@@ -164,13 +483,16 @@ static void external_inject_ct_stats(int fd)
 	size = sprintf(buf, "external inject:\n"
 			    "connections created:\t\t%12u\tfailed:\t%12u\n"
 			    "connections updated:\t\t%12u\tfailed:\t%12u\n"
-			    "connections destroyed:\t\t%12u\tfailed:\t%12u\n\n",
+			    "connections destroyed:\t\t%12u\tfailed:\t%12u\n"
+			    "requests collapsed:\t\t%12u\tbatches:%12u\n\n",
 			    external_inject_stat.add_ok,
 			    external_inject_stat.add_fail,
 			    external_inject_stat.upd_ok,
 			    external_inject_stat.upd_fail,
 			    external_inject_stat.del_ok,
-			    external_inject_stat.del_fail);
+			    external_inject_stat.del_fail,
+			    external_inject_stat.collapsed,
+			    external_inject_stat.batches);
 
 	send(fd, buf, size, 0);
 }
@@ -188,6 +510,8 @@ static void external_inject_exp_new(struct nf_expect *exp)
 {
 	int ret, retry = 1;
 
+	/* the conntracks go first, we share the socket with them. */
+	inject_sync();
 retry:
 	if (nl_create_expect(inject, exp, 0) == -1) {
 		/* if the state entry exists, we delete and try again */
@@ -214,6 +538,8 @@ retry:
 
 static void external_inject_exp_del(struct nf_expect *exp)
 {
+	inject_sync();
+
 	if (nl_destroy_expect(inject, exp) == -1) {
 		if (errno != ENOENT) {
 			exp_external_inject_stat.del_fail++;
@@ -261,6 +587,7 @@ static void external_inject_exp_stats(int fd)
 struct external_handler external_inject = {
 	.init		= external_inject_init,
 	.close		= external_inject_close,
+	.batch_end	= external_inject_batch_end,
 	.ct = {
 		.new		= external_inject_ct_new,
 		.upd		= external_inject_ct_upd,
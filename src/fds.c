@@ -21,6 +21,10 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
 #include "conntrackd.h"
 #include "date.h"
@@ -34,81 +38,484 @@ struct fds *create_fds(void)
 	if (fds == NULL)
 		return NULL;
 
+	fds->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (fds->epfd == -1) {
+		free(fds);
+		return NULL;
+	}
 	INIT_LIST_HEAD(&fds->list);
+	INIT_LIST_HEAD(&fds->gc);
+	INIT_LIST_HEAD(&fds->ready[FDS_PRIO_NORMAL]);
+	INIT_LIST_HEAD(&fds->ready[FDS_PRIO_HIGH]);
 
 	return fds;
 }
 
+/* Switch to the io_uring engine, this has to be called before any
+ * descriptor is registered. */
+int fds_use_uring(struct fds *fds)
+{
+	if (fds->num > 0)
+		return -1;
+
+	if (uring_init(FDS_URING_ENTRIES) == -1)
+		return -1;
+
+	close(fds->epfd);
+	fds->epfd = -1;
+	fds->uring = 1;
+
+	return 0;
+}
+
+static void fds_gc(struct fds *fds)
+{
+	struct fds_item *this, *tmp;
+
+	list_for_each_entry_safe(this, tmp, &fds->gc, head) {
+		/* the kernel still refers to it, wait for the completion. */
+		if (this->armed)
+			continue;
+
+		list_del(&this->head);
+		free(this);
+	}
+}
+
 void destroy_fds(struct fds *fds)
 {
 	struct fds_item *this, *tmp;
 
 	list_for_each_entry_safe(this, tmp, &fds->list, head) {
 		list_del(&this->head);
-		FD_CLR(this->fd, &fds->readfds);
 		free(this);
 	}
+	list_for_each_entry_safe(this, tmp, &fds->gc, head) {
+		list_del(&this->head);
+		free(this);
+	}
+	if (fds->uring)
+		uring_fini();
+	else
+		close(fds->epfd);
 	free(fds);
 }
 
-int register_fd(int fd, void (*cb)(void *data), void *data, struct fds *fds)
+static void fds_uring_complete(struct uring_req *req, int res)
 {
-	struct fds_item *item;
-	
-	FD_SET(fd, &fds->readfds);
+	struct fds_item *item = container_of(req, struct fds_item, req);
+
+	item->armed = 0;
+	if (item->removed)
+		return;
+
+	if (res > 0) {
+		if (!item->is_ready) {
+			item->is_ready = 1;
+			list_add_tail(&item->ready,
+				      &STATE(fds)->ready[item->prio]);
+		}
+	} else if (uring_poll_add(item->fd, item->events, &item->req) == 0) {
+		/* spurious wake-up, poll again. */
+		item->armed = 1;
+	}
+}
 
-	if (fd > fds->maxfd)
-		fds->maxfd = fd;
+/* events are EPOLLIN and/or EPOLLOUT, they have the same value as POLLIN
+ * and POLLOUT, so they are also valid for io_uring poll requests. */
+int register_fd_events(int fd, uint32_t events, void (*cb)(void *data),
+		       void *data, struct fds *fds)
+{
+	struct fds_item *item;
+	struct epoll_event ev = {
+		.events	= events,
+	};
 
 	item = calloc(sizeof(struct fds_item), 1);
 	if (item == NULL)
 		return -1;
 
 	item->fd = fd;
+	item->events = events;
 	item->cb = cb;
 	item->data = data;
-	/* Order matters: the descriptors are served in FIFO basis. */
+	item->budget = 1;
+
+	if (fds->uring) {
+		item->req.complete = fds_uring_complete;
+		if (uring_poll_add(fd, events, &item->req) == -1) {
+			free(item);
+			return -1;
+		}
+		item->armed = 1;
+	} else {
+		ev.data.ptr = item;
+		if (epoll_ctl(fds->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			free(item);
+			return -1;
+		}
+	}
+	/* all descriptors, in registration order, for lookups and stats. */
 	list_add_tail(&item->head, &fds->list);
+	fds->num++;
 
 	return 0;
 }
 
-int unregister_fd(int fd, struct fds *fds)
+int register_fd(int fd, void (*cb)(void *data), void *data, struct fds *fds)
 {
-	int found = 0, maxfd = -1;
-	struct fds_item *this, *tmp;
+	return register_fd_events(fd, EPOLLIN, cb, data, fds);
+}
 
-	list_for_each_entry_safe(this, tmp, &fds->list, head) {
-		if (this->fd == fd) {
-			list_del(&this->head);
-			FD_CLR(this->fd, &fds->readfds);
-			free(this);
-			found = 1;
-			/* ... and recalculate maxfd, see below. */
-		}
+static struct fds_item *fds_item_find(int fd, struct fds *fds)
+{
+	struct fds_item *this;
+
+	list_for_each_entry(this, &fds->list, head) {
+		if (this->fd == fd)
+			return this;
 	}
+	return NULL;
+}
+
+int unregister_fd(int fd, struct fds *fds)
+{
+	struct fds_item *item;
+
+	item = fds_item_find(fd, fds);
 	/* not found, report an error. */
-	if (!found)
+	if (item == NULL)
 		return -1;
 
-	/* calculate the new maximum fd. */
-	list_for_each_entry(this, &fds->list, head) {
-		if (maxfd < this->fd) {
-			maxfd = this->fd;
+	if (fds->uring) {
+		if (item->is_ready) {
+			list_del(&item->ready);
+			item->is_ready = 0;
 		}
-	}
-	fds->maxfd = maxfd;
+		if (item->armed)
+			uring_poll_remove(&item->req);
+	} else
+		epoll_ctl(fds->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+	/* We may be called from a callback while we are still walking
+	 * over the array of ready descriptors, this item may be in there.
+	 * Release it once the dispatching has finished. */
+	item->removed = 1;
+	if (item->prio == FDS_PRIO_HIGH)
+		fds->high--;
+	list_del(&item->head);
+	list_add(&item->head, &fds->gc);
+	fds->num--;
+
+	return 0;
+}
 
+/* Number of times that the callback is invoked per wake-up if the
+ * descriptor is ready, the callback must handle EAGAIN in that case. */
+int fds_set_budget(int fd, unsigned int budget, struct fds *fds)
+{
+	struct fds_item *item;
+
+	item = fds_item_find(fd, fds);
+	if (item == NULL || budget == 0)
+		return -1;
+
+	item->budget = budget;
 	return 0;
 }
 
+/* Stop invoking the callback once it has consumed this time, even if
+ * there is budget left. */
+int fds_set_time_budget(int fd, unsigned int usecs, struct fds *fds)
+{
+	struct fds_item *item;
+
+	item = fds_item_find(fd, fds);
+	if (item == NULL)
+		return -1;
+
+	item->time_budget = usecs;
+	return 0;
+}
+
+/* High priority descriptors are served first and they are also served
+ * between normal priority callbacks that take too long. Thus, their
+ * callbacks may be invoked without data, they must handle EAGAIN. */
+int fds_set_priority(int fd, int prio, struct fds *fds)
+{
+	struct fds_item *item;
+
+	item = fds_item_find(fd, fds);
+	if (item == NULL || prio < 0 || prio >= FDS_PRIO_MAX)
+		return -1;
+
+	if (item->prio == FDS_PRIO_HIGH)
+		fds->high--;
+	if (prio == FDS_PRIO_HIGH)
+		fds->high++;
+	item->prio = prio;
+	return 0;
+}
+
+/* Named descriptors are reported in the statistics, they also take the
+ * budget from the SourceBudget clauses in the configuration file. */
+int fds_set_name(int fd, const char *name, struct fds *fds)
+{
+	struct fds_item *item;
+	int i;
+
+	item = fds_item_find(fd, fds);
+	if (item == NULL)
+		return -1;
+
+	snprintf(item->name, sizeof(item->name), "%s", name);
+
+	for (i = 0; i < CONFIG(source_budget_num); i++) {
+		if (strcmp(CONFIG(source_budget)[i].name, name) != 0)
+			continue;
+
+		if (CONFIG(source_budget)[i].calls)
+			item->budget = CONFIG(source_budget)[i].calls;
+		item->time_budget = CONFIG(source_budget)[i].usecs;
+	}
+	return 0;
+}
+
+static struct fds_item *fds_current;
+
+/* Called from a callback to report that there is nothing left to do, so
+ * we don't waste the remaining budget in calls that hit EAGAIN. */
+void fds_drained(void)
+{
+	if (fds_current)
+		fds_current->drained = 1;
+}
+
+static uint64_t fds_now(void)
+{
+	return time_ns() / 1000;
+}
+
+static void fds_hist_add(uint32_t *hist, uint64_t usecs)
+{
+	unsigned int i = 0;
+
+	while (usecs && i < FDS_HIST_BUCKETS - 1) {
+		usecs >>= 1;
+		i++;
+	}
+	hist[i]++;
+}
+
+/*
+ * Invoke the callback until the work budget or the time budget has been
+ * consumed. The queueing delay is the time since we woke up until the
+ * callback is invoked, the service time is the time spent in it.
+ */
+static uint64_t
+fds_dispatch(struct fds *fds, struct fds_item *item, uint64_t wakeup)
+{
+	uint64_t start, now;
+	unsigned int k;
+
+	start = now = fds_now();
+	fds_hist_add(item->stats.delay, start - wakeup);
+
+	fds_current = item;
+	item->drained = 0;
+	for (k = 0; k < item->budget; k++) {
+		item->cb(item->data);
+		now = fds_now();
+
+		if (item->removed || item->drained)
+			break;
+
+		if (item->time_budget && now - start >= item->time_budget) {
+			if (k + 1 < item->budget)
+				item->stats.exhausted++;
+			break;
+		}
+	}
+	fds_current = NULL;
+
+	item->stats.dispatched++;
+	item->stats.usecs += now - start;
+	fds_hist_add(item->stats.service, now - start);
+
+	if (item->prio == FDS_PRIO_HIGH)
+		fds->last_high = now;
+
+	return now;
+}
+
+/* A normal priority callback has run for too long, give the high priority
+ * descriptors a chance before going on with the next one. */
+static void fds_preempt(struct fds *fds, uint64_t now, uint64_t wakeup)
+{
+	struct fds_item *item;
+
+	if (fds->high == 0 || now - fds->last_high < FDS_PREEMPT_USECS)
+		return;
+
+	list_for_each_entry(item, &fds->list, head) {
+		if (item->prio != FDS_PRIO_HIGH)
+			continue;
+
+		item->stats.preempted++;
+		fds_dispatch(fds, item, wakeup);
+		/* the list has changed under our feet, stop here. */
+		if (item->removed)
+			break;
+	}
+}
+
+static void fds_dispatch_normal(struct fds *fds, struct fds_item *item,
+				uint64_t wakeup)
+{
+	uint64_t now;
+
+	/* nothing high priority has been served since we woke up. */
+	if (fds->last_high < wakeup)
+		fds->last_high = wakeup;
+
+	now = fds_dispatch(fds, item, wakeup);
+	fds_preempt(fds, now, wakeup);
+}
+
+static int fds_hist_print(char *buf, size_t size, const uint32_t *hist)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < FDS_HIST_BUCKETS; i++) {
+		if (hist[i] == 0)
+			continue;
+
+		if (i == 0)
+			ret += snprintf(buf+ret, size-ret, " 0:%u", hist[i]);
+		else if (i == FDS_HIST_BUCKETS - 1)
+			ret += snprintf(buf+ret, size-ret, " %u+:%u",
+					1U << (i - 1), hist[i]);
+		else
+			ret += snprintf(buf+ret, size-ret, " %u-%u:%u",
+					1U << (i - 1), (1U << i) - 1, hist[i]);
+
+		if ((size_t)ret >= size)
+			return size;
+	}
+	return ret;
+}
+
+void fds_stats(int fd, struct fds *fds)
+{
+	struct fds_item *this;
+	char buf[2048];
+	int size;
+
+	size = snprintf(buf, sizeof(buf), "main loop sources:\n");
+	send(fd, buf, size, 0);
+
+	list_for_each_entry(this, &fds->list, head) {
+		size = snprintf(buf, sizeof(buf),
+			"\t%s (fd=%d, %s priority, budget %u calls/%u usecs):\n"
+			"\t\tdispatched:\t\t%20llu\n"
+			"\t\tservice time (in usecs):%20llu\n"
+			"\t\tbudget exhausted:\t\t%12u\n"
+			"\t\tpreempted:\t\t\t%12u\n"
+			"\t\tservice time histogram:",
+			this->name[0] ? this->name : "unnamed",
+			this->fd,
+			this->prio == FDS_PRIO_HIGH ? "high" : "normal",
+			this->budget, this->time_budget,
+			(unsigned long long)this->stats.dispatched,
+			(unsigned long long)this->stats.usecs,
+			this->stats.exhausted,
+			this->stats.preempted);
+		size += fds_hist_print(buf+size, sizeof(buf)-size,
+				       this->stats.service);
+		size += snprintf(buf+size, sizeof(buf)-size,
+				 "\n\t\tqueueing delay histogram:");
+		size += fds_hist_print(buf+size, sizeof(buf)-size,
+				       this->stats.delay);
+		size += snprintf(buf+size, sizeof(buf)-size, "\n");
+		send(fd, buf, size, 0);
+	}
+	send(fd, "\n", 1, 0);
+}
+
+static int timeval_to_msecs(const struct timeval *tv)
+{
+	if (tv == NULL)
+		return -1;
+
+	/* round up, otherwise we would spin until the alarm expires. */
+	return tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+}
+
+static void fds_uring_serve(struct fds *fds, int prio, uint64_t wakeup)
+{
+	struct fds_item *item;
+
+	while (!list_empty(&fds->ready[prio])) {
+		item = list_entry(fds->ready[prio].next, struct fds_item, ready);
+		list_del(&item->ready);
+		item->is_ready = 0;
+
+		if (prio == FDS_PRIO_HIGH)
+			fds_dispatch(fds, item, wakeup);
+		else
+			fds_dispatch_normal(fds, item, wakeup);
+
+		if (!item->removed && !item->armed &&
+		    uring_poll_add(item->fd, item->events, &item->req) == 0)
+			item->armed = 1;
+	}
+}
+
+/*
+ * The poll requests are one-shot and they are re-armed once the callback
+ * has been called, so we don't miss data that is left in the socket. The
+ * new poll requests and the sends that were enqueued by the callbacks are
+ * passed to the kernel together with the next wait.
+ */
+static void select_main_step_uring(struct timeval *next_alarm)
+{
+	struct fds *fds = STATE(fds);
+	uint64_t wakeup;
+
+	if (uring_wait(next_alarm) == -1) {
+		/* interrupted syscall, retry */
+		if (errno == EINTR)
+			return;
+
+		STATE(stats).select_failed++;
+		return;
+	}
+
+	/* signals are racy */
+	sigprocmask(SIG_BLOCK, &STATE(block), NULL);
+
+	wakeup = fds_now();
+	fds_uring_serve(fds, FDS_PRIO_HIGH, wakeup);
+	fds_uring_serve(fds, FDS_PRIO_NORMAL, wakeup);
+	fds_gc(fds);
+
+	sigprocmask(SIG_UNBLOCK, &STATE(block), NULL);
+}
+
 static void select_main_step(struct timeval *next_alarm)
 {
-	int ret;
-	fd_set readfds = STATE(fds)->readfds;
-	struct fds_item *cur, *tmp;
+	static struct epoll_event events[FDS_EVENTS_MAX];
+	struct fds *fds = STATE(fds);
+	uint64_t wakeup;
+	int i, ret, prio;
 
-	ret = select(STATE(fds)->maxfd + 1, &readfds, NULL, NULL, next_alarm);
+	if (fds->uring) {
+		select_main_step_uring(next_alarm);
+		return;
+	}
+
+	ret = epoll_wait(fds->epfd, events, FDS_EVENTS_MAX,
+			 timeval_to_msecs(next_alarm));
 	if (ret == -1) {
 		/* interrupted syscall, retry */
 		if (errno == EINTR)
@@ -121,10 +528,23 @@ static void select_main_step(struct timeval *next_alarm)
 	/* signals are racy */
 	sigprocmask(SIG_BLOCK, &STATE(block), NULL);
 
-	list_for_each_entry_safe(cur, tmp, &STATE(fds)->list, head) {
-		if (FD_ISSET(cur->fd, &readfds))
-			cur->cb(cur->data);
+	wakeup = fds_now();
+
+	/* the high priority descriptors go first. */
+	for (prio = FDS_PRIO_MAX - 1; prio >= 0; prio--) {
+		for (i = 0; i < ret; i++) {
+			struct fds_item *item = events[i].data.ptr;
+
+			if (item->prio != prio || item->removed)
+				continue;
+
+			if (prio == FDS_PRIO_HIGH)
+				fds_dispatch(fds, item, wakeup);
+			else
+				fds_dispatch_normal(fds, item, wakeup);
+		}
 	}
+	fds_gc(fds);
 
 	sigprocmask(SIG_UNBLOCK, &STATE(block), NULL);
 }
@@ -135,7 +555,7 @@ void __attribute__((noreturn)) select_main_loop(void)
 	struct timeval *next = NULL;
 
 	while(1) {
-		do_gettimeofday();
+		do_gettime();
 
 		sigprocmask(SIG_BLOCK, &STATE(block), NULL);
 		if (next != NULL && !timerisset(next))
@@ -49,12 +49,12 @@ static uint32_t ct_filter_hash(const void *data, const struct hashtable *table)
 {
 	const uint32_t *f = data;
 
-	return jhash_1word(*f, 0) % table->hashsize;
+	return jhash_1word(*f, 0);
 }
 
 static uint32_t ct_filter_hash6(const void *data, const struct hashtable *table)
 {
-	return jhash2(data, 4, 0) % table->hashsize;
+	return jhash2(data, 4, 0);
 }
 
 static int ct_filter_compare(const void *data1, const void *data2)
@@ -82,7 +82,7 @@ struct ct_filter *ct_filter_create(void)
 		return NULL;
 
 	filter->h = hashtable_create(FILTER_POOL_SIZE,
-				     FILTER_POOL_LIMIT,
+				     FILTER_POOL_LIMIT, 0,
 				     ct_filter_hash,
 				     ct_filter_compare);
 	if (!filter->h) {
@@ -91,7 +91,7 @@ struct ct_filter *ct_filter_create(void)
 	}
 
 	filter->h6 = hashtable_create(FILTER_POOL_SIZE,
-				      FILTER_POOL_LIMIT,
+				      FILTER_POOL_LIMIT, 0,
 				      ct_filter_hash6,
 				      ct_filter_compare6);
 	if (!filter->h6) {
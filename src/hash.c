@@ -25,27 +25,413 @@
 #include <string.h>
 #include <limits.h>
 
+/*
+ * The hash function returns a full 32-bit hash, that we store in the node.
+ * Instead of returning hash % table->hashsize (implying a divide) we use
+ * the high 32 bits of the (hash * size) that will give results between
+ * [0 and size-1] and same hash distribution, but using a multiply, less
+ * expensive than a divide. See:
+ * http://www.mail-archive.com/netdev@vger.kernel.org/msg56623.html
+ *
+ * This mapping keeps the order of the hashes whatever the size is, which
+ * is what allows us to resize the table while it is being iterated, see
+ * hashtable_iterate_limit().
+ */
+static inline uint32_t
+table_bucket(const struct hashtable_table *tb, uint32_t hash)
+{
+	return ((uint64_t)hash * tb->size) >> 32;
+}
+
+/* the lowest hash that is placed in this bucket */
+static inline uint64_t
+table_bucket_start(const struct hashtable_table *tb, uint32_t i)
+{
+	return (((uint64_t)i << 32) + tb->size - 1) / tb->size;
+}
+
+static inline int hash_in_range(uint32_t hash, uint64_t lo, uint64_t hi)
+{
+	return hash >= lo && hash < hi;
+}
+
+/*
+ * Open addressing: buckets are one cache line long, they contain a control
+ * word and up to seven node pointers. The control word stores one byte per
+ * slot, the high bit is set if the slot is in use and the lower bits are a
+ * fingerprint of the hash, so most of the misses never touch the node. The
+ * top byte counts the entries that did not fit in this bucket and that have
+ * been placed in the next ones, the lookup stops at the first bucket that
+ * did not overflow. Entries never move, so we don't need tombstones and
+ * deleting the current node while iterating is safe.
+ */
+#define CTRL_SLOT_MASK		0x0000000000000080ULL
+#define CTRL_LOW		0x0001010101010101ULL
+#define CTRL_HIGH		0x0080808080808080ULL
+#define CTRL_OVERFLOW_SHIFT	56
+#define CTRL_OVERFLOW_MAX	0xffULL
+
+static inline uint64_t oa_tag(uint32_t hash)
+{
+	return (hash & 0x7f) | 0x80;
+}
+
+/* Match the tag in all slots at once, this returns one bit set per slot
+ * that matches. This has no false positives, unlike the classic formula. */
+static inline uint64_t oa_match(uint64_t ctrl, uint64_t tag)
+{
+	uint64_t x = ctrl ^ (CTRL_LOW * tag);
+	uint64_t t = ((x & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | x;
+
+	return ~t & CTRL_HIGH;
+}
+
+static inline uint64_t oa_match_empty(uint64_t ctrl)
+{
+	return ~ctrl & CTRL_HIGH;
+}
+
+static inline uint64_t oa_match_used(uint64_t ctrl)
+{
+	return ctrl & CTRL_HIGH;
+}
+
+static inline int oa_slot(uint64_t match)
+{
+	return __builtin_ctzll(match) >> 3;
+}
+
+static inline uint64_t oa_overflow(uint64_t ctrl)
+{
+	return ctrl >> CTRL_OVERFLOW_SHIFT;
+}
+
+static inline uint32_t oa_next(const struct hashtable_table *tb, uint32_t i)
+{
+	return ++i == tb->size ? 0 : i;
+}
+
+static struct hashtable_node *
+oa_find(const struct hashtable *h, const struct hashtable_table *tb,
+	const void *data, uint32_t hash)
+{
+	uint64_t tag = oa_tag(hash);
+	uint32_t i = table_bucket(tb, hash), k;
+
+	for (k = 0; k < tb->size; k++) {
+		const struct hashtable_bucket *b = &tb->buckets[i];
+		uint64_t match = oa_match(b->ctrl, tag);
+
+		while (match) {
+			struct hashtable_node *n = b->node[oa_slot(match)];
+
+			if (n->hash == hash && h->compare(n, data))
+				return n;
+
+			match &= match - 1;
+		}
+		if (oa_overflow(b->ctrl) == 0)
+			break;
+
+		i = oa_next(tb, i);
+	}
+	return NULL;
+}
+
+static int
+oa_add(struct hashtable_table *tb, struct hashtable_node *n, uint32_t hash)
+{
+	uint32_t i = table_bucket(tb, hash), k;
+
+	for (k = 0; k < tb->size; k++) {
+		struct hashtable_bucket *b = &tb->buckets[i];
+		uint64_t empty = oa_match_empty(b->ctrl);
+
+		if (empty) {
+			int slot = oa_slot(empty);
+
+			b->node[slot] = n;
+			b->ctrl |= oa_tag(hash) << (slot * 8);
+			return 0;
+		}
+		if (oa_overflow(b->ctrl) < CTRL_OVERFLOW_MAX)
+			b->ctrl += 1ULL << CTRL_OVERFLOW_SHIFT;
+
+		i = oa_next(tb, i);
+	}
+	/* we never get here, we resize or hit the limit before. */
+	return -1;
+}
+
+/* returns -1 if the node is not in this table. */
+static int oa_del(struct hashtable_table *tb, struct hashtable_node *n)
+{
+	uint64_t tag = oa_tag(n->hash);
+	uint32_t i = table_bucket(tb, n->hash), k;
+	struct hashtable_bucket *b;
+	int slot = -1;
+
+	for (k = 0; k < tb->size; k++) {
+		uint64_t match;
+
+		b = &tb->buckets[i];
+		for (match = oa_match(b->ctrl, tag); match; match &= match - 1) {
+			if (b->node[oa_slot(match)] == n) {
+				slot = oa_slot(match);
+				break;
+			}
+		}
+		if (slot >= 0)
+			break;
+
+		if (oa_overflow(b->ctrl) == 0)
+			return -1;
+
+		i = oa_next(tb, i);
+	}
+	if (slot < 0)
+		return -1;
+
+	b->node[slot] = NULL;
+	b->ctrl &= ~(0xffULL << (slot * 8));
+
+	/* it went through these buckets, saturated counters stay as they
+	 * are since we cannot know how many entries they account for. */
+	for (i = table_bucket(tb, n->hash); k > 0; k--) {
+		b = &tb->buckets[i];
+		if (oa_overflow(b->ctrl) < CTRL_OVERFLOW_MAX)
+			b->ctrl -= 1ULL << CTRL_OVERFLOW_SHIFT;
+
+		i = oa_next(tb, i);
+	}
+	return 0;
+}
+
+static int oa_iterate_bucket(struct hashtable_table *tb, uint32_t i,
+			     uint64_t lo, uint64_t hi, void *data,
+			     int (*iterate)(void *data1, void *n))
+{
+	struct hashtable_bucket *b = &tb->buckets[i];
+	int slot;
+
+	for (slot = 0; slot < HASHTABLE_BUCKET_SLOTS; slot++) {
+		/* the callback may have released other nodes in here. */
+		if (!(b->ctrl & (CTRL_SLOT_MASK << (slot * 8))))
+			continue;
+
+		if (!hash_in_range(b->node[slot]->hash, lo, hi))
+			continue;
+
+		if (iterate(data, b->node[slot]) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Visit the nodes of this table whose hash is in [lo, hi). With open
+ * addressing, entries may have overflowed beyond the last bucket of the
+ * range, we keep going while buckets report that they overflowed.
+ */
+static int table_iterate_range(struct hashtable_table *tb,
+			       uint64_t lo, uint64_t hi, void *data,
+			       int (*iterate)(void *data1, void *n))
+{
+	uint32_t first = table_bucket(tb, lo);
+	uint32_t last = table_bucket(tb, hi - 1);
+	uint32_t i, k;
+
+	if (tb->members) {
+		for (i = first; i <= last; i++) {
+			struct list_head *e, *tmp;
+			struct hashtable_node *n;
+
+			list_for_each_safe(e, tmp, &tb->members[i]) {
+				n = list_entry(e, struct hashtable_node, head);
+				if (!hash_in_range(n->hash, lo, hi))
+					continue;
+				if (iterate(data, n) == -1)
+					return -1;
+			}
+		}
+		return 0;
+	}
+
+	for (i = first, k = 0; k < tb->size; k++) {
+		if (oa_iterate_bucket(tb, i, lo, hi, data, iterate) == -1)
+			return -1;
+
+		if (k >= last - first && oa_overflow(tb->buckets[i].ctrl) == 0)
+			break;
+
+		i = oa_next(tb, i);
+	}
+	return 0;
+}
+
+static int table_alloc(struct hashtable_table *tb, uint32_t size, int open)
+{
+	uint32_t i;
+
+	memset(tb, 0, sizeof(*tb));
+
+	if (open) {
+		size_t len = (size_t)size * sizeof(struct hashtable_bucket);
+
+		if (posix_memalign((void **)&tb->buckets,
+				   sizeof(struct hashtable_bucket), len))
+			return -1;
+
+		memset(tb->buckets, 0, len);
+	} else {
+		tb->members = malloc((size_t)size * sizeof(struct list_head));
+		if (tb->members == NULL)
+			return -1;
+
+		for (i = 0; i < size; i++)
+			INIT_LIST_HEAD(&tb->members[i]);
+	}
+	tb->size = size;
+	return 0;
+}
+
+static void table_free(struct hashtable_table *tb)
+{
+	free(tb->members);
+	free(tb->buckets);
+	memset(tb, 0, sizeof(*tb));
+}
+
+/* number of entries that fit in the table before it gets too loaded */
+static uint64_t table_capacity(const struct hashtable *h, uint32_t size)
+{
+	if (h->flags & HASHTABLE_F_OPEN)
+		return (uint64_t)size * HASHTABLE_BUCKET_SLOTS * 3 / 4;
+
+	return size;
+}
+
+/*
+ * Move some buckets from the old table to the new one. This is done a few
+ * buckets at a time from the operations that modify the table, so the cost
+ * of the resize is spread over them, we never stop to rehash everything.
+ */
+static void hashtable_rehash_step(struct hashtable *h, uint32_t steps)
+{
+	struct hashtable_table *old = &h->old;
+	uint32_t k;
+
+	/* the iterator walks over the buckets, we cannot move them now. */
+	if (old->size == 0 || h->iterating)
+		return;
+
+	for (k = 0; k < steps && h->rehash < old->size; k++, h->rehash++) {
+		if (old->members) {
+			struct list_head *e, *tmp;
+			struct hashtable_node *n;
+
+			list_for_each_safe(e, tmp, &old->members[h->rehash]) {
+				n = list_entry(e, struct hashtable_node, head);
+				list_del(&n->head);
+				list_add(&n->head,
+					 &h->cur.members[table_bucket(&h->cur,
+								      n->hash)]);
+			}
+		} else {
+			struct hashtable_bucket *b = &old->buckets[h->rehash];
+			uint64_t used;
+
+			while ((used = oa_match_used(b->ctrl)) != 0) {
+				struct hashtable_node *n;
+
+				n = b->node[oa_slot(used)];
+				oa_del(old, n);
+				oa_add(&h->cur, n, n->hash);
+			}
+		}
+	}
+	if (h->rehash == old->size)
+		table_free(old);
+}
+
+static void hashtable_resize(struct hashtable *h, uint32_t size)
+{
+	struct hashtable_table tb;
+
+	if (table_alloc(&tb, size, h->flags & HASHTABLE_F_OPEN) == -1) {
+		h->stats.resize_failed++;
+		return;
+	}
+	if (size > h->cur.size)
+		h->stats.grow++;
+	else
+		h->stats.shrink++;
+
+	h->old = h->cur;
+	h->cur = tb;
+	h->hashsize = size;
+	h->rehash = 0;
+
+	hashtable_rehash_step(h, HASHTABLE_REHASH_STEPS);
+}
+
+/* double the size if it is too loaded, halve it if it is mostly empty. */
+static void hashtable_check_size(struct hashtable *h)
+{
+	uint32_t size = h->cur.size;
+
+	if (!(h->flags & HASHTABLE_F_RESIZE) || h->old.size || h->iterating)
+		return;
+
+	if (h->count > table_capacity(h, size) && size <= UINT32_MAX / 2)
+		hashtable_resize(h, size * 2);
+	else if (h->count < table_capacity(h, size) / 8 &&
+		 size / 2 >= h->min_size)
+		hashtable_resize(h, size / 2);
+}
+
 struct hashtable *
-hashtable_create(int hashsize, int limit,
+hashtable_create(int hashsize, int limit, unsigned int flags,
 		 uint32_t (*hash)(const void *data,
 		 		  const struct hashtable *table),
 		 int (*compare)(const void *data1, const void *data2))
 {
-	int i;
 	struct hashtable *h;
-	int size = sizeof(struct hashtable)
-		   + hashsize * sizeof(struct list_head);
+	uint64_t size = hashsize;
 
-	h = (struct hashtable *) calloc(size, 1);
+	h = (struct hashtable *) calloc(sizeof(struct hashtable), 1);
 	if (h == NULL) {
 		errno = ENOMEM;
 		return NULL;
 	}
 
-	for (i=0; i<hashsize; i++)
-		INIT_LIST_HEAD(&h->members[i]);
+	h->flags = flags;
+	if (flags & HASHTABLE_F_OPEN) {
+		/* enough buckets to hold HashSize entries, if we can resize,
+		 * otherwise enough buckets to hold the limit. */
+		if (!(flags & HASHTABLE_F_RESIZE))
+			size = (uint64_t)limit + limit / 3 + 1;
+
+		size = (size + HASHTABLE_BUCKET_SLOTS - 1) /
+		       HASHTABLE_BUCKET_SLOTS;
+	}
+	if (size == 0)
+		size = 1;
+	if (size > UINT32_MAX) {
+		free(h);
+		errno = ENOMEM;
+		return NULL;
+	}
+	/* we never shrink below the initial size. */
+	h->min_size = size;
+
+	if (table_alloc(&h->cur, size, flags & HASHTABLE_F_OPEN) == -1) {
+		free(h);
+		errno = ENOMEM;
+		return NULL;
+	}
 
-	h->hashsize = hashsize;
+	h->hashsize = size;
 	h->limit = limit;
 	h->hash = hash;
 	h->compare = compare;
@@ -55,89 +441,207 @@ hashtable_create(int hashsize, int limit,
 
 void hashtable_destroy(struct hashtable *h)
 {
+	table_free(&h->cur);
+	table_free(&h->old);
 	free(h);
 }
 
-int hashtable_hash(const struct hashtable *table, const void *data)
+uint32_t hashtable_hash(const struct hashtable *table, const void *data)
 {
 	return table->hash(data, table);
 }
 
 struct hashtable_node *
-hashtable_find(const struct hashtable *table, const void *data, int id)
+hashtable_find(struct hashtable *table, const void *data, uint32_t hash)
 {
+	struct hashtable_table *tb;
 	struct list_head *e;
 	struct hashtable_node *n;
+	int i;
+
+	hashtable_rehash_step(table, HASHTABLE_REHASH_STEPS);
 
-	list_for_each(e, &table->members[id]) {
-		n = list_entry(e, struct hashtable_node, head);
-		if (table->compare(n, data)) {
-			return n;
+	/* while resizing, entries may still be in the old table. */
+	for (i = 0, tb = &table->cur; i < 2 && tb->size; i++, tb = &table->old) {
+		if (tb->buckets) {
+			n = oa_find(table, tb, data, hash);
+			if (n)
+				return n;
+			continue;
+		}
+		list_for_each(e, &tb->members[table_bucket(tb, hash)]) {
+			n = list_entry(e, struct hashtable_node, head);
+			if (n->hash == hash && table->compare(n, data)) {
+				return n;
+			}
 		}
 	}
 	errno = ENOENT;
 	return NULL;
 }
 
-int hashtable_add(struct hashtable *table, struct hashtable_node *n, int id)
+/* bring the bucket of this hash into the cache ahead of hashtable_find() */
+void hashtable_prefetch(const struct hashtable *table, uint32_t hash)
+{
+	const struct hashtable_table *tb = &table->cur;
+
+	if (tb->size == 0)
+		return;
+
+	if (tb->buckets)
+		__builtin_prefetch(&tb->buckets[table_bucket(tb, hash)]);
+	else
+		__builtin_prefetch(&tb->members[table_bucket(tb, hash)]);
+}
+
+int hashtable_add(struct hashtable *table, struct hashtable_node *n,
+		  uint32_t hash)
 {
+	struct hashtable_table *tb = &table->cur;
+
 	/* hash table is full */
 	if (table->count >= table->limit) {
 		errno = ENOSPC;
 		return -1;
 	}
-	list_add(&n->head, &table->members[id]);
+	n->hash = hash;
+	if (tb->buckets) {
+		/* no free slots left, we could not grow it. */
+		if (table->count >=
+		    (uint64_t)tb->size * HASHTABLE_BUCKET_SLOTS ||
+		    oa_add(tb, n, hash) == -1) {
+			errno = ENOSPC;
+			return -1;
+		}
+	} else
+		list_add(&n->head, &tb->members[table_bucket(tb, hash)]);
+
 	table->count++;
+
+	hashtable_check_size(table);
+	hashtable_rehash_step(table, HASHTABLE_REHASH_STEPS);
 	return 0;
 }
 
 void hashtable_del(struct hashtable *table, struct hashtable_node *n)
 {
-	list_del(&n->head);
+	if (table->cur.buckets) {
+		if (oa_del(&table->cur, n) == -1)
+			oa_del(&table->old, n);
+	} else
+		list_del(&n->head);
+
 	table->count--;
+
+	hashtable_check_size(table);
+	hashtable_rehash_step(table, HASHTABLE_REHASH_STEPS);
+}
+
+static int flush_cb(void *data, void *n)
+{
+	free(n);
+	return 0;
 }
 
 int hashtable_flush(struct hashtable *table)
 {
-	uint32_t i;
-	struct list_head *e, *tmp;
-	struct hashtable_node *n;
+	uint32_t from = 0;
+	int ret;
 
-	for (i=0; i < table->hashsize; i++) {
-		list_for_each_safe(e, tmp, &table->members[i]) {
-			n = list_entry(e, struct hashtable_node, head);
-			free(n);
-		}
-	}
-	return 0;
+	ret = hashtable_iterate_limit(table, NULL, &from, UINT_MAX, flush_cb);
+	table_free(&table->old);
+	table_free(&table->cur);
+	table->count = 0;
+	if (table_alloc(&table->cur, table->hashsize,
+			table->flags & HASHTABLE_F_OPEN) == -1)
+		return -1;
+
+	return ret;
 }
 
+/*
+ * Iterate over the nodes in the next steps buckets. The cursor is the lowest
+ * hash that has not been visited yet rather than a bucket number, so that it
+ * remains valid if the table is resized between two calls: the buckets are
+ * sorted by hash whatever the size is. Returns 1 if there are more nodes to
+ * visit, 0 if we are done and -1 if the iterator failed.
+ */
 int
 hashtable_iterate_limit(struct hashtable *table, void *data,
-			uint32_t from, uint32_t steps,
+			uint32_t *cursor, uint32_t steps,
 		        int (*iterate)(void *data1, void *n))
 {
-	uint32_t i;
-	struct list_head *e, *tmp;
-	struct hashtable_node *n;
+	struct hashtable_table *tb = &table->cur;
+	uint64_t lo = *cursor, hi;
+	uint32_t first = table_bucket(tb, lo);
+	int ret;
 
-	for (i=from; i < table->hashsize && i < from+steps; i++) {
-		list_for_each_safe(e, tmp, &table->members[i]) {
-			n = list_entry(e, struct hashtable_node, head);
-			if (iterate(data, n) == -1)
-				return -1;
-		}
+	if ((uint64_t)first + steps >= tb->size)
+		hi = 1ULL << 32;
+	else
+		hi = table_bucket_start(tb, first + steps);
+
+	table->iterating++;
+	ret = table_iterate_range(&table->cur, lo, hi, data, iterate);
+	if (ret == 0 && table->old.size)
+		ret = table_iterate_range(&table->old, lo, hi, data, iterate);
+	table->iterating--;
+
+	if (ret == -1)
+		return -1;
+
+	if (hi > UINT32_MAX) {
+		*cursor = 0;
+		return 0;
 	}
-	return i;
+	*cursor = hi;
+	return 1;
 }
 
 int hashtable_iterate(struct hashtable *table, void *data,
 		      int (*iterate)(void *data1, void *n))
 {
-	return hashtable_iterate_limit(table, data, 0, UINT_MAX, iterate);
+	uint32_t from = 0;
+
+	return hashtable_iterate_limit(table, data, &from, UINT_MAX, iterate);
 }
 
 unsigned int hashtable_counter(const struct hashtable *table)
 {
 	return table->count;
 }
+
+void hashtable_get_stats(const struct hashtable *h, struct hashtable_stats *s)
+{
+	const struct hashtable_table *tb = &h->cur;
+	uint32_t i, len;
+
+	memset(s, 0, sizeof(*s));
+	s->buckets = tb->size;
+	s->capacity = tb->members ? tb->size :
+				    tb->size * HASHTABLE_BUCKET_SLOTS;
+	s->rehash_pending = h->old.size ? h->old.size - h->rehash : 0;
+	s->grow = h->stats.grow;
+	s->shrink = h->stats.shrink;
+	s->resize_failed = h->stats.resize_failed;
+
+	for (i = 0; i < tb->size; i++) {
+		if (tb->members) {
+			struct list_head *e;
+
+			len = 0;
+			list_for_each(e, &tb->members[i])
+				len++;
+		} else {
+			len = __builtin_popcountll(
+					oa_match_used(tb->buckets[i].ctrl));
+			if (oa_overflow(tb->buckets[i].ctrl))
+				s->overflow++;
+		}
+		if (len > s->max_chain)
+			s->max_chain = len;
+
+		s->chain[len < HASHTABLE_STATS_CHAIN ?
+			 len : HASHTABLE_STATS_CHAIN - 1]++;
+	}
+}
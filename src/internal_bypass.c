@@ -67,7 +67,7 @@ static void internal_bypass_ct_dump(int fd, int type)
 
 static void internal_bypass_ct_flush(void)
 {
-	nl_flush_conntrack_table_selective();
+	nl_flush_conntrack_table_selective(STATE(flush));
 }
 
 struct {
@@ -110,7 +110,9 @@ internal_bypass_ct_resync(enum nf_conntrack_msg_type type,
 	return NFCT_CB_CONTINUE;
 }
 
-static void internal_bypass_ct_event_new(struct nf_conntrack *ct, int origin)
+static void
+internal_bypass_ct_event_new(struct nf_conntrack *ct,
+			     const struct cache_key *key, int origin)
 {
 	struct nethdr *net;
 
@@ -123,7 +125,9 @@ static void internal_bypass_ct_event_new(struct nf_conntrack *ct, int origin)
 	internal_bypass_stats.new++;
 }
 
-static void internal_bypass_ct_event_upd(struct nf_conntrack *ct, int origin)
+static void
+internal_bypass_ct_event_upd(struct nf_conntrack *ct,
+			     const struct cache_key *key, int origin)
 {
 	struct nethdr *net;
 
@@ -136,7 +140,9 @@ static void internal_bypass_ct_event_upd(struct nf_conntrack *ct, int origin)
 	internal_bypass_stats.upd++;
 }
 
-static int internal_bypass_ct_event_del(struct nf_conntrack *ct, int origin)
+static int
+internal_bypass_ct_event_del(struct nf_conntrack *ct,
+			     const struct cache_key *key, int origin)
 {
 	struct nethdr *net;
 
@@ -14,6 +14,10 @@
 #include "netlink.h"
 #include "network.h"
 #include "origin.h"
+#include "queue.h"
+
+#include <string.h>
+#include <errno.h>
 
 static inline void sync_send(struct cache_object *obj, int query)
 {
@@ -22,16 +26,29 @@ static inline void sync_send(struct cache_object *obj, int query)
 
 static int internal_cache_init(void)
 {
+	unsigned int flags = STATE_SYNC(sync)->internal_cache_flags;
+
+	if (CONFIG(sync).internal_file[0])
+		flags |= PERSIST;
+
 	STATE(mode)->internal->ct.data =
-		cache_create("internal", CACHE_T_CT,
-			     STATE_SYNC(sync)->internal_cache_flags,
+		cache_create("internal", CACHE_T_CT, flags,
 			     STATE_SYNC(sync)->internal_cache_extra,
-			     &cache_sync_internal_ct_ops);
+			     CONFIG(sync).wire_format_cache ?
+				&cache_sync_internal_wire_ct_ops :
+				&cache_sync_internal_ct_ops);
 
 	if (!STATE(mode)->internal->ct.data) {
 		dlog(LOG_ERR, "can't allocate memory for the internal cache");
 		return -1;
 	}
+	if (CONFIG(sync).internal_file[0] &&
+	    cache_file_open(STATE(mode)->internal->ct.data,
+			    CONFIG(sync).internal_file) == -1) {
+		dlog(LOG_ERR, "can't open cache file `%s': %s, going on "
+		     "without it", CONFIG(sync).internal_file,
+		     strerror(errno));
+	}
 
 	STATE(mode)->internal->exp.data =
 		cache_create("internal", CACHE_T_EXP,
@@ -58,11 +75,27 @@ static void internal_cache_ct_dump(int fd, int type)
 	cache_dump(STATE(mode)->internal->ct.data, fd, type);
 }
 
+static int internal_cache_ct_dump_async(int fd, int type)
+{
+	return cache_dump_async(STATE(mode)->internal->ct.data, fd, type);
+}
+
 static void internal_cache_ct_flush(void)
 {
 	cache_flush(STATE(mode)->internal->ct.data);
 }
 
+static int
+internal_cache_ct_dump_index(int fd, int type, const struct cache_index_query *q)
+{
+	return cache_index_dump(STATE(mode)->internal->ct.data, fd, type, q);
+}
+
+static int internal_cache_ct_flush_index(const struct cache_index_query *q)
+{
+	return cache_index_flush(STATE(mode)->internal->ct.data, q);
+}
+
 static void internal_cache_ct_stats(int fd)
 {
 	cache_stats(STATE(mode)->internal->ct.data, fd);
@@ -75,6 +108,11 @@ static void internal_cache_ct_stats_ext(int fd)
 
 static void internal_cache_ct_populate(struct nf_conntrack *ct)
 {
+	struct cache_object *obj;
+	struct cache *c;
+	void *cached;
+	int id;
+
 	/* This is required by kernels < 2.6.20 */
 	nfct_attr_unset(ct, ATTR_ORIG_COUNTER_BYTES);
 	nfct_attr_unset(ct, ATTR_ORIG_COUNTER_PACKETS);
@@ -82,30 +120,83 @@ static void internal_cache_ct_populate(struct nf_conntrack *ct)
 	nfct_attr_unset(ct, ATTR_REPL_COUNTER_PACKETS);
 	nfct_attr_unset(ct, ATTR_USE);
 
-	cache_update_force(STATE(mode)->internal->ct.data, ct);
+	c = STATE(mode)->internal->ct.data;
+	obj = cache_find(c, ct, &id);
+	if (obj != NULL && obj->status != C_OBJ_DEAD) {
+		/* eg. loaded from the cache file, it did not change. The
+		 * timeout is always different in the dump and, like the
+		 * TCP flags, it is not worth an update. */
+		cached = cache_object_ptr(obj);
+		if (cached != NULL && c->ops->diff &&
+		    !(c->ops->diff(cached, ct) & ~((1 << CACHE_A_TIMEOUT) |
+						   (1 << CACHE_A_OTHER)))) {
+			STATE(stats).nl_dump_unchanged++;
+			cache_object_seen(obj);
+			return;
+		}
+		cache_update(c, obj, id, ct);
+		return;
+	}
+	cache_update_force(c, ct);
 }
 
-static int internal_cache_ct_purge_step(void *data1, void *data2)
+static void internal_cache_ct_populate_start(void)
+{
+	cache_generation_next(STATE(mode)->internal->ct.data);
+}
+
+static int internal_cache_ct_sweep_step(void *data1, void *data2)
 {
 	struct cache_object *obj = data2;
 
-	STATE(get_retval) = 0;
-	nl_get_conntrack(STATE(get), obj->ptr);	/* modifies STATE(get_reval) */
-	if (!STATE(get_retval)) {
-		if (obj->status != C_OBJ_DEAD) {
-			cache_object_set_status(obj, C_OBJ_DEAD);
-			sync_send(obj, NET_T_STATE_CT_DEL);
-			cache_object_put(obj);
-		}
+	/* not in the kernel table anymore. */
+	if (cache_object_stale(obj) && obj->status != C_OBJ_DEAD) {
+		STATE(stats).nl_dump_stale++;
+		cache_object_set_status(obj, C_OBJ_DEAD);
+		sync_send(obj, NET_T_STATE_CT_DEL);
+		cache_object_put(obj);
 	}
-
 	return 0;
 }
 
+/* the dump of the kernel table has completed, remove what we missed. */
+static void internal_cache_ct_populate_done(void)
+{
+	cache_sweep(STATE(mode)->internal->ct.data,
+		    internal_cache_ct_sweep_step);
+}
+
+/* this entry is in the kernel table that we are dumping to purge. */
+static void internal_cache_ct_seen(struct nf_conntrack *ct)
+{
+	struct cache_object *obj;
+	int id;
+
+	obj = cache_find(STATE(mode)->internal->ct.data, ct, &id);
+	if (obj != NULL)
+		cache_object_seen(obj);
+}
+
+static void internal_cache_ct_prefetch(const struct cache_key *key)
+{
+	cache_prefetch_key(STATE(mode)->internal->ct.data, key);
+}
+
+/* the events of a batch wake up the transmitter once. */
+static void internal_cache_ct_batch_start(void)
+{
+	queue_plug(STATE_SYNC(tx_queue));
+}
+
+static void internal_cache_ct_batch_done(void)
+{
+	queue_unplug(STATE_SYNC(tx_queue));
+}
+
 static void internal_cache_ct_purge(void)
 {
-	cache_iterate(STATE(mode)->internal->ct.data, NULL,
-			internal_cache_ct_purge_step);
+	cache_sweep(STATE(mode)->internal->ct.data,
+		    internal_cache_ct_sweep_step);
 }
 
 static int
@@ -139,7 +230,9 @@ internal_cache_ct_resync(enum nf_conntrack_msg_type type,
 	return NFCT_CB_CONTINUE;
 }
 
-static void internal_cache_ct_event_new(struct nf_conntrack *ct, int origin)
+static void
+internal_cache_ct_event_new(struct nf_conntrack *ct,
+			    const struct cache_key *key, int origin)
 {
 	struct cache_object *obj;
 	int id;
@@ -154,10 +247,11 @@ static void internal_cache_ct_event_new(struct nf_conntrack *ct, int origin)
 	nfct_attr_unset(ct, ATTR_REPL_COUNTER_BYTES);
 	nfct_attr_unset(ct, ATTR_REPL_COUNTER_PACKETS);
 
-	obj = cache_find(STATE(mode)->internal->ct.data, ct, &id);
+	obj = cache_find_key(STATE(mode)->internal->ct.data, key, &id);
 	if (obj == NULL) {
 retry:
-		obj = cache_object_new(STATE(mode)->internal->ct.data, ct);
+		obj = cache_object_new_key(STATE(mode)->internal->ct.data,
+					   ct, key);
 		if (obj == NULL)
 			return;
 		if (cache_add(STATE(mode)->internal->ct.data, obj, id) == -1) {
@@ -176,7 +270,20 @@ retry:
 	}
 }
 
-static void internal_cache_ct_event_upd(struct nf_conntrack *ct, int origin)
+/* the update changes something that we send to the other nodes. */
+static int internal_cache_ct_dirty(const struct cache_object *obj)
+{
+	uint32_t dirty = obj->dirty & ~(1 << CACHE_A_OTHER);
+
+	if (CONFIG(commit_timeout))
+		dirty &= ~(1 << CACHE_A_TIMEOUT);
+
+	return dirty != 0;
+}
+
+static void
+internal_cache_ct_event_upd(struct nf_conntrack *ct,
+			    const struct cache_key *key, int origin)
 {
 	struct cache_object *obj;
 
@@ -184,15 +291,17 @@ static void internal_cache_ct_event_upd(struct nf_conntrack *ct, int origin)
 	if (origin == CTD_ORIGIN_INJECT)
 		return;
 
-	obj = cache_update_force(STATE(mode)->internal->ct.data, ct);
+	obj = cache_update_force_key(STATE(mode)->internal->ct.data, ct, key);
 	if (obj == NULL)
 		return;
 
-	if (origin == CTD_ORIGIN_NOT_ME)
+	if (origin == CTD_ORIGIN_NOT_ME && internal_cache_ct_dirty(obj))
 		sync_send(obj, NET_T_STATE_CT_UPD);
 }
 
-static int internal_cache_ct_event_del(struct nf_conntrack *ct, int origin)
+static int
+internal_cache_ct_event_del(struct nf_conntrack *ct,
+			    const struct cache_key *key, int origin)
 {
 	struct cache_object *obj;
 	int id;
@@ -202,7 +311,7 @@ static int internal_cache_ct_event_del(struct nf_conntrack *ct, int origin)
 		return 0;
 
 	/* we don't synchronize events for objects that are not in the cache */
-	obj = cache_find(STATE(mode)->internal->ct.data, ct, &id);
+	obj = cache_find_key(STATE(mode)->internal->ct.data, key, &id);
 	if (obj == NULL)
 		return 0;
 
@@ -221,6 +330,11 @@ static void internal_cache_exp_dump(int fd, int type)
 	cache_dump(STATE(mode)->internal->exp.data, fd, type);
 }
 
+static int internal_cache_exp_dump_async(int fd, int type)
+{
+	return cache_dump_async(STATE(mode)->internal->exp.data, fd, type);
+}
+
 static void internal_cache_exp_flush(void)
 {
 	cache_flush(STATE(mode)->internal->exp.data);
@@ -370,10 +484,19 @@ struct internal_handler internal_cache = {
 	.close			= internal_cache_close,
 	.ct = {
 		.dump			= internal_cache_ct_dump,
+		.dump_async		= internal_cache_ct_dump_async,
 		.flush			= internal_cache_ct_flush,
+		.dump_index		= internal_cache_ct_dump_index,
+		.flush_index		= internal_cache_ct_flush_index,
 		.stats			= internal_cache_ct_stats,
 		.stats_ext		= internal_cache_ct_stats_ext,
 		.populate		= internal_cache_ct_populate,
+		.populate_start		= internal_cache_ct_populate_start,
+		.populate_done		= internal_cache_ct_populate_done,
+		.seen			= internal_cache_ct_seen,
+		.prefetch_key		= internal_cache_ct_prefetch,
+		.batch_start		= internal_cache_ct_batch_start,
+		.batch_done		= internal_cache_ct_batch_done,
 		.purge			= internal_cache_ct_purge,
 		.resync			= internal_cache_ct_resync,
 		.new			= internal_cache_ct_event_new,
@@ -382,6 +505,7 @@ struct internal_handler internal_cache = {
 	},
 	.exp = {
 		.dump			= internal_cache_exp_dump,
+		.dump_async		= internal_cache_exp_dump_async,
 		.flush			= internal_cache_exp_flush,
 		.stats			= internal_cache_exp_stats,
 		.stats_ext		= internal_cache_exp_stats_ext,
@@ -156,3 +156,31 @@ int do_local_request(int request,
 	
 	return 0;
 }
+
+/* same as above, the request is followed by len bytes of data */
+int do_local_request_data(int request, const void *data, size_t len,
+			  struct local_conf *conf,
+			  void (*step)(char *buf))
+{
+	char buf[sizeof(int) + len];
+	int fd, ret;
+
+	memcpy(buf, &request, sizeof(int));
+	memcpy(buf + sizeof(int), data, len);
+
+	fd = local_client_create(conf);
+	if (fd == -1)
+		return -1;
+
+	ret = send(fd, buf, sizeof(buf), 0);
+	if (ret == -1) {
+		local_client_destroy(fd);
+		return -1;
+	}
+
+	do_local_client_step(fd, step);
+
+	local_client_destroy(fd);
+
+	return 0;
+}
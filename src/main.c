@@ -20,6 +20,7 @@
 #include "conntrackd.h"
 #include "log.h"
 #include "helper.h"
+#include "cache.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -30,6 +31,7 @@
 #include <unistd.h>
 #include <sched.h>
 #include <limits.h>
+#include <arpa/inet.h>
 
 struct ct_general_state st;
 struct ct_state state;
@@ -45,6 +47,10 @@ static const char usage_client_commands[] =
 	"  -F [ct|expect], flush kernel conntrack table\n"
 	"  -i [ct|expect], display content of the internal cache\n"
 	"  -e [ct|expect], display the content of the external cache\n"
+	"  -I [internal|external] mark|zone|source value, display the\n"
+	"     cache entries with this key (see CacheIndex)\n"
+	"  -D [internal|external] mark|zone|source value, flush the\n"
+	"     cache entries with this key (see CacheIndex)\n"
 	"  -k, kill conntrack daemon\n"
 	"  -s  [|network|cache|runtime|link|rsqueue|queue|ct|expect], "
 		"dump statistics\n"
@@ -112,9 +118,67 @@ set_action_by_table(int i, int argc, char *argv[],
 	return i;
 }
 
+static int
+set_index_query(int i, int argc, char *argv[], int int_action,
+		int ext_action, int *action, struct cache_index_query *q)
+{
+	char *end;
+	int type;
+
+	*action = int_action;
+	if (i+1 < argc && argv[i+1][0] != '-') {
+		if (strncmp(argv[i+1], "internal", strlen(argv[i+1])) == 0) {
+			i++;
+		} else if (strncmp(argv[i+1], "external",
+				   strlen(argv[i+1])) == 0) {
+			*action = ext_action;
+			i++;
+		}
+	}
+	if (i+2 >= argc) {
+		fprintf(stderr, "ERROR: option `%s' requires an index "
+				"and a value\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	type = cache_index_type(argv[i+1]);
+	if (type == -1) {
+		fprintf(stderr, "ERROR: unknown index `%s', use mark, zone "
+				"or source\n", argv[i+1]);
+		exit(EXIT_FAILURE);
+	}
+	memset(q, 0, sizeof(struct cache_index_query));
+	q->type = type;
+
+	switch(type) {
+	case CACHE_INDEX_MARK:
+	case CACHE_INDEX_ZONE:
+		q->key.value[0] = strtoul(argv[i+2], &end, 0);
+		if (*end != '\0') {
+			fprintf(stderr, "ERROR: bad %s `%s'\n",
+				argv[i+1], argv[i+2]);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case CACHE_INDEX_SOURCE:
+		if (inet_pton(AF_INET, argv[i+2], q->key.value) == 1)
+			q->key.family = AF_INET;
+		else if (inet_pton(AF_INET6, argv[i+2], q->key.value) == 1)
+			q->key.family = AF_INET6;
+		else {
+			fprintf(stderr, "ERROR: bad address `%s'\n",
+				argv[i+2]);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	}
+	return i + 2;
+}
+
 int main(int argc, char *argv[])
 {
 	int ret, i, action = -1;
+	int ready[2] = { -1, -1 };
+	struct cache_index_query query;
 	char config_file[PATH_MAX] = {};
 	int type = 0;
 	struct utsname u;
@@ -156,6 +220,17 @@ int main(int argc, char *argv[])
 						EXP_DUMP_EXTERNAL,
 						CT_DUMP_EXTERNAL, &action);
 			break;
+		case 'I':
+			set_operation_mode(&type, REQUEST, argv);
+			i = set_index_query(i, argc, argv, CT_DUMP_INT_INDEX,
+					    CT_DUMP_EXT_INDEX, &action, &query);
+			break;
+		case 'D':
+			set_operation_mode(&type, REQUEST, argv);
+			i = set_index_query(i, argc, argv, CT_FLUSH_INT_INDEX,
+					    CT_FLUSH_EXT_INDEX, &action,
+					    &query);
+			break;
 		case 'C':
 			if (++i < argc) {
 				strncpy(config_file, argv[i], PATH_MAX);
@@ -328,7 +403,21 @@ int main(int argc, char *argv[])
 	}
 
 	if (type == REQUEST) {
-		if (do_local_request(action, &conf.local, local_step) == -1) {
+		switch(action) {
+		case CT_DUMP_INT_INDEX:
+		case CT_DUMP_EXT_INDEX:
+		case CT_FLUSH_INT_INDEX:
+		case CT_FLUSH_EXT_INDEX:
+			ret = do_local_request_data(action, &query,
+						    sizeof(query),
+						    &conf.local, local_step);
+			break;
+		default:
+			ret = do_local_request(action, &conf.local,
+					       local_step);
+			break;
+		}
+		if (ret == -1) {
 			fprintf(stderr, "can't connect: is conntrackd "
 					"running? appropriate permissions?\n");
 			exit(EXIT_FAILURE);
@@ -370,6 +459,36 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/*
+	 * Daemonize conntrackd before the initialization, threads and the
+	 * io_uring do not survive fork(). The parent waits for the child to
+	 * tell that it is ready, so errors are still reported.
+	 */
+	if (type == DAEMON) {
+		pid_t pid;
+		char c;
+
+		if (pipe(ready) == -1) {
+			perror("pipe has failed: ");
+			unlink(CONFIG(lockfile));
+			exit(EXIT_FAILURE);
+		}
+		if ((pid = fork()) == -1) {
+			perror("fork has failed: ");
+			unlink(CONFIG(lockfile));
+			exit(EXIT_FAILURE);
+		} else if (pid) {
+			close(ready[1]);
+			/* the pipe is closed without a byte if init fails */
+			if (read(ready[0], &c, sizeof(c)) != sizeof(c))
+				exit(EXIT_FAILURE);
+			exit(EXIT_SUCCESS);
+		}
+		close(ready[0]);
+
+		setsid();
+	}
+
 	/*
 	 * initialization process
 	 */
@@ -385,17 +504,11 @@ int main(int argc, char *argv[])
 	chdir("/");
 	close(STDIN_FILENO);
 
-	/* Daemonize conntrackd */
 	if (type == DAEMON) {
-		pid_t pid;
-
-		if ((pid = fork()) == -1) {
-			perror("fork has failed: ");
-			exit(EXIT_FAILURE);
-		} else if (pid)
-			exit(EXIT_SUCCESS);
-
-		setsid();
+		/* we are ready, let the parent go. */
+		if (write(ready[1], "", 1) == -1)
+			dlog(LOG_WARNING, "can't notify the parent process");
+		close(ready[1]);
 
 		close(STDOUT_FILENO);
 		close(STDERR_FILENO);
@@ -19,6 +19,7 @@
  */
 
 #include "mcast.h"
+#include "uring.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -251,14 +252,37 @@ struct mcast_sock *mcast_client_create(struct mcast_conf *conf)
 
 void mcast_client_destroy(struct mcast_sock *m)
 {
+	/* pending sends refer to this socket. */
+	uring_flush(m);
 	close(m->fd);
 	free(m);
 }
 
+static void mcast_send_done(void *data, ssize_t ret)
+{
+	struct mcast_sock *m = data;
+
+	if (ret == -1) {
+		m->stats.error++;
+		return;
+	}
+	m->stats.bytes += ret;
+	m->stats.messages++;
+}
+
 ssize_t mcast_send(struct mcast_sock *m, const void *data, int size)
 {
 	ssize_t ret;
-	
+
+	/* batched with other sends, stats are updated on completion. */
+	if (uring_enabled()) {
+		ret = uring_sendto(m->fd, data, size,
+				   (struct sockaddr *) &m->addr,
+				   m->sockaddr_len, mcast_send_done, m);
+		if (ret != -1)
+			return ret;
+	}
+
 	ret = sendto(m->fd, 
 		     data,
 		     size,
@@ -27,6 +27,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <libmnl/libmnl.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack_tcp.h>
 
 struct nfct_handle *nl_init_event_handler(void)
@@ -161,16 +166,19 @@ nl_flush_selective_cb(enum nf_conntrack_msg_type type,
 
 	switch(type) {
 	case NFCT_T_UPDATE:
-		nl_destroy_conntrack(STATE(flush), ct);
+		nl_destroy_conntrack(data, ct);
 		break;
 	default:
-		STATE(stats).nl_dump_unknown_type++;
+		__atomic_fetch_add(&STATE(stats).nl_dump_unknown_type, 1,
+				   __ATOMIC_RELAXED);
 		break;
 	}
 	return NFCT_CB_CONTINUE;
 }
 
-int nl_flush_conntrack_table_selective(void)
+/* the entries are deleted through @flusher, this may run in a worker
+ * thread, so the main thread must not use that handler meanwhile. */
+int nl_flush_conntrack_table_selective(struct nfct_handle *flusher)
 {
 	struct nfct_handle *h;
 	int ret;
@@ -180,7 +188,7 @@ int nl_flush_conntrack_table_selective(void)
 		dlog(LOG_ERR, "cannot open handle");
 		return -1;
 	}
-	nfct_callback_register(h, NFCT_T_ALL, nl_flush_selective_cb, NULL);
+	nfct_callback_register(h, NFCT_T_ALL, nl_flush_selective_cb, flusher);
 
 	ret = nfct_query(h, NFCT_Q_DUMP, &CONFIG(family));
 
@@ -215,17 +223,9 @@ int nl_get_conntrack(struct nfct_handle *h, const struct nf_conntrack *ct)
 	return ret;
 }
 
-int nl_create_conntrack(struct nfct_handle *h, 
-			const struct nf_conntrack *orig,
-			int timeout)
+/* adjust a copy of the conntrack so that the kernel accepts to create it. */
+static void nl_create_setup(struct nf_conntrack *ct, int timeout)
 {
-	int ret;
-	struct nf_conntrack *ct;
-
-	ct = nfct_clone(orig);
-	if (ct == NULL)
-		return -1;
-
 	if (timeout > 0)
 		nfct_set_attr_u32(ct, ATTR_TIMEOUT, timeout);
 
@@ -257,14 +257,9 @@ int nl_create_conntrack(struct nfct_handle *h,
 		nfct_set_attr_u8(ct, ATTR_TCP_FLAGS_REPL, flags);
 		nfct_set_attr_u8(ct, ATTR_TCP_MASK_REPL, flags);
 	}
-
-	ret = nfct_query(h, NFCT_Q_CREATE, ct);
-	nfct_destroy(ct);
-
-	return ret;
 }
 
-int nl_update_conntrack(struct nfct_handle *h,
+int nl_create_conntrack(struct nfct_handle *h, 
 			const struct nf_conntrack *orig,
 			int timeout)
 {
@@ -275,6 +270,16 @@ int nl_update_conntrack(struct nfct_handle *h,
 	if (ct == NULL)
 		return -1;
 
+	nl_create_setup(ct, timeout);
+
+	ret = nfct_query(h, NFCT_Q_CREATE, ct);
+	nfct_destroy(ct);
+
+	return ret;
+}
+
+static void nl_update_setup(struct nf_conntrack *ct, int timeout)
+{
 	if (timeout > 0)
 		nfct_set_attr_u32(ct, ATTR_TIMEOUT, timeout);
 
@@ -324,6 +329,20 @@ int nl_update_conntrack(struct nfct_handle *h,
 		nfct_set_attr_u8(ct, ATTR_TCP_FLAGS_REPL, flags);
 		nfct_set_attr_u8(ct, ATTR_TCP_MASK_REPL, flags);
 	}
+}
+
+int nl_update_conntrack(struct nfct_handle *h,
+			const struct nf_conntrack *orig,
+			int timeout)
+{
+	int ret;
+	struct nf_conntrack *ct;
+
+	ct = nfct_clone(orig);
+	if (ct == NULL)
+		return -1;
+
+	nl_update_setup(ct, timeout);
 
 	ret = nfct_query(h, NFCT_Q_UPDATE, ct);
 	nfct_destroy(ct);
@@ -336,6 +355,297 @@ int nl_destroy_conntrack(struct nfct_handle *h, const struct nf_conntrack *ct)
 	return nfct_query(h, NFCT_Q_DESTROY, ct);
 }
 
+/*
+ * Batches of conntrack requests. The messages are packed in one buffer
+ * that is sent at once, the kernel acknowledges each of them and we match
+ * the acknowledgments with the requests by sequence number. The socket of
+ * the handle must not be subscribed to any group.
+ */
+#define NL_BATCH_BUFSIZ		(64 * 1024)
+/* receive buffer for the acknowledgments of a whole batch, an error
+ * echoes the request unless NETLINK_CAP_ACK is supported. This includes
+ * the overhead of the socket buffers that the kernel accounts for. */
+#define NL_BATCH_ACK_SIZE	2048
+
+struct nl_batch {
+	struct nfct_handle	*h;
+	char			*buf;
+	size_t			len;
+	unsigned int		num;
+	unsigned int		pending;	/* sent, not acknowledged yet */
+	uint32_t		seq;		/* of the first message */
+	void			*data[NL_BATCH_MAX];
+	uint8_t			acked[NL_BATCH_MAX];
+};
+
+static uint32_t nl_batch_seq;
+
+/* if the acknowledgments do not fit, they are lost and the whole batch is
+ * considered failed, even if the kernel applied it. */
+static void nl_batch_setup_socket(struct nfct_handle *h)
+{
+	unsigned int size = NL_BATCH_MAX * NL_BATCH_ACK_SIZE;
+#ifdef NETLINK_CAP_ACK
+	int one = 1;
+
+	/* errors come without the request, since Linux 4.3. */
+	setsockopt(nfct_fd(h), SOL_NETLINK, NETLINK_CAP_ACK,
+		   &one, sizeof(one));
+#endif
+	if (nfnl_rcvbufsiz(nfct_nfnlh(h), size) < size)
+		dlog(LOG_WARNING, "netlink batch socket buffer is too small, "
+		     "acknowledgments may be lost");
+}
+
+struct nl_batch *nl_batch_create(struct nfct_handle *h)
+{
+	struct nl_batch *b;
+
+	b = calloc(1, sizeof(struct nl_batch));
+	if (b == NULL)
+		return NULL;
+
+	b->buf = malloc(NL_BATCH_BUFSIZ);
+	if (b->buf == NULL) {
+		free(b);
+		return NULL;
+	}
+	b->h = h;
+	if (nl_batch_seq == 0)
+		nl_batch_seq = time(NULL);
+
+	nl_batch_setup_socket(h);
+
+	return b;
+}
+
+void nl_batch_destroy(struct nl_batch *b)
+{
+	free(b->buf);
+	free(b);
+}
+
+unsigned int nl_batch_len(const struct nl_batch *b)
+{
+	return b->num;
+}
+
+unsigned int nl_batch_pending(const struct nl_batch *b)
+{
+	return b->pending;
+}
+
+static struct nlmsghdr *
+nl_batch_put(struct nl_batch *b, uint16_t type, uint16_t flags,
+	     const struct nf_conntrack *ct, void *data)
+{
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfh;
+
+	/* the messages in flight are still waiting for their ack. */
+	if (b->pending) {
+		errno = EBUSY;
+		return NULL;
+	}
+	/* leave room for a message of the maximum size. */
+	if (b->num >= NL_BATCH_MAX ||
+	    NL_BATCH_BUFSIZ - b->len < MNL_SOCKET_BUFFER_SIZE) {
+		errno = ENOSPC;
+		return NULL;
+	}
+	if (b->num == 0) {
+		b->seq = nl_batch_seq;
+		nl_batch_seq += NL_BATCH_MAX;
+	}
+
+	nlh = mnl_nlmsg_put_header(b->buf + b->len);
+	nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	nlh->nlmsg_seq = b->seq + b->num;
+
+	nfh = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+	nfh->nfgen_family = nfct_get_attr_u8(ct, ATTR_L3PROTO);
+	nfh->version = NFNETLINK_V0;
+	nfh->res_id = 0;
+
+	if (nfct_nlmsg_build(nlh, ct) == -1)
+		return NULL;
+
+	b->data[b->num] = data;
+	b->acked[b->num] = 0;
+	b->len += NLMSG_ALIGN(nlh->nlmsg_len);
+	b->num++;
+
+	return nlh;
+}
+
+/* returns -1 and sets errno to ENOSPC if the batch has to be flushed. */
+int nl_batch_create_conntrack(struct nl_batch *b,
+			      const struct nf_conntrack *orig,
+			      int timeout, void *data)
+{
+	struct nf_conntrack *ct;
+	struct nlmsghdr *nlh;
+
+	ct = nfct_clone(orig);
+	if (ct == NULL)
+		return -1;
+
+	nl_create_setup(ct, timeout);
+
+	nlh = nl_batch_put(b, IPCTNL_MSG_CT_NEW, NLM_F_CREATE | NLM_F_EXCL,
+			   ct, data);
+	nfct_destroy(ct);
+
+	return nlh ? 0 : -1;
+}
+
+int nl_batch_update_conntrack(struct nl_batch *b,
+			      const struct nf_conntrack *orig,
+			      int timeout, void *data)
+{
+	struct nf_conntrack *ct;
+	struct nlmsghdr *nlh;
+
+	ct = nfct_clone(orig);
+	if (ct == NULL)
+		return -1;
+
+	nl_update_setup(ct, timeout);
+
+	nlh = nl_batch_put(b, IPCTNL_MSG_CT_NEW, 0, ct, data);
+	nfct_destroy(ct);
+
+	return nlh ? 0 : -1;
+}
+
+int nl_batch_destroy_conntrack(struct nl_batch *b,
+			       const struct nf_conntrack *ct, void *data)
+{
+	return nl_batch_put(b, IPCTNL_MSG_CT_DELETE, 0, ct, data) ? 0 : -1;
+}
+
+static void nl_batch_reset(struct nl_batch *b)
+{
+	b->len = 0;
+	b->num = 0;
+	b->pending = 0;
+}
+
+/* the messages that were not acknowledged get the error of the socket. */
+static void nl_batch_abort(struct nl_batch *b, int error,
+			   void (*cb)(void *data, int error, void *arg),
+			   void *arg)
+{
+	unsigned int i;
+
+	for (i = 0; i < b->num; i++) {
+		if (!b->acked[i])
+			cb(b->data[i], error, arg);
+	}
+	nl_batch_reset(b);
+}
+
+/*
+ * Send the batch. The kernel processes the requests while we are in
+ * sendto(), so the acknowledgments are usually waiting in the socket
+ * already when this returns, collect them with nl_batch_recv(). No more
+ * messages can be added until all of them have been acknowledged.
+ */
+int nl_batch_send(struct nl_batch *b,
+		  void (*cb)(void *data, int error, void *arg), void *arg)
+{
+	struct sockaddr_nl addr = {
+		.nl_family	= AF_NETLINK,
+	};
+
+	if (b->num == 0 || b->pending)
+		return 0;
+
+	if (sendto(nfct_fd(b->h), b->buf, b->len, 0,
+		   (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		int error = errno;
+
+		nl_batch_abort(b, error, cb, arg);
+		errno = error;
+		return -1;
+	}
+	b->pending = b->num;
+
+	return 0;
+}
+
+/*
+ * Collect the acknowledgments of the batch in flight, cb is called for
+ * every message with the data that was passed when it was added and the
+ * error reported by the kernel, zero on success. With MSG_DONTWAIT in
+ * flags, we return -1 and errno is set to EAGAIN if some of them have not
+ * arrived yet. If the socket fails, the messages that are left get its
+ * error and we return -1.
+ */
+int nl_batch_recv(struct nl_batch *b,
+		  void (*cb)(void *data, int error, void *arg), void *arg,
+		  int flags)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	int fd = nfct_fd(b->h);
+	unsigned int i;
+
+	while (b->pending > 0) {
+		const struct nlmsghdr *nlh;
+		int len;
+
+		len = recv(fd, buf, sizeof(buf), flags);
+		if (len == -1) {
+			int error = errno;
+
+			if (error == EINTR)
+				continue;
+			if (error != EAGAIN)
+				nl_batch_abort(b, error, cb, arg);
+			errno = error;
+			return -1;
+		}
+
+		nlh = (const struct nlmsghdr *)buf;
+		while (mnl_nlmsg_ok(nlh, len)) {
+			const struct nlmsgerr *err;
+
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				err = mnl_nlmsg_get_payload(nlh);
+				i = nlh->nlmsg_seq - b->seq;
+
+				/* late acknowledgments of an older batch. */
+				if (i < b->num && !b->acked[i]) {
+					b->acked[i] = 1;
+					b->pending--;
+					cb(b->data[i], -err->error, arg);
+				}
+			}
+			nlh = mnl_nlmsg_next(nlh, &len);
+		}
+	}
+	nl_batch_reset(b);
+
+	return 0;
+}
+
+/*
+ * Send the batch and wait for the acknowledgments, see nl_batch_send()
+ * and nl_batch_recv().
+ */
+int nl_batch_flush(struct nl_batch *b,
+		   void (*cb)(void *data, int error, void *arg), void *arg)
+{
+	if (b->num == 0)
+		return 0;
+
+	if (nl_batch_send(b, cb, arg) == -1)
+		return -1;
+
+	return nl_batch_recv(b, cb, arg, 0);
+}
+
 int nl_create_expect(struct nfct_handle *h, const struct nf_expect *orig,
 		     int timeout)
 {
@@ -14,58 +14,264 @@
  * You should have received a copy of the GNU General Public License
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Long operations (flushes, dumps) used to be run from a child process.
+ * With large caches, fork() stalls the daemon while copying the page
+ * tables and copy-on-write doubles the memory consumption, so they are
+ * now run in a pool of worker threads. Jobs that access the caches are
+ * not thread-safe, so they are run in steps from the main loop instead.
+ * In both cases, the main loop is notified via evfd.
  */
 
 #include <signal.h>
+#include <errno.h>
+#include <pthread.h>
 #include "conntrackd.h"
 #include "process.h"
+#include "fds.h"
+#include "event.h"
+#include "log.h"
+#include "date.h"
+
+static LIST_HEAD(job_list);		/* all jobs, main thread only */
+static LIST_HEAD(iter_list);		/* main thread only */
 
-static LIST_HEAD(process_list);
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct list_head	pending;	/* protected by lock */
+	struct list_head	done;		/* protected by lock */
+	int			stop;		/* protected by lock */
+	struct evfd		*evfd;
+	unsigned int		num;
+	pthread_t		thread[WORKER_THREADS_MAX];
+} pool = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.cond		= PTHREAD_COND_INITIALIZER,
+	.pending	= LIST_HEAD_INIT(pool.pending),
+	.done		= LIST_HEAD_INIT(pool.done),
+};
 
-int fork_process_new(int type, int flags, void (*cb)(void *data), void *data)
+static void worker_pool_wakeup(void)
 {
-	struct child_process *c, *this;
-	int pid;
+	if (write_evfd(pool.evfd) == -1)
+		dlog(LOG_ERR, "cannot wake up main loop: %s",
+		     strerror(errno));
+}
 
-	/* We only want one process of this type at the same time. This is
-	 * useful if you want to prevent two child processes from accessing
-	 * a shared descriptor at the same time. */
-	if (flags & CTD_PROC_F_EXCL) {
-		list_for_each_entry(this, &process_list, head) {
-			if (this->type == type) {
-				return -1;
-			}
+static void *worker_thread(void *data)
+{
+	struct worker_job *job;
+
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (list_empty(&pool.pending) && !pool.stop)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+
+		if (pool.stop)
+			break;
+
+		job = list_entry(pool.pending.next, struct worker_job, list);
+		list_del(&job->list);
+		job->state = WORKER_JOB_RUNNING;
+		pthread_mutex_unlock(&pool.lock);
+
+		job->run(job->data);
+
+		pthread_mutex_lock(&pool.lock);
+		job->state = WORKER_JOB_DONE;
+		list_add_tail(&job->list, &pool.done);
+		worker_pool_wakeup();
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+static void worker_job_release(struct worker_job *job)
+{
+	list_del(&job->head);
+	if (job->done)
+		job->done(job->data);
+	free(job);
+}
+
+/* main loop side: release finished jobs and run one step of iterators */
+static void worker_pool_cb(void *data)
+{
+	struct worker_job *job, *tmp;
+	LIST_HEAD(done);
+
+	if (read_evfd(pool.evfd) == -1)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	list_splice_init(&pool.done, &done);
+	pthread_mutex_unlock(&pool.lock);
+
+	list_for_each_entry_safe(job, tmp, &done, list) {
+		list_del(&job->list);
+		worker_job_release(job);
+	}
+
+	list_for_each_entry_safe(job, tmp, &iter_list, list) {
+		if (job->step(job->data) == 0) {
+			list_del(&job->list);
+			worker_job_release(job);
 		}
 	}
-	c = calloc(sizeof(struct child_process), 1);
-	if (c == NULL)
+	/* iterators not yet finished, come back in the next round. */
+	if (!list_empty(&iter_list))
+		worker_pool_wakeup();
+}
+
+int worker_pool_create(unsigned int num)
+{
+	sigset_t all, old;
+	unsigned int i;
+	int ret = 0;
+
+	if (num > WORKER_THREADS_MAX)
+		num = WORKER_THREADS_MAX;
+
+	pool.evfd = create_evfd();
+	if (pool.evfd == NULL)
 		return -1;
 
-	c->type = type;
-	c->cb = cb;
-	c->data = data;
-	c->pid = pid = fork();
+	if (register_fd(get_read_evfd(pool.evfd), worker_pool_cb, NULL,
+			STATE(fds)) == -1) {
+		destroy_evfd(pool.evfd);
+		pool.evfd = NULL;
+		return -1;
+	}
+	fds_set_name(get_read_evfd(pool.evfd), "worker", STATE(fds));
 
-	if (c->pid > 0)
-		list_add(&c->head, &process_list);
+	/* signals are handled by the main thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < num; i++) {
+		ret = pthread_create(&pool.thread[i], NULL,
+				     worker_thread, NULL);
+		if (ret != 0)
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pool.num = i;
 
-	return pid;
+	if (ret != 0) {
+		worker_pool_destroy();
+		errno = ret;
+		return -1;
+	}
+	return 0;
 }
 
-int fork_process_delete(int pid)
+void worker_pool_destroy(void)
 {
-	struct child_process *this, *tmp;
+	struct worker_job *job, *tmp;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	/* wait for the running jobs to finish. */
+	for (i = 0; i < pool.num; i++)
+		pthread_join(pool.thread[i], NULL);
+	pool.num = 0;
 
-	list_for_each_entry_safe(this, tmp, &process_list, head) {
-		if (this->pid == pid) {
-			list_del(&this->head);
-			if (this->cb) {
-				this->cb(this->data);
+	list_for_each_entry_safe(job, tmp, &job_list, head) {
+		list_del(&job->list);
+		worker_job_release(job);
+	}
+	if (pool.evfd != NULL) {
+		unregister_fd(get_read_evfd(pool.evfd), STATE(fds));
+		destroy_evfd(pool.evfd);
+		pool.evfd = NULL;
+	}
+}
+
+static struct worker_job *worker_job_alloc(int type, int flags)
+{
+	struct worker_job *job;
+
+	/* We only want one job of this type at the same time. This is
+	 * useful if you want to prevent two jobs from accessing a shared
+	 * descriptor at the same time. */
+	if (flags & CTD_PROC_F_EXCL) {
+		list_for_each_entry(job, &job_list, head) {
+			if (job->type == type) {
+				errno = EBUSY;
+				return NULL;
 			}
-			free(this);
-			return 1;
 		}
 	}
+	job = calloc(sizeof(struct worker_job), 1);
+	if (job == NULL)
+		return NULL;
+
+	job->type = type;
+	gettime(&job->start);
+
+	return job;
+}
+
+/* run() is called from a worker thread, done() from the main loop */
+int worker_job_new(int type, int flags,
+		   void (*run)(void *data),
+		   void (*done)(void *data), void *data)
+{
+	struct worker_job *job;
+
+	if (pool.num == 0) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	job = worker_job_alloc(type, flags);
+	if (job == NULL)
+		return -1;
+
+	job->run = run;
+	job->done = done;
+	job->data = data;
+	job->state = WORKER_JOB_QUEUED;
+	list_add_tail(&job->head, &job_list);
+
+	pthread_mutex_lock(&pool.lock);
+	list_add_tail(&job->list, &pool.pending);
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	return 0;
+}
+
+/* step() is called from the main loop until it returns zero */
+int worker_iter_new(int type, int flags,
+		    int (*step)(void *data),
+		    void (*done)(void *data), void *data)
+{
+	struct worker_job *job;
+
+	if (pool.evfd == NULL) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	job = worker_job_alloc(type, flags);
+	if (job == NULL)
+		return -1;
+
+	job->step = step;
+	job->done = done;
+	job->data = data;
+	job->state = WORKER_JOB_ITER;
+	list_add_tail(&job->head, &job_list);
+	list_add_tail(&job->list, &iter_list);
+
+	worker_pool_wakeup();
+
 	return 0;
 }
 
@@ -73,21 +279,43 @@ static const char *process_type_to_name[CTD_PROC_MAX] = {
 	[CTD_PROC_ANY]		= "any",
 	[CTD_PROC_FLUSH]	= "flush",
 	[CTD_PROC_COMMIT]	= "commit",
+	[CTD_PROC_DUMP]		= "dump",
 };
 
-void fork_process_dump(int fd)
+static const char *worker_job_state_to_name[] = {
+	[WORKER_JOB_QUEUED]	= "queued",
+	[WORKER_JOB_RUNNING]	= "running",
+	[WORKER_JOB_DONE]	= "done",
+	[WORKER_JOB_ITER]	= "iterating",
+};
+
+void worker_job_dump(int fd)
 {
-	struct child_process *this;
+	struct worker_job *this;
+	struct timeval now, elapsed;
 	char buf[4096];
 	int size = 0;
 
-	list_for_each_entry(this, &process_list, head) {
-		size += snprintf(buf+size, sizeof(buf),
-				 "PID=%u type=%s\n",
-				 this->pid,
+	gettime(&now);
+
+	pthread_mutex_lock(&pool.lock);
+	list_for_each_entry(this, &job_list, head) {
+		if (size >= (int)sizeof(buf))
+			break;
+
+		timersub(&now, &this->start, &elapsed);
+		size += snprintf(buf+size, sizeof(buf)-size,
+				 "job type=%s state=%s elapsed=%lu.%06lu\n",
 				 this->type < CTD_PROC_MAX ?
-				 process_type_to_name[this->type] : "unknown");
+				 process_type_to_name[this->type] : "unknown",
+				 worker_job_state_to_name[this->state],
+				 (unsigned long)elapsed.tv_sec,
+				 (unsigned long)elapsed.tv_usec);
 	}
+	pthread_mutex_unlock(&pool.lock);
+
+	if (size > (int)sizeof(buf))
+		size = sizeof(buf);
 
 	send(fd, buf, size, 0);
 }
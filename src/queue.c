@@ -132,8 +132,12 @@ int queue_add(struct queue *b, struct queue_node *n)
 	n->owner = b;
 	list_add_tail(&n->head, &b->head);
 	b->num_elems++;
-	if (b->evfd)
-		write_evfd(b->evfd);
+	if (b->evfd) {
+		if (b->plugged)
+			b->deferred = 1;
+		else
+			write_evfd(b->evfd);
+	}
 	return 1;
 }
 
@@ -144,8 +148,6 @@ int queue_del(struct queue_node *n)
 
 	list_del_init(&n->head);
 	n->owner->num_elems--;
-	if (n->owner->evfd)
-		read_evfd(n->owner->evfd);
 	n->owner = NULL;
 	return 1;
 }
@@ -167,6 +169,27 @@ int queue_get_eventfd(struct queue *b)
 	return get_read_evfd(b->evfd);
 }
 
+/* the consumer has woken up, it has to empty the queue after this. */
+int queue_ack_eventfd(struct queue *b)
+{
+	return read_evfd(b->evfd);
+}
+
+/* objects added in between wake up the consumer once, on unplug. */
+void queue_plug(struct queue *b)
+{
+	b->plugged++;
+}
+
+void queue_unplug(struct queue *b)
+{
+	if (--b->plugged > 0 || !b->deferred)
+		return;
+
+	b->deferred = 0;
+	write_evfd(b->evfd);
+}
+
 void queue_iterate(struct queue *b, 
 		   const void *data, 
 		   int (*iterate)(struct queue_node *n, const void *data2))
@@ -30,6 +30,9 @@
 #include "cidr.h"
 #include "helper.h"
 #include "stack.h"
+#include "process.h"
+#include "hash.h"
+#include "cache.h"
 #include <syslog.h>
 #include <sched.h>
 #include <dlfcn.h>
@@ -51,6 +54,10 @@ static void print_err(int err, const char *msg, ...);
 static void __kernel_filter_start(void);
 static void __kernel_filter_add_state(int value);
 static void __max_dedicated_links_reached(void);
+static void __add_source_budget(char *name, unsigned int calls,
+				unsigned int usecs);
+static void __add_cache_index(char *name, unsigned int prefix4,
+			      unsigned int prefix6);
 
 struct stack symbol_stack;
 
@@ -87,8 +94,11 @@ enum {
 %token T_SCHEDULER T_TYPE T_PRIO T_NETLINK_EVENTS_RELIABLE
 %token T_DISABLE_INTERNAL_CACHE T_DISABLE_EXTERNAL_CACHE T_ERROR_QUEUE_LENGTH
 %token T_OPTIONS T_TCP_WINDOW_TRACKING T_EXPECT_SYNC
+%token T_WIRE_FORMAT_CACHE T_CACHE_FILE
 %token T_HELPER T_HELPER_QUEUE_NUM T_HELPER_QUEUE_LEN T_HELPER_POLICY
-%token T_HELPER_EXPECT_TIMEOUT T_HELPER_EXPECT_MAX
+%token T_HELPER_EXPECT_TIMEOUT T_HELPER_EXPECT_MAX T_TIMER_WHEEL
+%token T_NETLINK_EVENT_THREAD T_IO_ENGINE T_WORKER_THREADS T_SOURCE_BUDGET
+%token T_HASH_TYPE T_CACHE_INDEX T_CACHE_MEMORY_LIMIT
 
 %token <string> T_IP T_PATH_VAL
 %token <val> T_NUMBER
@@ -744,6 +754,53 @@ hashlimit: T_HASHLIMIT T_NUMBER
 	conf.limit = $2;
 };
 
+hash_type : T_HASH_TYPE T_STRING
+{
+	if (strcasecmp($2, "chained") == 0) {
+		conf.general.hash_flags &= ~HASHTABLE_F_OPEN;
+	} else if (strcasecmp($2, "open") == 0) {
+		conf.general.hash_flags |= HASHTABLE_F_OPEN;
+	} else {
+		print_err(CTD_CFG_ERROR, "unknown hashtable type `%s'", $2);
+		exit(EXIT_FAILURE);
+	}
+};
+
+cache_index : T_CACHE_INDEX T_STRING
+{
+	__add_cache_index($2, 0, 0);
+};
+
+cache_index : T_CACHE_INDEX T_STRING T_NUMBER
+{
+	__add_cache_index($2, $3, 0);
+};
+
+cache_index : T_CACHE_INDEX T_STRING T_NUMBER T_NUMBER
+{
+	__add_cache_index($2, $3, $4);
+};
+
+cache_memory_limit : T_CACHE_MEMORY_LIMIT T_NUMBER
+{
+	conf.general.cache_memory = $2;
+};
+
+cache_memory_limit : T_CACHE_MEMORY_LIMIT T_STRING T_NUMBER
+{
+	if (strcasecmp($2, "external") == 0) {
+		conf.general.cache_memory_external = $3;
+	} else if (strcasecmp($2, "internal") == 0) {
+		conf.general.cache_memory_internal = $3;
+	} else {
+		print_err(CTD_CFG_ERROR, "unknown cache `%s' in "
+					 "`CacheMemoryLimit', use `External' "
+					 "or `Internal'", $2);
+		exit(EXIT_FAILURE);
+	}
+	free($2);
+};
+
 unix_line: T_UNIX '{' unix_options '}';
 
 unix_options:
@@ -844,6 +901,31 @@ option: T_TCP_WINDOW_TRACKING T_OFF
 	CONFIG(sync).tcp_window_tracking = 0;
 };
 
+option: T_WIRE_FORMAT_CACHE T_ON
+{
+	CONFIG(sync).wire_format_cache = 1;
+};
+
+option: T_WIRE_FORMAT_CACHE T_OFF
+{
+	CONFIG(sync).wire_format_cache = 0;
+};
+
+option: T_CACHE_FILE T_STRING T_PATH_VAL
+{
+	if (strcasecmp($2, "external") == 0) {
+		strncpy(CONFIG(sync).external_file, $3, FILENAME_MAXLEN - 1);
+	} else if (strcasecmp($2, "internal") == 0) {
+		strncpy(CONFIG(sync).internal_file, $3, FILENAME_MAXLEN - 1);
+	} else {
+		print_err(CTD_CFG_ERROR, "unknown cache `%s' in `CacheFile', "
+					 "use `External' or `Internal'", $2);
+		exit(EXIT_FAILURE);
+	}
+	free($2);
+	free($3);
+};
+
 option: T_EXPECT_SYNC T_ON
 {
 	CONFIG(flags) |= CTD_EXPECT;
@@ -1106,6 +1188,9 @@ general_list:
 
 general_line: hashsize
 	    | hashlimit
+	    | hash_type
+	    | cache_index
+	    | cache_memory_limit
 	    | logfile_bool
 	    | logfile_path
 	    | syslog_facility
@@ -1120,8 +1205,13 @@ general_line: hashsize
 	    | filter
 	    | netlink_overrun_resync
 	    | netlink_events_reliable
+	    | netlink_event_thread
 	    | nice
 	    | scheduler
+	    | timer_wheel
+	    | io_engine
+	    | worker_threads
+	    | source_budget
 	    ;
 
 netlink_buffer_size: T_BUFFER_SIZE T_NUMBER
@@ -1159,6 +1249,58 @@ netlink_events_reliable : T_NETLINK_EVENTS_RELIABLE T_OFF
 	conf.netlink.events_reliable = 0;
 };
 
+netlink_event_thread : T_NETLINK_EVENT_THREAD T_ON
+{
+	conf.netlink.event_thread = 1;
+};
+
+netlink_event_thread : T_NETLINK_EVENT_THREAD T_OFF
+{
+	conf.netlink.event_thread = 0;
+};
+
+timer_wheel : T_TIMER_WHEEL T_ON
+{
+	conf.general.timer_wheel = 1;
+};
+
+timer_wheel : T_TIMER_WHEEL T_OFF
+{
+	conf.general.timer_wheel = 0;
+};
+
+io_engine : T_IO_ENGINE T_STRING
+{
+	if (strcasecmp($2, "epoll") == 0) {
+		conf.general.io_engine = IO_ENGINE_EPOLL;
+	} else if (strcasecmp($2, "uring") == 0) {
+		conf.general.io_engine = IO_ENGINE_URING;
+	} else {
+		print_err(CTD_CFG_ERROR, "unknown I/O engine `%s'", $2);
+		exit(EXIT_FAILURE);
+	}
+};
+
+worker_threads : T_WORKER_THREADS T_NUMBER
+{
+	if ($2 == 0 || $2 > WORKER_THREADS_MAX) {
+		print_err(CTD_CFG_ERROR, "`WorkerThreads' must be [1, %d]",
+			  WORKER_THREADS_MAX);
+		exit(EXIT_FAILURE);
+	}
+	conf.general.worker_threads = $2;
+};
+
+source_budget : T_SOURCE_BUDGET T_STRING T_NUMBER
+{
+	__add_source_budget($2, $3, 0);
+};
+
+source_budget : T_SOURCE_BUDGET T_STRING T_NUMBER T_NUMBER
+{
+	__add_source_budget($2, $3, $4);
+};
+
 nice : T_NICE T_SIGNED_NUMBER
 {
 	conf.nice = $2;
@@ -1840,6 +1982,57 @@ static void __max_dedicated_links_reached(void)
 	}
 }
 
+static void __add_source_budget(char *name, unsigned int calls,
+				unsigned int usecs)
+{
+	int i = conf.source_budget_num;
+
+	if (i >= CTD_SOURCE_BUDGET_MAX) {
+		print_err(CTD_CFG_ERROR, "too many `SourceBudget' clauses "
+					 "(Maximum: %d)", CTD_SOURCE_BUDGET_MAX);
+		exit(EXIT_FAILURE);
+	}
+	if (calls == 0 && usecs == 0) {
+		print_err(CTD_CFG_WARN, "`SourceBudget %s' without budget, "
+					"ignoring", name);
+		free(name);
+		return;
+	}
+	conf.source_budget[i].name = name;
+	conf.source_budget[i].calls = calls;
+	conf.source_budget[i].usecs = usecs;
+	conf.source_budget_num++;
+}
+
+static void __add_cache_index(char *name, unsigned int prefix4,
+			      unsigned int prefix6)
+{
+	int type = cache_index_type(name);
+
+	if (type == -1) {
+		print_err(CTD_CFG_ERROR, "unknown cache index `%s', use "
+					 "`mark', `zone' or `source'", name);
+		exit(EXIT_FAILURE);
+	}
+	if (type != CACHE_INDEX_SOURCE && (prefix4 || prefix6)) {
+		print_err(CTD_CFG_WARN, "prefix length only applies to "
+					"`CacheIndex source', ignoring");
+	}
+	if (type == CACHE_INDEX_SOURCE) {
+		if (prefix4 > 32 || prefix6 > 128) {
+			print_err(CTD_CFG_ERROR, "bad `CacheIndex source' "
+						 "prefix length");
+			exit(EXIT_FAILURE);
+		}
+		if (prefix4)
+			conf.general.cache_index_prefix4 = prefix4;
+		if (prefix6)
+			conf.general.cache_index_prefix6 = prefix6;
+	}
+	conf.general.cache_index |= (1 << type);
+	free(name);
+}
+
 int
 init_config(char *filename)
 {
@@ -1898,6 +2091,16 @@ init_config(char *filename)
 	if (CONFIG(general).commit_steps == 0)
 		CONFIG(general).commit_steps = 8192;
 
+	/* default to 2 threads to run flushes and dumps */
+	if (CONFIG(general).worker_threads == 0)
+		CONFIG(general).worker_threads = 2;
+
+	/* default to index sources by /24 and /64 prefixes */
+	if (CONFIG(general).cache_index_prefix4 == 0)
+		CONFIG(general).cache_index_prefix4 = 24;
+	if (CONFIG(general).cache_index_prefix6 == 0)
+		CONFIG(general).cache_index_prefix6 = 64;
+
 	/* if overrun, automatically resync with kernel after 30 seconds */
 	if (CONFIG(nl_overrun_resync) == 0)
 		CONFIG(nl_overrun_resync) = 30;
@@ -0,0 +1,112 @@
+/*
+ * (C) 2006-2012 by Pablo Neira Ayuso <pablo@netfilter.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "ring.h"
+
+#include <stdlib.h>
+#include <errno.h>
+
+struct ring *ring_create(unsigned int size, size_t elem_size)
+{
+	struct ring *r;
+	unsigned int n = 1;
+
+	/* round up to power of two, so we can use a mask. */
+	while (n < size)
+		n <<= 1;
+
+	if (posix_memalign((void **)&r, 64, sizeof(struct ring)) != 0)
+		return NULL;
+
+	r->data = calloc(n, elem_size);
+	if (r->data == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->size = n;
+	r->mask = n - 1;
+	r->elem_size = elem_size;
+	r->head = r->tail = 0;
+
+	return r;
+}
+
+void ring_destroy(struct ring *r)
+{
+	free(r->data);
+	free(r);
+}
+
+/* returns the slot to be filled by the producer, NULL if the ring is full */
+void *ring_write_slot(struct ring *r)
+{
+	unsigned int head = r->head;
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail >= r->size)
+		return NULL;
+
+	return r->data + (head & r->mask) * r->elem_size;
+}
+
+/*
+ * Publish the slot that we obtained via ring_write_slot(). This returns 1
+ * if the ring was empty, so the consumer may be sleeping and it has to
+ * be woken up. Otherwise, the consumer has not yet seen the previous
+ * element and it will also see this one.
+ */
+int ring_write_commit(struct ring *r)
+{
+	unsigned int head = r->head;
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	/* pairs with the barrier in ring_read_commit(). */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&r->tail, __ATOMIC_RELAXED) == head;
+}
+
+/* returns the next slot to be consumed, NULL if the ring is empty */
+void *ring_read_slot(struct ring *r)
+{
+	unsigned int tail = r->tail;
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	if (tail == head)
+		return NULL;
+
+	return r->data + (tail & r->mask) * r->elem_size;
+}
+
+/* release the slot that we obtained via ring_read_slot(). This returns 1
+ * if there are more elements to be consumed. */
+int ring_read_commit(struct ring *r)
+{
+	unsigned int tail = r->tail + 1;
+
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != tail;
+}
+
+unsigned int ring_depth(struct ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
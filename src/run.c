@@ -30,6 +30,7 @@
 #include "origin.h"
 #include "date.h"
 #include "internal.h"
+#include "event.h"
 
 #include <errno.h>
 #include <signal.h>
@@ -40,18 +41,23 @@
 #include <time.h>
 #include <fcntl.h>
 
+/* wakes up the main loop to shut down, see killer_signal(). */
+static struct evfd *killer_evfd;
+
 void killer(int signal)
 {
-	/* Signals are re-entrant, disable signal handling to avoid problems
-	 * in case we receive SIGINT and SIGTERM in a row. This function is
-	 * also called via -k from the unix socket context, we already disabled
-	 * signals in that path, so don't do it.
+	/* This is called from the main loop, either after SIGINT/SIGTERM
+	 * or via -k from the unix socket context. Disable signal handling,
+	 * a second signal has nothing to add while we are tearing down.
 	 */
 	if (signal)
 		sigprocmask(SIG_BLOCK, &STATE(block), NULL);
 
 	local_server_destroy(&STATE(local));
 
+	/* wait for running jobs, they may use the netlink handlers. */
+	worker_pool_destroy();
+
 	if (CONFIG(flags) & (CTD_SYNC_MODE | CTD_STATS_MODE))
 		ctnl_kill();
 
@@ -66,6 +72,20 @@ void killer(int signal)
 	exit(0);
 }
 
+/* The main thread may hold the worker pool lock or be in the middle of
+ * anything when the signal arrives, so the teardown is left to the main
+ * loop: write() is all we do from here. */
+static void killer_signal(int signal)
+{
+	write_evfd(killer_evfd);
+}
+
+static void killer_cb(void *data)
+{
+	read_evfd(killer_evfd);
+	killer(SIGTERM);
+}
+
 static void child(int foo)
 {
 	int status, ret;
@@ -79,9 +99,6 @@ static void child(int foo)
 			STATE(stats).wait_failed++;
 			break;
 		}
-		/* delete process from list and run the callback */
-		fork_process_delete(ret);
-
 		if (!WIFSIGNALED(status))
 			continue;
 
@@ -136,7 +153,7 @@ static void uptime(char *buf, size_t bufsiz)
 
 static void dump_stats_runtime(int fd)
 {
-	char buf[1024], uptime_string[512];
+	char buf[4096], uptime_string[512];
 	int size;
 
 	uptime(uptime_string, sizeof(uptime_string));
@@ -151,8 +168,12 @@ static void dump_stats_runtime(int fd)
 			"\tnetlink overrun:\t\t%12u\n"
 			"\tflush kernel table:\t\t%12u\n"
 			"\tresync with kernel table:\t%12u\n"
+			"\tlast table dump (in usecs):\t%20llu\n"
+			"\t\tentries unchanged:\t%12u\n"
+			"\t\tentries gone:\t\t%12u\n"
 			"\tcurrent buffer size (in bytes):\t%12u\n\n"
 			"runtime stats:\n"
+			"\ttime to ready (in usecs):\t%20llu\n"
 			"\tchild process failed:\t\t%12u\n"
 			"\t\tchild process segfault:\t%12u\n"
 			"\t\tchild process termsig:\t%12u\n"
@@ -169,7 +190,11 @@ static void dump_stats_runtime(int fd)
 			STATE(stats).nl_overrun,
 			STATE(stats).nl_kernel_table_flush,
 			STATE(stats).nl_kernel_table_resync,
+			(unsigned long long)STATE(stats).nl_dump_usecs,
+			STATE(stats).nl_dump_unchanged,
+			STATE(stats).nl_dump_stale,
 			CONFIG(netlink_buffer_size),
+			(unsigned long long)STATE(stats).ready_usecs,
 			STATE(stats).child_process_failed,
 			STATE(stats).child_process_error_segfault,
 			STATE(stats).child_process_error_term,
@@ -178,7 +203,82 @@ static void dump_stats_runtime(int fd)
 			STATE(stats).local_read_failed,
 			STATE(stats).local_unknown_request);
 
+	if (!(CONFIG(flags) & CTD_POLL)) {
+		uint64_t calls, msgs;
+		int i;
+
+		calls = __atomic_load_n(&STATE(stats).nl_recv_calls,
+					__ATOMIC_RELAXED);
+		msgs = __atomic_load_n(&STATE(stats).nl_recv_msgs,
+				       __ATOMIC_RELAXED);
+		size += snprintf(buf + size, sizeof(buf) - size,
+			"netlink event receive stats:\n"
+			"\tsyscalls:\t\t%20llu\n"
+			"\tevents:\t\t\t%20llu\n"
+			"\tevents per syscall:\t\t%12.2f\n"
+			"\tdatagrams per syscall:\t",
+			(unsigned long long)calls,
+			(unsigned long long)msgs,
+			calls ? (double)msgs / calls : 0.0);
+
+		/* slot i counts from 2^i to 2^(i+1) - 1 datagrams. */
+		for (i = 0; i < CTNL_RECV_HIST; i++) {
+			uint32_t n = __atomic_load_n(
+					&STATE(stats).nl_recv_batch[i],
+					__ATOMIC_RELAXED);
+
+			if (i == 0 || i == CTNL_RECV_HIST - 1)
+				size += snprintf(buf + size, sizeof(buf) - size,
+						 " %d:%u", 1 << i, n);
+			else
+				size += snprintf(buf + size, sizeof(buf) - size,
+						 " %d-%d:%u", 1 << i,
+						 (2 << i) - 1, n);
+		}
+		size += snprintf(buf + size, sizeof(buf) - size, "\n\n");
+	}
+
+	if (CONFIG(netlink).event_thread) {
+		size += snprintf(buf + size, sizeof(buf) - size,
+			"netlink event thread stats:\n"
+			"\tcurrent ring depth:\t\t%12u\n"
+			"\tmaximum ring depth:\t\t%12u\n"
+			"\tbatches:\t\t%20llu\n"
+			"\tstalls (ring full):\t\t%12u\n"
+			"\tstall time (in usecs):\t%20llu\n\n",
+			ctnl_reader_depth(),
+			STATE(stats).nl_ring_max_depth,
+			(unsigned long long)STATE(stats).nl_ring_batches,
+			__atomic_load_n(&STATE(stats).nl_ring_stalls,
+					__ATOMIC_RELAXED),
+			(unsigned long long)
+			__atomic_load_n(&STATE(stats).nl_ring_stall_usecs,
+					__ATOMIC_RELAXED));
+	}
+
+	if (uring_enabled()) {
+		struct uring_stats us;
+
+		uring_get_stats(&us);
+		size += snprintf(buf + size, sizeof(buf) - size,
+			"io_uring stats:\n"
+			"\tsyscalls:\t\t%20llu\n"
+			"\trequests submitted:\t%20llu\n"
+			"\trequests completed:\t%20llu\n"
+			"\tdatagrams sent:\t\t%20llu\n"
+			"\tdatagrams failed:\t%20llu\n"
+			"\tdatagrams not queued:\t%20llu\n\n",
+			(unsigned long long)us.enter,
+			(unsigned long long)us.submitted,
+			(unsigned long long)us.completed,
+			(unsigned long long)us.sends,
+			(unsigned long long)us.send_failed,
+			(unsigned long long)us.send_busy);
+	}
+
 	send(fd, buf, size, 0);
+
+	fds_stats(fd, STATE(fds));
 }
 
 static int local_handler(int fd, void *data)
@@ -198,7 +298,7 @@ static int local_handler(int fd, void *data)
 		dump_stats_runtime(fd);
 		break;
 	case STATS_PROCESS:
-		fork_process_dump(fd);
+		worker_job_dump(fd);
 		break;
 	}
 
@@ -220,13 +320,35 @@ static void local_cb(void *data)
 int
 init(void)
 {
-	do_gettimeofday();
+	uint64_t start = time_ns();
+
+	do_gettime();
+
+	if (CONFIG(general).timer_wheel &&
+	    alarm_set_type(ALARM_T_WHEEL) == -1) {
+		dlog(LOG_ERR, "can't create timer wheel");
+		return -1;
+	}
 
 	STATE(fds) = create_fds();
 	if (STATE(fds) == NULL) {
 		dlog(LOG_ERR, "can't create file descriptor pool");
 		return -1;
 	}
+	if (CONFIG(general).io_engine == IO_ENGINE_URING) {
+		if (fds_use_uring(STATE(fds)) == -1) {
+			dlog(LOG_WARNING, "can't use io_uring: %s, "
+			     "falling back to epoll", strerror(errno));
+		} else
+			dlog(LOG_NOTICE, "using io_uring I/O engine");
+	}
+
+	/* threads do not survive fork(), main() daemonizes before init(). */
+	if (worker_pool_create(CONFIG(general).worker_threads) == -1) {
+		dlog(LOG_ERR, "can't create worker threads: %s",
+		     strerror(errno));
+		return -1;
+	}
 
 	/* local UNIX socket */
 	if (local_server_create(&STATE(local), &CONFIG(local)) == -1) {
@@ -234,6 +356,15 @@ init(void)
 		return -1;
 	}
 	register_fd(STATE(local).fd, local_cb, NULL, STATE(fds));
+	fds_set_name(STATE(local).fd, "local", STATE(fds));
+
+	killer_evfd = create_evfd();
+	if (killer_evfd == NULL)
+		return -1;
+	register_fd(get_read_evfd(killer_evfd), killer_cb, NULL, STATE(fds));
+	fds_set_priority(get_read_evfd(killer_evfd), FDS_PRIO_HIGH,
+			 STATE(fds));
+	fds_set_name(get_read_evfd(killer_evfd), "signal", STATE(fds));
 
 	/* Signals handling */
 	sigemptyset(&STATE(block));
@@ -241,10 +372,10 @@ init(void)
 	sigaddset(&STATE(block), SIGINT);
 	sigaddset(&STATE(block), SIGCHLD);
 
-	if (signal(SIGINT, killer) == SIG_ERR)
+	if (signal(SIGINT, killer_signal) == SIG_ERR)
 		return -1;
 
-	if (signal(SIGTERM, killer) == SIG_ERR)
+	if (signal(SIGTERM, killer_signal) == SIG_ERR)
 		return -1;
 
 	/* ignore connection reset by peer */
@@ -265,8 +396,10 @@ init(void)
 	}
 
 	time(&STATE(stats).daemon_start_time);
+	STATE(stats).ready_usecs = (time_ns() - start) / 1000;
 
-	dlog(LOG_NOTICE, "initialization completed");
+	dlog(LOG_NOTICE, "initialization completed in %llu ms",
+	     (unsigned long long)STATE(stats).ready_usecs / 1000);
 
 	return 0;
 }
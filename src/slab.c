@@ -0,0 +1,165 @@
+/*
+ * (C) 2006-2012 by Pablo Neira Ayuso <pablo@netfilter.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "slab.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define SLAB_ALIGN	sizeof(void *)
+
+/* objects start at the first cacheline after the chunk header. */
+#define SLAB_HDR_SIZE	((sizeof(struct slab_chunk) + 63) & ~63)
+
+static inline struct slab_chunk *slab_chunk_of(const void *obj)
+{
+	return (struct slab_chunk *)
+		((unsigned long)obj & ~((unsigned long)SLAB_CHUNK_SIZE - 1));
+}
+
+static struct slab_chunk *slab_grow(struct slab *s)
+{
+	struct slab_chunk *chunk;
+	char *obj;
+	unsigned int i;
+
+	if (posix_memalign((void **)&chunk, SLAB_CHUNK_SIZE,
+			   SLAB_CHUNK_SIZE) != 0) {
+		s->stats.fail++;
+		errno = ENOMEM;
+		return NULL;
+	}
+	chunk->used = 0;
+	chunk->free = NULL;
+
+	/* link objects backwards, so they are handed out in address order. */
+	obj = (char *)chunk + SLAB_HDR_SIZE + (s->per_chunk - 1) * s->size;
+	for (i = 0; i < s->per_chunk; i++) {
+		*(void **)obj = chunk->free;
+		chunk->free = obj;
+		obj -= s->size;
+	}
+
+	list_add(&chunk->head, &s->partial);
+	s->chunks++;
+	s->empty++;
+	s->stats.grow++;
+
+	return chunk;
+}
+
+static void slab_release(struct slab *s, struct slab_chunk *chunk)
+{
+	list_del(&chunk->head);
+	s->chunks--;
+	s->empty--;
+	s->stats.shrink++;
+	free(chunk);
+}
+
+struct slab *slab_create(size_t size, unsigned int reserve)
+{
+	struct slab *s;
+
+	size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+	if (size < sizeof(void *) ||
+	    size > SLAB_CHUNK_SIZE - SLAB_HDR_SIZE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(struct slab));
+	if (s == NULL)
+		return NULL;
+
+	s->size = size;
+	s->per_chunk = (SLAB_CHUNK_SIZE - SLAB_HDR_SIZE) / size;
+	s->reserve = reserve;
+	INIT_LIST_HEAD(&s->partial);
+	INIT_LIST_HEAD(&s->full);
+
+	/* preallocate the reserve in bulk. */
+	while (slab_total(s) < reserve) {
+		if (slab_grow(s) == NULL) {
+			slab_destroy(s);
+			return NULL;
+		}
+	}
+	return s;
+}
+
+void slab_destroy(struct slab *s)
+{
+	struct slab_chunk *chunk, *tmp;
+
+	list_for_each_entry_safe(chunk, tmp, &s->partial, head)
+		free(chunk);
+	list_for_each_entry_safe(chunk, tmp, &s->full, head)
+		free(chunk);
+	free(s);
+}
+
+void *slab_alloc(struct slab *s)
+{
+	struct slab_chunk *chunk;
+	void *obj;
+
+	if (list_empty(&s->partial)) {
+		chunk = slab_grow(s);
+		if (chunk == NULL)
+			return NULL;
+	} else
+		chunk = list_entry(s->partial.next, struct slab_chunk, head);
+
+	obj = chunk->free;
+	chunk->free = *(void **)obj;
+	if (chunk->used++ == 0)
+		s->empty--;
+	if (chunk->free == NULL) {
+		list_del(&chunk->head);
+		list_add(&chunk->head, &s->full);
+	}
+	s->used++;
+	s->stats.alloc++;
+
+	return obj;
+}
+
+void slab_free(struct slab *s, void *obj)
+{
+	struct slab_chunk *chunk = slab_chunk_of(obj);
+
+	if (chunk->free == NULL) {
+		/* it was full, allocate from it again before new chunks */
+		list_del(&chunk->head);
+		list_add(&chunk->head, &s->partial);
+	}
+	*(void **)obj = chunk->free;
+	chunk->free = obj;
+	s->used--;
+	s->stats.free++;
+
+	if (--chunk->used == 0) {
+		s->empty++;
+		/* keep one empty chunk around to avoid thrashing. */
+		if (s->empty > 1 &&
+		    slab_total(s) - s->per_chunk >= s->reserve)
+			slab_release(s, chunk);
+	}
+}
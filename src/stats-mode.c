@@ -63,10 +63,16 @@ static int local_handler_stats(int fd, int type, void *data)
 
 	switch(type) {
 	case CT_DUMP_INTERNAL:
-		cache_dump(STATE_STATS(cache), fd, NFCT_O_PLAIN);
+		if (cache_dump_async(STATE_STATS(cache), fd, NFCT_O_PLAIN) == 0)
+			ret = LOCAL_RET_STOLEN;
+		else
+			cache_dump(STATE_STATS(cache), fd, NFCT_O_PLAIN);
 		break;
 	case CT_DUMP_INT_XML:
-		cache_dump(STATE_STATS(cache), fd, NFCT_O_XML);
+		if (cache_dump_async(STATE_STATS(cache), fd, NFCT_O_XML) == 0)
+			ret = LOCAL_RET_STOLEN;
+		else
+			cache_dump(STATE_STATS(cache), fd, NFCT_O_XML);
 		break;
 	case CT_FLUSH_CACHE:
 	case CT_FLUSH_INT_CACHE:
@@ -123,36 +129,54 @@ static int stats_resync(enum nf_conntrack_msg_type type,
 	return NFCT_CB_CONTINUE;
 }
 
+static void stats_populate_start(void)
+{
+	cache_generation_next(STATE_STATS(cache));
+}
+
+/* this entry is in the kernel table that we are dumping to purge. */
+static void stats_seen(struct nf_conntrack *ct)
+{
+	struct cache_object *obj;
+	int id;
+
+	obj = cache_find(STATE_STATS(cache), ct, &id);
+	if (obj != NULL)
+		cache_object_seen(obj);
+}
+
+static void stats_prefetch(const struct cache_key *key)
+{
+	cache_prefetch_key(STATE_STATS(cache), key);
+}
+
 static int purge_step(void *data1, void *data2)
 {
 	struct cache_object *obj = data2;
 
-	STATE(get_retval) = 0;
-	nl_get_conntrack(STATE(get), obj->ptr); /* modifies STATE(get_retval) */
-	if (!STATE(get_retval)) {
-		cache_del(STATE_STATS(cache), obj);
-		dlog_ct(STATE(stats_log), obj->ptr, NFCT_O_PLAIN);
-		cache_object_free(obj);
-	}
+	cache_del(STATE_STATS(cache), obj);
+	dlog_ct(STATE(stats_log), obj->ptr, NFCT_O_PLAIN);
+	cache_object_free(obj);
 
 	return 0;
 }
 
 static void stats_purge(void)
 {
-	cache_iterate(STATE_STATS(cache), NULL, purge_step);
+	cache_sweep(STATE_STATS(cache), purge_step);
 }
 
-static void stats_event_new(struct nf_conntrack *ct, int origin)
+static void
+stats_event_new(struct nf_conntrack *ct, const struct cache_key *key, int origin)
 {
 	int id;
 	struct cache_object *obj;
 
 	nfct_attr_unset(ct, ATTR_TIMEOUT);
 
-	obj = cache_find(STATE_STATS(cache), ct, &id);
+	obj = cache_find_key(STATE_STATS(cache), key, &id);
 	if (obj == NULL) {
-		obj = cache_object_new(STATE_STATS(cache), ct);
+		obj = cache_object_new_key(STATE_STATS(cache), ct, key);
 		if (obj == NULL)
 			return;
 
@@ -164,20 +188,22 @@ static void stats_event_new(struct nf_conntrack *ct, int origin)
 	return;
 }
 
-static void stats_event_upd(struct nf_conntrack *ct, int origin)
+static void
+stats_event_upd(struct nf_conntrack *ct, const struct cache_key *key, int origin)
 {
 	nfct_attr_unset(ct, ATTR_TIMEOUT);
-	cache_update_force(STATE_STATS(cache), ct);
+	cache_update_force_key(STATE_STATS(cache), ct, key);
 }
 
-static int stats_event_del(struct nf_conntrack *ct, int origin)
+static int
+stats_event_del(struct nf_conntrack *ct, const struct cache_key *key, int origin)
 {
 	int id;
 	struct cache_object *obj;
 
 	nfct_attr_unset(ct, ATTR_TIMEOUT);
 
-	obj = cache_find(STATE_STATS(cache), ct, &id);
+	obj = cache_find_key(STATE_STATS(cache), key, &id);
 	if (obj) {
 		cache_del(STATE_STATS(cache), obj);
 		dlog_ct(STATE(stats_log), ct, NFCT_O_PLAIN);
@@ -191,7 +217,10 @@ static struct internal_handler internal_cache_stats = {
 	.flags			= INTERNAL_F_POPULATE | INTERNAL_F_RESYNC,
 	.ct = {
 		.populate		= stats_populate,
+		.populate_start		= stats_populate_start,
 		.resync			= stats_resync,
+		.seen			= stats_seen,
+		.prefetch_key		= stats_prefetch,
 		.purge			= stats_purge,
 		.new			= stats_event_new,
 		.upd			= stats_event_upd,
@@ -59,6 +59,15 @@ struct cache_ftfw {
 	uint32_t 		seq;
 };
 
+/*
+ * Destroyed conntracks are not kept in the cache until the deletion is
+ * acknowledged, we queue a tombstone instead and release the object.
+ */
+struct ftfw_tombstone {
+	struct cache_key	key;
+	uint32_t		seq;
+};
+
 static void cache_ftfw_add(struct cache_object *obj, void *data)
 {
 	struct cache_ftfw *cn = data;
@@ -201,6 +210,11 @@ static int rs_queue_dump(struct queue_node *n, const void *data2)
 			size = sprintf(buf, "object -> seq:%u\n", cn->seq);
 		break;
 		}
+		case Q_ELEM_DEL: {
+			struct ftfw_tombstone *t = queue_node_data(n);
+			size = sprintf(buf, "tombstone -> seq:%u\n", t->seq);
+			break;
+		}
 		default:
 			return 0;
 	}
@@ -277,6 +291,18 @@ static int rs_queue_to_tx(struct queue_node *n, const void *data)
 		queue_add(STATE_SYNC(tx_queue), n);
 		break;
 	}
+	case Q_ELEM_DEL: {
+		struct ftfw_tombstone *t = queue_node_data(n);
+
+		if (before(t->seq, nack->from))
+			return 0;
+		else if (after(t->seq, nack->to))
+			return 1;
+
+		queue_del(n);
+		queue_add(STATE_SYNC(tx_queue), n);
+		break;
+	}
 	}
 	return 0;
 }
@@ -323,6 +349,19 @@ static int rs_queue_empty(struct queue_node *n, const void *data)
 		cache_object_put(cn->obj);
 		break;
 	}
+	case Q_ELEM_DEL: {
+		struct ftfw_tombstone *t = queue_node_data(n);
+
+		if (h != NULL) {
+			if (before(t->seq, h->from))
+				return 0;
+			else if (after(t->seq, h->to))
+				return 1;
+		}
+		queue_del(n);
+		queue_object_free((struct queue_object *)n);
+		break;
+	}
 	}
 	return 0;
 }
@@ -462,7 +501,8 @@ static void rs_queue_purge_full(void)
 
 	n = queue_del_head(rs_queue);
 	switch(n->type) {
-	case Q_ELEM_CTL: {
+	case Q_ELEM_CTL:
+	case Q_ELEM_DEL: {
 		struct queue_object *qobj = (struct queue_object *)n;
 		queue_object_free(qobj);
 		break;
@@ -535,6 +575,27 @@ static int tx_queue_xmit(struct queue_node *n, const void *data)
 		/* we release the object once we get the acknowlegment */
 		break;
 	}
+	case Q_ELEM_DEL: {
+		struct ftfw_tombstone *t = queue_node_data(n);
+		struct nethdr *net;
+
+		net = cache_ct_key_build_msg(&t->key, NET_T_STATE_CT_DEL);
+		if (net == NULL) {
+			queue_object_free((struct queue_object *)n);
+			break;
+		}
+		nethdr_set_hello(net);
+
+		multichannel_send(STATE_SYNC(channel), net);
+		t->seq = ntohl(net->seq);
+		if (queue_add(rs_queue, n) < 0) {
+			if (errno == ENOSPC) {
+				rs_queue_purge_full();
+				queue_add(rs_queue, n);
+			}
+		}
+		break;
+	}
 	}
 
 	return 0;
@@ -548,9 +609,39 @@ static void ftfw_xmit(void)
 		queue_len(tx_queue), queue_len(rs_queue));
 }
 
+static int ftfw_enqueue_tombstone(struct cache_object *obj)
+{
+	struct cache_ftfw *cn = cache_get_extra(obj);
+	struct queue_object *qobj;
+	struct ftfw_tombstone *t;
+
+	qobj = queue_object_new(Q_ELEM_DEL, sizeof(struct ftfw_tombstone));
+	if (qobj == NULL)
+		return -1;
+
+	t = (struct ftfw_tombstone *)qobj->data;
+	t->key = obj->key;
+	if (queue_add(STATE_SYNC(tx_queue), &qobj->qnode) < 0) {
+		queue_object_free(qobj);
+		return -1;
+	}
+
+	/* the deletion supersedes what we had to send for this object. */
+	if (queue_del(&cn->qnode))
+		cache_object_put(obj);
+
+	return 0;
+}
+
 static void ftfw_enqueue(struct cache_object *obj, int type)
 {
 	struct cache_ftfw *cn = cache_get_extra(obj);
+
+	/* if we cannot leave a tombstone, the object stays until the
+	 * deletion is acknowledged. */
+	if (type == NET_T_STATE_CT_DEL && ftfw_enqueue_tombstone(obj) == 0)
+		return;
+
 	if (queue_in(rs_queue, &cn->qnode)) {
 		queue_del(&cn->qnode);
 		queue_add(STATE_SYNC(tx_queue), &cn->qnode);
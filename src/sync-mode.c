@@ -246,20 +246,34 @@ static int channel_handler_routine(struct channel *m)
 		ptr += net->len;
 		remain -= net->len;
 	}
+	if (STATE_SYNC(external)->batch_end)
+		STATE_SYNC(external)->batch_end();
+
 	return 0;
 }
 
 /* handler for messages received */
+/* the main loop invokes this up to EventIterationsLimit times per wake-up,
+ * see channel_register_fd(). */
 static void channel_handler(void *data)
 {
 	struct channel *c = data;
-	int k;
 
-	for (k=0; k<CONFIG(event_iterations_limit); k++) {
-		if (channel_handler_routine(c) == -1) {
-			break;
-		}
-	}
+	if (channel_handler_routine(c) == -1)
+		fds_drained();
+}
+
+static int channel_register_fd(int fd, void (*cb)(void *data),
+			       struct channel *c)
+{
+	if (register_fd(fd, cb, c, STATE(fds)) == -1)
+		return -1;
+
+	if (cb == channel_handler)
+		fds_set_budget(fd, CONFIG(event_iterations_limit), STATE(fds));
+
+	fds_set_name(fd, "channel", STATE(fds));
+	return 0;
 }
 
 /* select a new interface candidate in a round robin basis */
@@ -296,17 +310,25 @@ static void interface_handler(void *data)
 		interface_candidate();
 }
 
+static void reset_cache_run(void *data)
+{
+	nl_flush_conntrack_table_selective(STATE(flush_job));
+}
+
 static void do_reset_cache_alarm(struct alarm_block *a, void *data)
 {
 	STATE(stats).nl_kernel_table_flush++;
 	dlog(LOG_NOTICE, "flushing kernel conntrack table (scheduled)");
 
-	/* fork a child process that performs the flush operation,
-	 * meanwhile the parent process handles events. */
-	if (fork_process_new(CTD_PROC_FLUSH, CTD_PROC_F_EXCL,
-			     NULL, NULL) == 0) {
-		nl_flush_conntrack_table_selective();
-		exit(EXIT_SUCCESS);
+	/* a worker thread performs the flush operation, meanwhile the
+	 * main loop handles events. */
+	if (worker_job_new(CTD_PROC_FLUSH, CTD_PROC_F_EXCL,
+			   reset_cache_run, NULL, NULL) == -1) {
+		dlog(LOG_ERR, "can't flush kernel conntrack table: %s",
+		     strerror(errno));
+	} else if (STATE(mode)->internal == &internal_bypass) {
+		/* the bypass flush is the one that the job does. */
+		return;
 	}
 	/* this is not required if events don't get lost */
 	STATE(mode)->internal->ct.flush();
@@ -348,11 +370,15 @@ static void channel_accept_cb(void *data)
 	if (fd < 0)
 		return;
 
-	register_fd(fd, channel_handler, c, STATE(fds));
+	channel_register_fd(fd, channel_handler, c);
 }
 
 static void tx_queue_cb(void *data)
 {
+	if (queue_ack_eventfd(STATE_SYNC(tx_queue)) == 0) {
+		fds_drained();
+		return;
+	}
 	STATE_SYNC(sync)->xmit();
 
 	/* flush pending messages */
@@ -391,7 +417,9 @@ static int init_sync(void)
 	} else {
 		STATE(mode)->internal = &internal_bypass;
 		dlog(LOG_NOTICE, "disabling internal cache");
-
+		if (CONFIG(sync).internal_file[0])
+			dlog(LOG_WARNING, "no internal cache, ignoring "
+			     "`CacheFile Internal'");
 	}
 	if (STATE(mode)->internal->init() == -1)
 		return -1;
@@ -401,6 +429,9 @@ static int init_sync(void)
 	} else {
 		STATE_SYNC(external) = &external_inject;
 		dlog(LOG_NOTICE, "disabling external cache");
+		if (CONFIG(sync).external_file[0])
+			dlog(LOG_WARNING, "no external cache, ignoring "
+			     "`CacheFile External'");
 	}
 	if (STATE_SYNC(external)->init() == -1)
 		return -1;
@@ -421,14 +452,12 @@ static int init_sync(void)
 
 		switch(channel_type(STATE_SYNC(channel)->channel[i])) {
 		case CHANNEL_T_STREAM:
-			register_fd(fd, channel_accept_cb,
-					STATE_SYNC(channel)->channel[i],
-					STATE(fds));
+			channel_register_fd(fd, channel_accept_cb,
+					STATE_SYNC(channel)->channel[i]);
 			break;
 		case CHANNEL_T_DATAGRAM:
-			register_fd(fd, channel_handler,
-					STATE_SYNC(channel)->channel[i],
-					STATE(fds));
+			channel_register_fd(fd, channel_handler,
+					STATE_SYNC(channel)->channel[i]);
 			break;
 		}
 	}
@@ -441,6 +470,7 @@ static int init_sync(void)
 	if (register_fd(nlif_fd(STATE_SYNC(interface)),
 			interface_handler, NULL, STATE(fds)) == -1)
 		return -1;
+	fds_set_name(nlif_fd(STATE_SYNC(interface)), "interface", STATE(fds));
 
 	STATE_SYNC(tx_queue) = queue_create("txqueue", INT_MAX, QUEUE_F_EVFD);
 	if (STATE_SYNC(tx_queue) == NULL) {
@@ -450,6 +480,8 @@ static int init_sync(void)
 	if (register_fd(queue_get_eventfd(STATE_SYNC(tx_queue)),
 			tx_queue_cb, NULL, STATE(fds)) == -1)
 		return -1;
+	fds_set_name(queue_get_eventfd(STATE_SYNC(tx_queue)), "txqueue",
+		     STATE(fds));
 
 	STATE_SYNC(commit).h = nfct_open(CONFIG(netlink).subsys_id, 0);
 	if (STATE_SYNC(commit).h == NULL) {
@@ -458,6 +490,12 @@ static int init_sync(void)
 	}
 	origin_register(STATE_SYNC(commit).h, CTD_ORIGIN_COMMIT);
 
+	STATE_SYNC(commit).batch = nl_batch_create(STATE_SYNC(commit).h);
+	if (STATE_SYNC(commit).batch == NULL) {
+		dlog(LOG_ERR, "can't create batch to commit");
+		return -1;
+	}
+
 	STATE_SYNC(commit).evfd = create_evfd();
 	if (STATE_SYNC(commit).evfd == NULL) {
 		dlog(LOG_ERR, "can't create eventfd to commit");
@@ -467,6 +505,8 @@ static int init_sync(void)
 				commit_cb, NULL, STATE(fds)) == -1) {
 		return -1;
 	}
+	fds_set_name(get_read_evfd(STATE_SYNC(commit).evfd), "commit",
+		     STATE(fds));
 	STATE_SYNC(commit).clientfd = -1;
 
 	init_alarm(&STATE_SYNC(reset_cache_alarm), NULL, do_reset_cache_alarm);
@@ -491,6 +531,7 @@ static void kill_sync(void)
 	channel_end();
 
 	origin_unregister(STATE_SYNC(commit).h);
+	nl_batch_destroy(STATE_SYNC(commit).batch);
 	nfct_close(STATE_SYNC(commit).h);
 	destroy_evfd(STATE_SYNC(commit).evfd);
 
@@ -509,6 +550,19 @@ static void dump_stats_sync(int fd)
 			(unsigned long long)STATE_SYNC(error).msg_rcv_malformed,
 			(unsigned long long)STATE_SYNC(error).msg_rcv_lost);
 
+	if (STATE_SYNC(commit).stats.last_usecs) {
+		uint64_t usecs = STATE_SYNC(commit).stats.last_usecs;
+
+		size += sprintf(buf+size, "last commit:\n"
+				"%20u Entries %20llu ms "
+				"%20llu Entries/s\n\n",
+				STATE_SYNC(commit).stats.last_ok,
+				(unsigned long long)usecs / 1000,
+				(unsigned long long)
+				STATE_SYNC(commit).stats.last_ok * 1000000 /
+				usecs);
+	}
+
 	send(fd, buf, size, 0);
 }
 
@@ -568,6 +622,121 @@ static int local_commit(int fd)
 	return ret;
 }
 
+struct local_dump {
+	int		fd;
+	int		type;
+	void		(*dump)(int fd, int type);
+};
+
+static void local_dump_run(void *data)
+{
+	struct local_dump *d = data;
+
+	d->dump(d->fd, d->type);
+}
+
+static void local_dump_done(void *data)
+{
+	struct local_dump *d = data;
+
+	close(d->fd);
+	free(d);
+}
+
+/*
+ * Caches are not thread-safe, they are dumped from a snapshot that is
+ * written from the main loop as the client reads it, see cache_dump_async().
+ * Other handlers (eg. no internal cache) dump the kernel table through
+ * their own netlink socket, we do this from a worker thread.
+ */
+static int local_dump(int fd, int type, void (*dump)(int fd, int type),
+		      int (*dump_async)(int fd, int type))
+{
+	struct local_dump *d;
+
+	if (dump_async) {
+		if (dump_async(fd, type) == 0)
+			return LOCAL_RET_STOLEN;
+
+		/* out of memory, fall back to the blocking dump. */
+		dump(fd, type);
+		return LOCAL_RET_OK;
+	}
+
+	d = calloc(1, sizeof(struct local_dump));
+	if (d == NULL)
+		return LOCAL_RET_OK;
+
+	d->fd = fd;
+	d->type = type;
+	d->dump = dump;
+
+	if (worker_job_new(CTD_PROC_DUMP, 0, local_dump_run,
+			   local_dump_done, d) == -1) {
+		free(d);
+		return LOCAL_RET_OK;
+	}
+	/* the client is closed once the dump has finished. */
+	return LOCAL_RET_STOLEN;
+}
+
+/* dump or flush the entries that match an index key */
+static int local_index(int fd, int type)
+{
+	struct cache_index_query q;
+	const char *name;
+	char buf[128];
+	int ret = -1, size;
+
+	if (read(fd, &q, sizeof(q)) != sizeof(q)) {
+		STATE(stats).local_read_failed++;
+		return LOCAL_RET_OK;
+	}
+	name = cache_index_name(q.type);
+
+	switch(type) {
+	case CT_DUMP_INT_INDEX:
+		if (STATE(mode)->internal->ct.dump_index)
+			ret = STATE(mode)->internal->ct.dump_index(fd,
+							NFCT_O_PLAIN, &q);
+		break;
+	case CT_DUMP_EXT_INDEX:
+		if (STATE_SYNC(external)->ct.dump_index)
+			ret = STATE_SYNC(external)->ct.dump_index(fd,
+							NFCT_O_PLAIN, &q);
+		break;
+	case CT_FLUSH_INT_INDEX:
+		if (STATE(mode)->internal->ct.flush_index) {
+			ret = STATE(mode)->internal->ct.flush_index(&q);
+			if (ret >= 0)
+				dlog(LOG_NOTICE, "flushed %d entries by %s "
+				     "from internal cache", ret, name);
+		}
+		break;
+	case CT_FLUSH_EXT_INDEX:
+		/* if we're still committing, abort this command */
+		if (STATE_SYNC(commit).clientfd != -1) {
+			dlog(LOG_ERR, "ignoring flush command, "
+				      "commit still in progress");
+			return LOCAL_RET_OK;
+		}
+		if (STATE_SYNC(external)->ct.flush_index) {
+			ret = STATE_SYNC(external)->ct.flush_index(&q);
+			if (ret >= 0)
+				dlog(LOG_NOTICE, "flushed %d entries by %s "
+				     "from external cache", ret, name);
+		}
+		break;
+	}
+	if (ret == -1) {
+		size = snprintf(buf, sizeof(buf),
+				"no index by %s in this cache, see "
+				"CacheIndex in conntrackd.conf\n", name);
+		send(fd, buf, size, 0);
+	}
+	return LOCAL_RET_OK;
+}
+
 /* handler for requests coming via UNIX socket */
 static int local_handler_sync(int fd, int type, void *data)
 {
@@ -575,28 +744,20 @@ static int local_handler_sync(int fd, int type, void *data)
 
 	switch(type) {
 	case CT_DUMP_INTERNAL:
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE(mode)->internal->ct.dump(fd, NFCT_O_PLAIN);
-			exit(EXIT_SUCCESS);
-		}
+		ret = local_dump(fd, NFCT_O_PLAIN, STATE(mode)->internal->ct.dump,
+				 STATE(mode)->internal->ct.dump_async);
 		break;
 	case CT_DUMP_EXTERNAL:
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE_SYNC(external)->ct.dump(fd, NFCT_O_PLAIN);
-			exit(EXIT_SUCCESS);
-		} 
+		ret = local_dump(fd, NFCT_O_PLAIN, STATE_SYNC(external)->ct.dump,
+				 STATE_SYNC(external)->ct.dump_async);
 		break;
 	case CT_DUMP_INT_XML:
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE(mode)->internal->ct.dump(fd, NFCT_O_XML);
-			exit(EXIT_SUCCESS);
-		}
+		ret = local_dump(fd, NFCT_O_XML, STATE(mode)->internal->ct.dump,
+				 STATE(mode)->internal->ct.dump_async);
 		break;
 	case CT_DUMP_EXT_XML:
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE_SYNC(external)->ct.dump(fd, NFCT_O_XML);
-			exit(EXIT_SUCCESS);
-		}
+		ret = local_dump(fd, NFCT_O_XML, STATE_SYNC(external)->ct.dump,
+				 STATE_SYNC(external)->ct.dump_async);
 		break;
 	case CT_COMMIT:
 		dlog(LOG_NOTICE, "committing conntrack cache");
@@ -641,6 +802,12 @@ static int local_handler_sync(int fd, int type, void *data)
 		dlog(LOG_NOTICE, "flushing external cache");
 		STATE_SYNC(external)->ct.flush();
 		break;
+	case CT_DUMP_INT_INDEX:
+	case CT_DUMP_EXT_INDEX:
+	case CT_FLUSH_INT_INDEX:
+	case CT_FLUSH_EXT_INDEX:
+		ret = local_index(fd, type);
+		break;
 	case STATS:
 		STATE(mode)->internal->ct.stats(fd);
 		STATE_SYNC(external)->ct.stats(fd);
@@ -677,19 +844,15 @@ static int local_handler_sync(int fd, int type, void *data)
 		if (!(CONFIG(flags) & CTD_EXPECT))
 			break;
 
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE(mode)->internal->exp.dump(fd, NFCT_O_PLAIN);
-			exit(EXIT_SUCCESS);
-		}
+		ret = local_dump(fd, NFCT_O_PLAIN, STATE(mode)->internal->exp.dump,
+				 STATE(mode)->internal->exp.dump_async);
 		break;
 	case EXP_DUMP_EXTERNAL:
 		if (!(CONFIG(flags) & CTD_EXPECT))
 			break;
 
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE_SYNC(external)->exp.dump(fd, NFCT_O_PLAIN);
-			exit(EXIT_SUCCESS);
-		}
+		ret = local_dump(fd, NFCT_O_PLAIN, STATE_SYNC(external)->exp.dump,
+				 STATE_SYNC(external)->exp.dump_async);
 		break;
 	case EXP_COMMIT:
 		if (!(CONFIG(flags) & CTD_EXPECT))
@@ -727,16 +890,12 @@ static int local_handler_sync(int fd, int type, void *data)
 		ret = local_commit(fd);
 		break;
 	case EXP_DUMP_INT_XML:
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE(mode)->internal->exp.dump(fd, NFCT_O_XML);
-			exit(EXIT_SUCCESS);
-		}
+		ret = local_dump(fd, NFCT_O_XML, STATE(mode)->internal->exp.dump,
+				 STATE(mode)->internal->exp.dump_async);
 		break;
 	case EXP_DUMP_EXT_XML:
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE_SYNC(external)->exp.dump(fd, NFCT_O_XML);
-			exit(EXIT_SUCCESS);
-		}
+		ret = local_dump(fd, NFCT_O_XML, STATE_SYNC(external)->exp.dump,
+				 STATE_SYNC(external)->exp.dump_async);
 		break;
 	default:
 		if (STATE_SYNC(sync)->local)
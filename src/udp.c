@@ -8,6 +8,7 @@
  */
 
 #include "udp.h"
+#include "uring.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -161,14 +162,37 @@ struct udp_sock *udp_client_create(struct udp_conf *conf)
 
 void udp_client_destroy(struct udp_sock *m)
 {
+	/* pending sends refer to this socket. */
+	uring_flush(m);
 	close(m->fd);
 	free(m);
 }
 
+static void udp_send_done(void *data, ssize_t ret)
+{
+	struct udp_sock *m = data;
+
+	if (ret == -1) {
+		m->stats.error++;
+		return;
+	}
+	m->stats.bytes += ret;
+	m->stats.messages++;
+}
+
 ssize_t udp_send(struct udp_sock *m, const void *data, int size)
 {
 	ssize_t ret;
-	
+
+	/* batched with other sends, stats are updated on completion. */
+	if (uring_enabled()) {
+		ret = uring_sendto(m->fd, data, size,
+				   (struct sockaddr *) &m->addr,
+				   m->sockaddr_len, udp_send_done, m);
+		if (ret != -1)
+			return ret;
+	}
+
 	ret = sendto(m->fd, 
 		     data,
 		     size,
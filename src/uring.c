@@ -0,0 +1,544 @@
+/*
+ * (C) 2006-2012 by Pablo Neira Ayuso <pablo@netfilter.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Minimal io_uring I/O engine: readiness notification for the registered
+ * descriptors and batched datagram sends. Requests are queued in the
+ * submission ring and they are passed to the kernel together with the
+ * wait for completions, so that is one single syscall per iteration of
+ * the main loop.
+ */
+
+#include "uring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static struct {
+	int			fd;
+	int			enabled;
+	unsigned int		to_submit;
+	unsigned int		sends_inflight;
+
+	struct {
+		unsigned int	*khead;
+		unsigned int	*ktail;
+		unsigned int	*array;
+		unsigned int	mask;
+		unsigned int	entries;
+		unsigned int	tail;
+		struct io_uring_sqe *sqes;
+	} sq;
+
+	struct {
+		unsigned int	*khead;
+		unsigned int	*ktail;
+		unsigned int	mask;
+		struct io_uring_cqe *cqes;
+	} cq;
+
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+
+	struct uring_stats	stats;
+} uring = {
+	.fd	= -1,
+};
+
+/* a datagram waiting to be sent by the kernel. */
+struct uring_send {
+	struct uring_req	req;
+	struct msghdr		msg;
+	struct iovec		iov;
+	struct sockaddr_storage	addr;
+	void			(*done)(void *data, ssize_t res);
+	void			*data;
+	int			inflight;
+	char			buf[URING_SEND_BUFSIZ];
+};
+
+/* preallocated sends, so the send path does not allocate. */
+static struct uring_send *send_pool;
+static struct uring_send *send_free[URING_SEND_MAX];
+static unsigned int send_free_num;
+
+static int uring_enter(unsigned int to_submit, unsigned int min_complete,
+		       unsigned int flags, void *arg, size_t argsz)
+{
+	uring.stats.enter++;
+	return syscall(__NR_io_uring_enter, uring.fd, to_submit,
+		       min_complete, flags, arg, argsz);
+}
+
+static void uring_publish(void)
+{
+	__atomic_store_n(uring.sq.ktail, uring.sq.tail, __ATOMIC_RELEASE);
+}
+
+static int uring_submit(void)
+{
+	int ret;
+
+	if (uring.to_submit == 0)
+		return 0;
+
+	uring_publish();
+	ret = uring_enter(uring.to_submit, 0, 0, NULL, 0);
+	if (ret > 0) {
+		uring.to_submit -= ret;
+		uring.stats.submitted += ret;
+	}
+	return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, idx;
+
+	head = __atomic_load_n(uring.sq.khead, __ATOMIC_ACQUIRE);
+	if (uring.sq.tail - head >= uring.sq.entries) {
+		/* submission ring is full, pass it to the kernel now. */
+		if (uring_submit() <= 0)
+			return NULL;
+		head = __atomic_load_n(uring.sq.khead, __ATOMIC_ACQUIRE);
+		if (uring.sq.tail - head >= uring.sq.entries)
+			return NULL;
+	}
+	idx = uring.sq.tail & uring.sq.mask;
+	sqe = &uring.sq.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	uring.sq.array[idx] = idx;
+	uring.sq.tail++;
+	uring.to_submit++;
+
+	return sqe;
+}
+
+int uring_init(unsigned int entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	uring.fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (uring.fd == -1)
+		return -1;
+
+	/* we need to wait with timeout and no dropped completions. */
+	if (!(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_NODROP)) {
+		close(uring.fd);
+		uring.fd = -1;
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	uring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring.cq_ring_size = p.cq_off.cqes +
+			     p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring.cq_ring_size > uring.sq_ring_size)
+			uring.sq_ring_size = uring.cq_ring_size;
+		uring.cq_ring_size = 0;
+	}
+
+	uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ|PROT_WRITE,
+			     MAP_SHARED|MAP_POPULATE, uring.fd,
+			     IORING_OFF_SQ_RING);
+	if (uring.sq_ring == MAP_FAILED)
+		goto err_close;
+
+	if (uring.cq_ring_size) {
+		uring.cq_ring = mmap(NULL, uring.cq_ring_size,
+				     PROT_READ|PROT_WRITE,
+				     MAP_SHARED|MAP_POPULATE, uring.fd,
+				     IORING_OFF_CQ_RING);
+		if (uring.cq_ring == MAP_FAILED)
+			goto err_unmap_sq;
+	} else
+		uring.cq_ring = uring.sq_ring;
+
+	uring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sq.sqes = mmap(NULL, uring.sqes_size, PROT_READ|PROT_WRITE,
+			     MAP_SHARED|MAP_POPULATE, uring.fd,
+			     IORING_OFF_SQES);
+	if (uring.sq.sqes == MAP_FAILED)
+		goto err_unmap_cq;
+
+	sq = uring.sq_ring;
+	uring.sq.khead = (unsigned int *)(sq + p.sq_off.head);
+	uring.sq.ktail = (unsigned int *)(sq + p.sq_off.tail);
+	uring.sq.array = (unsigned int *)(sq + p.sq_off.array);
+	uring.sq.mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	uring.sq.entries = *(unsigned int *)(sq + p.sq_off.ring_entries);
+	uring.sq.tail = *uring.sq.ktail;
+
+	cq = uring.cq_ring;
+	uring.cq.khead = (unsigned int *)(cq + p.cq_off.head);
+	uring.cq.ktail = (unsigned int *)(cq + p.cq_off.tail);
+	uring.cq.mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	uring.cq.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	send_pool = calloc(URING_SEND_MAX, sizeof(struct uring_send));
+	if (send_pool == NULL)
+		goto err_unmap_sqes;
+	for (send_free_num = 0; send_free_num < URING_SEND_MAX; send_free_num++)
+		send_free[send_free_num] = &send_pool[send_free_num];
+
+	uring.enabled = 1;
+
+	return 0;
+
+err_unmap_sqes:
+	munmap(uring.sq.sqes, uring.sqes_size);
+err_unmap_cq:
+	if (uring.cq_ring != uring.sq_ring)
+		munmap(uring.cq_ring, uring.cq_ring_size);
+err_unmap_sq:
+	munmap(uring.sq_ring, uring.sq_ring_size);
+err_close:
+	close(uring.fd);
+	uring.fd = -1;
+	return -1;
+}
+
+void uring_fini(void)
+{
+	if (uring.fd == -1)
+		return;
+
+	uring_flush(NULL);
+	/* the kernel may still read the buffers of detached sends. */
+	if (uring.sends_inflight == 0) {
+		free(send_pool);
+		send_pool = NULL;
+	}
+	munmap(uring.sq.sqes, uring.sqes_size);
+	if (uring.cq_ring != uring.sq_ring)
+		munmap(uring.cq_ring, uring.cq_ring_size);
+	munmap(uring.sq_ring, uring.sq_ring_size);
+	close(uring.fd);
+	uring.fd = -1;
+	uring.enabled = 0;
+}
+
+int uring_enabled(void)
+{
+	return uring.enabled;
+}
+
+/* one-shot poll, the caller re-arms it once it has handled the data. */
+int uring_poll_add(int fd, uint32_t events, struct uring_req *req)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe();
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->user_data = (uint64_t)(uintptr_t)req;
+
+	return 0;
+}
+
+/* the poll request completes with -ECANCELED, if it is still armed. */
+int uring_poll_remove(struct uring_req *req)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe();
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)req;
+	sqe->user_data = 0;
+
+	return 0;
+}
+
+static void uring_send_complete(struct uring_req *req, int res)
+{
+	struct uring_send *s = (struct uring_send *)req;
+
+	uring.sends_inflight--;
+	s->inflight = 0;
+	if (res < 0)
+		uring.stats.send_failed++;
+	if (s->done)
+		s->done(s->data, res < 0 ? -1 : res);
+	send_free[send_free_num++] = s;
+}
+
+/*
+ * Enqueue a datagram, the data is copied so the caller can reuse its
+ * buffer. The result is reported via done() once the kernel is done
+ * with it, so this always returns the size that we were passed. If the
+ * datagram is too big or all the sends are in flight, this fails and
+ * the caller has to send it by itself.
+ */
+ssize_t uring_sendto(int fd, const void *data, size_t size,
+		     const struct sockaddr *addr, socklen_t addrlen,
+		     void (*done)(void *data, ssize_t res), void *cbdata)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_send *s;
+
+	if (addrlen > sizeof(s->addr) || size > URING_SEND_BUFSIZ) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (send_free_num == 0) {
+		uring.stats.send_busy++;
+		errno = EBUSY;
+		return -1;
+	}
+
+	sqe = uring_get_sqe();
+	if (sqe == NULL) {
+		uring.stats.send_busy++;
+		errno = EBUSY;
+		return -1;
+	}
+	s = send_free[--send_free_num];
+
+	memcpy(s->buf, data, size);
+	memcpy(&s->addr, addr, addrlen);
+	s->req.complete = uring_send_complete;
+	s->iov.iov_base = s->buf;
+	s->iov.iov_len = size;
+	memset(&s->msg, 0, sizeof(s->msg));
+	s->msg.msg_name = &s->addr;
+	s->msg.msg_namelen = addrlen;
+	s->msg.msg_iov = &s->iov;
+	s->msg.msg_iovlen = 1;
+	s->done = done;
+	s->data = cbdata;
+	s->inflight = 1;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)&s->msg;
+	sqe->len = 1;
+	sqe->user_data = (uint64_t)(uintptr_t)s;
+
+	uring.stats.sends++;
+	uring.sends_inflight++;
+
+	return size;
+}
+
+static int uring_reap(void)
+{
+	unsigned int head, tail;
+	int n = 0;
+
+	head = *uring.cq.khead;
+	tail = __atomic_load_n(uring.cq.ktail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &uring.cq.cqes[head & uring.cq.mask];
+		struct uring_req *req = (void *)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+
+		/* release the entry before calling the handler, it may
+		 * submit new requests. */
+		head++;
+		__atomic_store_n(uring.cq.khead, head, __ATOMIC_RELEASE);
+
+		if (req)
+			req->complete(req, res);
+		n++;
+
+		tail = __atomic_load_n(uring.cq.ktail, __ATOMIC_ACQUIRE);
+	}
+	uring.stats.completed += n;
+
+	return n;
+}
+
+/*
+ * Submit the pending requests and wait for completions, at most the time
+ * specified by tv (NULL means wait forever). The handlers of the requests
+ * are called from here. Returns the number of completions reaped.
+ */
+int uring_wait(struct timeval *tv)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	if (tv) {
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+
+	uring_publish();
+	ret = uring_enter(uring.to_submit, 1,
+			  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			  &arg, sizeof(arg));
+	if (ret > 0) {
+		uring.to_submit -= ret;
+		uring.stats.submitted += ret;
+	} else if (ret == -1 && errno != ETIME && errno != EINTR)
+		return -1;
+
+	return uring_reap();
+}
+
+static int uring_send_match(const struct uring_send *s, void *cbdata)
+{
+	return s->inflight && (cbdata == NULL || s->data == cbdata);
+}
+
+static unsigned int uring_send_pending(void *cbdata)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < URING_SEND_MAX; i++) {
+		if (uring_send_match(&send_pool[i], cbdata))
+			n++;
+	}
+	return n;
+}
+
+static void uring_send_cancel(void *cbdata)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int i;
+
+	for (i = 0; i < URING_SEND_MAX; i++) {
+		if (!uring_send_match(&send_pool[i], cbdata))
+			continue;
+
+		sqe = uring_get_sqe();
+		if (sqe == NULL)
+			return;
+
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)(uintptr_t)&send_pool[i];
+		sqe->user_data = 0;
+	}
+}
+
+/*
+ * Wait for the pending sends of cbdata (NULL means all of them), eg.
+ * before closing a socket. The sends that make no progress are cancelled
+ * and, if they do not complete either, they are detached: done() is not
+ * called for them anymore, so cbdata can be released.
+ */
+void uring_flush(void *cbdata)
+{
+	struct timeval tv = { .tv_usec = 100000 };
+	unsigned int i, n, pending;
+	int cancelled = 0;
+
+	if (!uring.enabled)
+		return;
+
+	pending = uring_send_pending(cbdata);
+	while (pending > 0) {
+		uring_wait(&tv);
+		n = uring_send_pending(cbdata);
+		if (n == pending) {
+			if (cancelled)
+				break;
+			uring_send_cancel(cbdata);
+			cancelled = 1;
+		}
+		pending = n;
+	}
+
+	for (i = 0; i < URING_SEND_MAX; i++) {
+		if (uring_send_match(&send_pool[i], cbdata))
+			send_pool[i].done = NULL;
+	}
+}
+
+void uring_get_stats(struct uring_stats *stats)
+{
+	memcpy(stats, &uring.stats, sizeof(struct uring_stats));
+}
+
+#else /* !HAVE_LINUX_IO_URING_H */
+
+int uring_init(unsigned int entries)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void uring_fini(void) {}
+
+int uring_enabled(void)
+{
+	return 0;
+}
+
+int uring_poll_add(int fd, uint32_t events, struct uring_req *req)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int uring_poll_remove(struct uring_req *req)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+ssize_t uring_sendto(int fd, const void *data, size_t size,
+		     const struct sockaddr *addr, socklen_t addrlen,
+		     void (*done)(void *data, ssize_t res), void *cbdata)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void uring_flush(void *cbdata) {}
+
+int uring_wait(struct timeval *tv)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void uring_get_stats(struct uring_stats *stats)
+{
+	memset(stats, 0, sizeof(struct uring_stats));
+}
+
+#endif
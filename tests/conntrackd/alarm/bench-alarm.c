@@ -0,0 +1,144 @@
+/*
+ * Micro-benchmark for the alarm subsystem: compares the red-black tree
+ * and the hashed timer wheel with millions of armed timers.
+ *
+ * gcc -O2 -I../../../include bench-alarm.c ../../../src/alarm.c \
+ *	../../../src/rbtree.c -o bench-alarm
+ *
+ * ./bench-alarm [number of timers]
+ *
+ * This code is released under GPLv2 or any later at your option.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alarm.h"
+#include "date.h"
+
+/*
+ * We control the clock, so expiration does not need real time to pass.
+ * It never goes backwards, the timer wheel does not expect it.
+ */
+static struct timeval now = { .tv_sec = 1000000 };
+
+int do_gettime(void)
+{
+	return 0;
+}
+
+void gettime_cached(struct timeval *tv)
+{
+	memcpy(tv, &now, sizeof(struct timeval));
+}
+
+int time_cached(void)
+{
+	return now.tv_sec;
+}
+
+static unsigned int expired;
+
+static void alarm_cb(struct alarm_block *a, void *data)
+{
+	expired++;
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	return (stop.tv_sec - start->tv_sec) +
+	       (stop.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int bench(enum alarm_type type, const char *name, unsigned int n)
+{
+	struct alarm_block *alarms;
+	struct timeval next;
+	struct timespec start;
+	unsigned int i;
+	double t_add, t_rearm, t_del, t_run;
+	int steps = 0;
+
+	expired = 0;
+
+	if (alarm_set_type(type) == -1) {
+		fprintf(stderr, "cannot set alarm type %s\n", name);
+		return -1;
+	}
+
+	alarms = calloc(n, sizeof(struct alarm_block));
+	if (alarms == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++)
+		init_alarm(&alarms[i], NULL, alarm_cb);
+
+	srandom(1);
+
+	/* initial arm, timeouts spread over 10 minutes like cache entries. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++)
+		add_alarm(&alarms[i], 1 + random() % 600, random() % 1000000);
+	t_add = elapsed(&start);
+
+	/* re-arm every timer as cache_update() does on each event. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++)
+		add_alarm(&alarms[random() % n], 1 + random() % 600, 0);
+	t_rearm = elapsed(&start);
+
+	/* disarm one out of ten, like destroy events do. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i += 10)
+		del_alarm(&alarms[i]);
+	t_del = elapsed(&start);
+
+	/* let time pass until all timers have expired. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (get_next_alarm_run(&next) != NULL) {
+		timeradd(&now, &next, &now);
+		do_alarm_run(&next);
+		steps++;
+	}
+	t_run = elapsed(&start);
+
+	printf("%-8s %8u timers: add %.3fs rearm %.3fs del %.3fs "
+	       "expire %.3fs (%d wakeups)\n",
+	       name, n, t_add, t_rearm, t_del, t_run, steps);
+
+	if (expired != n - (n + 9) / 10) {
+		fprintf(stderr, "%s: %u timers expired, expected %u\n",
+			name, expired, n - (n + 9) / 10);
+		free(alarms);
+		return -1;
+	}
+	free(alarms);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int sizes[] = { 1000000, 4000000 };
+	unsigned int i, num = sizeof(sizes) / sizeof(sizes[0]);
+	int ret = EXIT_SUCCESS;
+
+	if (argc > 1) {
+		sizes[0] = strtoul(argv[1], NULL, 10);
+		num = 1;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (bench(ALARM_T_RBTREE, "rbtree", sizes[i]) == -1)
+			ret = EXIT_FAILURE;
+		if (bench(ALARM_T_WHEEL, "wheel", sizes[i]) == -1)
+			ret = EXIT_FAILURE;
+	}
+	return ret;
+}
@@ -0,0 +1,5 @@
+#!/bin/bash
+
+gcc -O2 -Wall -I../../../include bench-alarm.c ../../../src/alarm.c \
+	../../../src/rbtree.c -o bench-alarm || exit 1
+./bench-alarm $@
@@ -0,0 +1,198 @@
+/*
+ * Micro-benchmark for the hashtable: compares the chained and the open
+ * addressing implementations with millions of entries, with a fixed size
+ * and growing from a small table. Objects look like
+ * cache objects, the key lives in a separate allocation as it happens
+ * with struct nf_conntrack, so every compare() is a pointer chase.
+ *
+ * gcc -O2 -I../../../include bench-hash.c ../../../src/hash.c -o bench-hash
+ *
+ * ./bench-hash [number of entries]
+ *
+ * This code is released under GPLv2 or any later at your option.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+#include "jhash.h"
+
+struct key {
+	uint32_t	addr[2];
+	uint32_t	ports;
+	uint32_t	id;
+};
+
+struct object {
+	struct hashtable_node	node;
+	struct key		*key;
+};
+
+static uint32_t hash(const void *data, const struct hashtable *table)
+{
+	return jhash2(data, 4, 0);
+}
+
+static int compare(const void *data1, const void *data2)
+{
+	const struct object *obj = data1;
+
+	return memcmp(obj->key, data2, sizeof(struct key)) == 0;
+}
+
+static int count_cb(void *data, void *n)
+{
+	(*(unsigned int *)data)++;
+	return 0;
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	return (stop.tv_sec - start->tv_sec) +
+	       (stop.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void key_init(struct key *k, unsigned int i)
+{
+	k->addr[0] = 0x0a000000 | (i >> 8);
+	k->addr[1] = 0xc0a80000 | (i & 0xff);
+	k->ports = (i * 2654435761U) & 0xffff;
+	k->id = i;
+}
+
+static int bench(const char *name, unsigned int flags, unsigned int size,
+		 unsigned int n)
+{
+	struct hashtable *h;
+	struct object *objs;
+	struct key *keys, miss;
+	struct timespec start;
+	unsigned int i, *order, found = 0, visited = 0, stepped = 0;
+	uint32_t cursor = 0;
+	double t_add, t_hit, t_miss, t_del;
+
+	h = hashtable_create(size, n, flags, hash, compare);
+	objs = calloc(n, sizeof(struct object));
+	keys = malloc(n * sizeof(struct key));
+	order = malloc(n * sizeof(unsigned int));
+	if (h == NULL || objs == NULL || keys == NULL || order == NULL) {
+		perror("alloc");
+		return -1;
+	}
+
+	/* the keys are shuffled, so lookups do not walk memory in order. */
+	for (i = 0; i < n; i++)
+		order[i] = i;
+	srandom(1);
+	for (i = n - 1; i > 0; i--) {
+		unsigned int j = random() % (i + 1), tmp = order[i];
+
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (i = 0; i < n; i++) {
+		key_init(&keys[order[i]], i);
+		objs[i].key = &keys[order[i]];
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		if (hashtable_add(h, &objs[i].node,
+				  hashtable_hash(h, objs[i].key)) == -1) {
+			fprintf(stderr, "%s: cannot add entry %u\n", name, i);
+			return -1;
+		}
+	}
+	t_add = elapsed(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		struct key *k = objs[order[i]].key;
+
+		if (hashtable_find(h, k, hashtable_hash(h, k)))
+			found++;
+	}
+	t_hit = elapsed(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		key_init(&miss, i);
+		miss.id = n + i;
+		if (hashtable_find(h, &miss, hashtable_hash(h, &miss)))
+			found++;
+	}
+	t_miss = elapsed(&start);
+
+	/* release half of them, and check that the other half is there. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i += 2)
+		hashtable_del(h, &objs[i].node);
+	t_del = elapsed(&start);
+
+	for (i = 1; i < n; i += 2) {
+		if (!hashtable_find(h, objs[i].key,
+				    hashtable_hash(h, objs[i].key)))
+			found = 0;
+	}
+	hashtable_iterate(h, &visited, count_cb);
+
+	/* iterate in steps, adding and removing entries in between so that
+	 * the table is resized while we are walking over it. */
+	for (i = 0; i < n; i += 2)
+		hashtable_add(h, &objs[i].node, hashtable_hash(h, objs[i].key));
+	i = 0;
+	while (hashtable_iterate_limit(h, &stepped, &cursor, 64,
+				       count_cb) > 0) {
+		if (i < n) {
+			hashtable_del(h, &objs[i].node);
+			hashtable_add(h, &objs[i].node,
+				      hashtable_hash(h, objs[i].key));
+			i += 2;
+		}
+	}
+
+	printf("%-8s %8u entries %8u buckets: add %.3fs hit %.3fs "
+	       "miss %.3fs del %.3fs\n",
+	       name, n, h->hashsize, t_add, t_hit, t_miss, t_del);
+
+	if (found != n || visited != n / 2 || hashtable_counter(h) != n) {
+		fprintf(stderr, "%s: found %u, visited %u, counter %u\n",
+			name, found, visited, hashtable_counter(h));
+		return -1;
+	}
+	hashtable_destroy(h);
+	free(objs);
+	free(keys);
+	free(order);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int n = 2000000;
+	int ret = EXIT_SUCCESS;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 10);
+
+	/* HashSize is usually a quarter of HashLimit. */
+	if (bench("chained", 0, n / 4, n) == -1)
+		ret = EXIT_FAILURE;
+	if (bench("chained", 0, n, n) == -1)
+		ret = EXIT_FAILURE;
+	if (bench("open", HASHTABLE_F_OPEN, n / 4, n) == -1)
+		ret = EXIT_FAILURE;
+	if (bench("chained+", HASHTABLE_F_RESIZE, 1024, n) == -1)
+		ret = EXIT_FAILURE;
+	if (bench("open+", HASHTABLE_F_OPEN | HASHTABLE_F_RESIZE,
+		  1024, n) == -1)
+		ret = EXIT_FAILURE;
+
+	return ret;
+}
@@ -0,0 +1,5 @@
+#!/bin/bash
+
+gcc -O2 -Wall -I../../../include bench-hash.c ../../../src/hash.c \
+	-o bench-hash || exit 1
+./bench-hash $@
@@ -0,0 +1,42 @@
+#!/bin/bash
+#
+# Resync with an idle kernel table: none of the entries changed, so all of
+# them have to be reported as unchanged, see `conntrackd -s runtime'.
+#
+
+UID=`id -u`
+if [ $UID -ne 0 ]
+then
+	echo "Run this test as root"
+	exit 1
+fi
+
+CONNTRACKD="../../../src/conntrackd -C conntrackd.conf"
+ENTRIES=${1:-256}
+
+conntrack -F
+$CONNTRACKD -d || exit 1
+sleep 1
+
+for i in `seq 1 $ENTRIES`
+do
+	conntrack -I -p udp -s 10.0.$((i / 256)).$((i % 256)) -d 10.1.0.1 \
+		--sport 1024 --dport 53 -t 600 > /dev/null 2>&1
+done
+
+# let the timeouts tick, they differ from the cached ones now.
+sleep 2
+$CONNTRACKD -R
+sleep 1
+
+UNCHANGED=`$CONNTRACKD -s runtime | awk '/entries unchanged/ { print $3 }'`
+$CONNTRACKD -k
+conntrack -F
+
+echo "entries: $ENTRIES unchanged: $UNCHANGED"
+if [ -z "$UNCHANGED" ] || [ $UNCHANGED -lt $ENTRIES ]
+then
+	echo "FAIL"
+	exit 1
+fi
+echo "OK"